@@ -0,0 +1,111 @@
+#!/bin/sh
+# End-to-end checks against a local mapius-test-server, run by "make check".
+
+set -e
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/mapius-check-XXXXXX")
+server_pid=
+
+cleanup ()
+{
+	[ -z "$server_pid" ] || kill "$server_pid" 2>/dev/null || true
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+fail ()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+./mapius-test-server --port 0 --host-latency 127.0.0.2=2000 > "$tmp/server.log" &
+server_pid=$!
+
+port=
+for i in $(seq 50); do
+	port=$(sed -n 's/^Listening on port //p' "$tmp/server.log")
+	[ -z "$port" ] || break
+	kill -0 "$server_pid" 2>/dev/null || fail "mapius-test-server exited"
+	sleep 0.1
+done
+[ -n "$port" ] || fail "mapius-test-server did not start"
+
+mkdir "$tmp/maps"
+cat > "$tmp/maps/check.py" <<END
+title = 'Check'
+format = 'png'
+proj = 3857
+url_template = 'http://127.0.0.1:$port/{z}/{x}/{y}.png'
+END
+cat > "$tmp/maps/mirror.py" <<END
+title = 'Mirror'
+format = 'png'
+proj = 3857
+url_template = 'http://127.0.0.1:$port/{z}/{x}/{y}.png'
+mirrors = ['127.0.0.1', '127.0.0.2']
+END
+
+# write_config NAME FORMAT
+write_config ()
+{
+	cat > "$tmp/$1.ini" <<END
+[Paths]
+Cache = $tmp/cache-$1
+CacheFormat = $2
+CacheMaxSize = 0
+Maps = $tmp/maps
+
+[Cache]
+DefaultMaxAge = 604800
+
+[Network]
+UserAgent = mapius-check
+END
+}
+
+# seed NAME MAP_ID [ARGS...]; prints the output one progress report per line
+seed ()
+{
+	name=$1
+	map_id=$2
+	shift 2
+	./mapius-seed --config "$tmp/$name.ini" --bbox -10,-10,10,10 -z 0 -Z 6 "$@" "$map_id" \
+		| tr '\r' '\n' | grep -v '^$'
+}
+
+# final_report OUTPUT
+final_report ()
+{
+	echo "$1" | grep ' tiles, ' | tail -n 1
+}
+
+# host_requests OUTPUT HOST
+host_requests ()
+{
+	echo "$1" | sed -n "s/^$2: \([0-9]*\) requests.*/\1/p"
+}
+
+for format in files pack; do
+	write_config "$format" "$format"
+
+	report=$(final_report "$(seed "$format" check)")
+	echo "$report" | grep -q '^\([0-9]*\)/\1 tiles, \1 downloaded, 0 present, 0 failed' \
+		|| fail "first seed into $format cache: $report"
+
+	report=$(final_report "$(seed "$format" check)")
+	echo "$report" | grep -q '^\([0-9]*\)/\1 tiles, 0 downloaded, \1 present, 0 failed' \
+		|| fail "second seed into $format cache did not skip every tile: $report"
+
+	echo "ok - seed resumes from a $format cache"
+done
+
+# The slow mirror answers three orders of magnitude later than the local
+# one, so even a loaded machine leaves a wide margin for the ratio below.
+write_config mirror files
+report=$(seed mirror mirror -Z 8 --host-stats)
+fast=$(host_requests "$report" 127.0.0.1)
+slow=$(host_requests "$report" 127.0.0.2)
+[ -n "$fast" ] && [ -n "$slow" ] && [ "$fast" -gt $((slow * 2)) ] \
+	|| fail "requests were not steered away from the slow mirror: $report"
+echo "ok - mirror selection prefers the faster host ($fast vs $slow requests)"
@@ -1,6 +1,15 @@
+#include <stdlib.h>
 #include <gtk/gtk.h>
 
 #include "mapius-map.h"
+#include "mapius-trace.h"
+
+static gchar *record = NULL;
+
+static GOptionEntry entries[] = {
+	{ "record", 0, 0, G_OPTION_ARG_FILENAME, &record, "Record input events to a trace file for mapius-replay", "FILE" },
+	{ NULL }
+};
 
 static void
 map_loading (MapiusMap *map, guint cnt, GtkWidget *label)
@@ -41,8 +50,13 @@ int main (int argc, char **argv, char **env)
 	GtkWidget *loading_label;
 	GtkWidget *zoom_label;
 	GtkWidget *map_label;
+	MapiusTraceRecorder *recorder = NULL;
+	GError *err = NULL;
 
-	gtk_init (&argc, &argv);
+	if (!gtk_init_with_args (&argc, &argv, NULL, entries, NULL, &err)) {
+		g_printerr ("%s\n", err ? err->message : "Cannot open display");
+		return EXIT_FAILURE;
+	}
 
 	window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title (GTK_WINDOW (window), "Mapius");
@@ -60,6 +74,14 @@ int main (int argc, char **argv, char **env)
 	gtk_widget_set_vexpand (map, TRUE);
 	gtk_grid_attach (GTK_GRID(container), map, 0, 1, 3, 1);
 
+	if (record) {
+		recorder = mapius_trace_recorder_new (MAPIUS_MAP (map), record, &err);
+		if (!recorder) {
+			g_printerr ("%s\n", err->message);
+			return EXIT_FAILURE;
+		}
+	}
+
 	GtkWidget *maps_menu = gtk_menu_new ();
 	GSList *i;
 	MapiusMapInfo *info;
@@ -75,6 +97,15 @@ int main (int argc, char **argv, char **env)
 	gtk_menu_item_set_submenu (GTK_MENU_ITEM (root_menu), maps_menu);
 	GtkWidget *menu_bar = gtk_menu_bar_new ();
 	gtk_menu_shell_append (GTK_MENU_SHELL (menu_bar), root_menu);
+
+	GtkWidget *view_menu = gtk_menu_new ();
+	GtkWidget *stats_item = gtk_check_menu_item_new_with_label ("Statistics");
+	gtk_widget_add_accelerator (stats_item, "activate", accel_group, GDK_KEY_F12, 0, GTK_ACCEL_VISIBLE);
+	g_object_bind_property (map, "show-stats", stats_item, "active", G_BINDING_BIDIRECTIONAL | G_BINDING_SYNC_CREATE);
+	gtk_menu_shell_append (GTK_MENU_SHELL (view_menu), stats_item);
+	GtkWidget *view_root_menu = gtk_menu_item_new_with_label ("View");
+	gtk_menu_item_set_submenu (GTK_MENU_ITEM (view_root_menu), view_menu);
+	gtk_menu_shell_append (GTK_MENU_SHELL (menu_bar), view_root_menu);
 	gtk_grid_attach (GTK_GRID (container), menu_bar, 0, 0, 1, 1);
 
 	loading_label = gtk_label_new ("");
@@ -98,5 +129,8 @@ int main (int argc, char **argv, char **env)
 
 	gtk_main();
 
+	if (recorder)
+		mapius_trace_recorder_free (recorder);
+
 	return 0;
 }
@@ -0,0 +1,604 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+
+#include "mapius-fixture.h"
+#include "mapius-map.h"
+#include "mapius-map-source.h"
+#include "mapius-tile-cache.h"
+#include "mapius-tile-decoder.h"
+
+#define CACHE_TILES 16384
+#define DECODE_BATCH 256
+#define URL_BATCH 1000
+#define URL_CHECKS 1000
+#define ZOOM_FRAMES 15
+#define FRAME_BUDGET (1.0 / 60)
+
+#define BENCH_MODULE \
+	"title = 'Benchmark'\n" \
+	"format = 'png'\n" \
+	"proj = 3857\n" \
+	"url_template = 'http://127.0.0.1:9/{s}/{z}/{x}/{y}.png'\n" \
+	"subdomains = 'abc'\n"
+#define BENCH_PYTHON_MODULE \
+	"title = 'Benchmark (Python)'\n" \
+	"format = 'png'\n" \
+	"proj = 3857\n" \
+	"def url(x, y, z):\n" \
+	"    return 'http://127.0.0.1:9/%s/%d/%d/%d.png' % ('abc'[(x + y) % 3], z, x, y)\n"
+
+static gdouble min_time = 0.5;
+static gchar *filter = NULL;
+static gchar *config = "mapius.ini";
+
+static GOptionEntry entries[] = {
+	{ "min-time", 't', 0, G_OPTION_ARG_DOUBLE, &min_time, "Minimum measured time per benchmark in seconds (default 0.5)", "SECONDS" },
+	{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only run benchmarks matching a glob pattern", "PATTERN" },
+	{ "config", 0, 0, G_OPTION_ARG_FILENAME, &config, "Settings file used as a base for the map view (default mapius.ini)", "FILE" },
+	{ NULL }
+};
+
+static const gint viewports[][2] = {
+	{ 640, 480 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+typedef guint64 (*BenchFunc) (gpointer data, GTimer *timer);
+
+typedef struct
+{
+	MapiusTileCache *cache;
+	cairo_surface_t *tile;
+	MapiusTileKey *keys;
+	MapiusTileKey *missing_keys;
+} CacheBench;
+
+typedef struct
+{
+	GBytes *bytes;
+	MapiusTileDecoder *decoder;
+	guint decoded;
+	GMainLoop *loop;
+} DecodeBench;
+
+typedef struct
+{
+	MapiusMapSource *source;
+	guint n;
+} UrlBench;
+
+typedef struct
+{
+	GtkWidget *window;
+	MapiusMap *map;
+	cairo_t *cr;
+	guint zoom;
+	gint x;
+	gint y;
+	gint dx;
+	gint dy;
+	guint n;
+} DrawBench;
+
+/* Returns the measured seconds per operation, or 0 if filtered out. */
+static gdouble
+run_bench (const gchar *name, const gchar *unit, BenchFunc func, gpointer data)
+{
+	guint64 ops = 0;
+	guint64 iterations = 0;
+
+	if (filter && !g_pattern_match_simple (filter, name))
+		return 0;
+
+	GTimer *timer = g_timer_new ();
+	func (data, timer);
+
+	g_timer_start (timer);
+	do {
+		ops += func (data, timer);
+		iterations++;
+	} while (g_timer_elapsed (timer, NULL) < min_time);
+
+	gdouble seconds = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	g_print ("{\"name\": \"%s\", \"unit\": \"%s\", \"iterations\": %" G_GUINT64_FORMAT ", \"ops\": %" G_GUINT64_FORMAT ", "
+		"\"seconds\": %.6f, \"ns_per_op\": %.1f, \"ops_per_sec\": %.1f}\n",
+		name, unit, iterations, ops, seconds, seconds * 1e9 / MAX (ops, 1), ops / seconds);
+
+	return seconds / MAX (ops, 1);
+}
+
+static GdkPixbuf *
+create_tile_pixbuf (void)
+{
+	GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 256, 256);
+	gint stride = gdk_pixbuf_get_rowstride (pixbuf);
+	guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+	GRand *rand = g_rand_new_with_seed (42);
+	gint x, y;
+
+	for (y = 0; y < 256; y++) {
+		for (x = 0; x < 256; x++) {
+			guchar *p = pixels + y * stride + x * 3;
+			if (x % 61 < 4 || y % 47 < 3 || (x + y) % 89 < 2) {
+				p[0] = 255;
+				p[1] = 255;
+				p[2] = 255;
+			}
+			else if ((x / 32 + y / 32) % 5 == 0) {
+				p[0] = 200 + g_rand_int_range (rand, 0, 8);
+				p[1] = 230 + g_rand_int_range (rand, 0, 8);
+				p[2] = 190;
+			}
+			else {
+				p[0] = 242;
+				p[1] = 239;
+				p[2] = 233 + g_rand_int_range (rand, 0, 3);
+			}
+		}
+	}
+
+	g_rand_free (rand);
+
+	return pixbuf;
+}
+
+static GBytes *
+encode_tile (GdkPixbuf *pixbuf, const gchar *type)
+{
+	gchar *buffer;
+	gsize size;
+	GError *err = NULL;
+
+	if (!gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, type, &err, NULL)) {
+		g_error ("Error encoding %s tile: %s", type, err->message);
+	}
+
+	return g_bytes_new_take (buffer, size);
+}
+
+static guint64
+bench_cache_insert (CacheBench *bench, GTimer *timer)
+{
+	guint i;
+
+	g_timer_stop (timer);
+	MapiusTileCache *cache = mapius_tile_cache_new (G_MAXSIZE);
+	g_timer_continue (timer);
+
+	for (i = 0; i < CACHE_TILES; i++)
+		mapius_tile_cache_insert (cache, bench->keys[i], cairo_surface_reference (bench->tile));
+
+	g_timer_stop (timer);
+	mapius_tile_cache_free (cache);
+	g_timer_continue (timer);
+
+	return CACHE_TILES;
+}
+
+static guint64
+bench_cache_lookup (CacheBench *bench, GTimer *timer)
+{
+	guint found = 0;
+	guint i;
+
+	for (i = 0; i < CACHE_TILES; i++) {
+		if (mapius_tile_cache_lookup (bench->cache, bench->keys[i]))
+			found++;
+	}
+	g_assert (found == CACHE_TILES);
+
+	return CACHE_TILES;
+}
+
+static guint64
+bench_cache_lookup_miss (CacheBench *bench, GTimer *timer)
+{
+	guint i;
+
+	for (i = 0; i < CACHE_TILES; i++) {
+		if (mapius_tile_cache_lookup (bench->cache, bench->missing_keys[i]))
+			g_assert_not_reached ();
+	}
+
+	return CACHE_TILES;
+}
+
+static guint64
+bench_cache_evict (CacheBench *bench, GTimer *timer)
+{
+	guint i;
+
+	g_timer_stop (timer);
+	MapiusTileCache *cache = mapius_tile_cache_new (G_MAXSIZE);
+	for (i = 0; i < CACHE_TILES; i++)
+		mapius_tile_cache_insert (cache, bench->keys[i], cairo_surface_reference (bench->tile));
+	mapius_tile_cache_set_budget (cache, mapius_tile_cache_get_usage (cache) / 2);
+	g_timer_continue (timer);
+
+	guint evicted = mapius_tile_cache_evict (cache);
+
+	g_timer_stop (timer);
+	mapius_tile_cache_free (cache);
+	g_timer_continue (timer);
+
+	return evicted;
+}
+
+static void
+run_cache_benches (cairo_surface_t *tile)
+{
+	CacheBench bench;
+	GRand *rand = g_rand_new_with_seed (42);
+	guint i;
+
+	bench.tile = tile;
+	bench.keys = g_new (MapiusTileKey, CACHE_TILES);
+	bench.missing_keys = g_new (MapiusTileKey, CACHE_TILES);
+	for (i = 0; i < CACHE_TILES; i++) {
+		bench.keys[i] = MAPIUS_TILE_KEY (0, 16, g_rand_int_range (rand, 0, 1 << 15) * 2, g_rand_int_range (rand, 0, 1 << 16));
+		bench.missing_keys[i] = MAPIUS_TILE_KEY (0, 16, g_rand_int_range (rand, 0, 1 << 15) * 2 + 1, g_rand_int_range (rand, 0, 1 << 16));
+	}
+
+	bench.cache = mapius_tile_cache_new (G_MAXSIZE);
+	for (i = 0; i < CACHE_TILES; i++)
+		mapius_tile_cache_insert (bench.cache, bench.keys[i], cairo_surface_reference (tile));
+	for (i = CACHE_TILES - 1; i > 0; i--) {
+		guint j = g_rand_int_range (rand, 0, i + 1);
+		MapiusTileKey key = bench.keys[i];
+		bench.keys[i] = bench.keys[j];
+		bench.keys[j] = key;
+	}
+
+	run_bench ("cache/insert", "tile", (BenchFunc) bench_cache_insert, &bench);
+	run_bench ("cache/lookup-hit", "tile", (BenchFunc) bench_cache_lookup, &bench);
+	run_bench ("cache/lookup-miss", "tile", (BenchFunc) bench_cache_lookup_miss, &bench);
+	run_bench ("cache/evict", "tile", (BenchFunc) bench_cache_evict, &bench);
+
+	mapius_tile_cache_free (bench.cache);
+	g_free (bench.missing_keys);
+	g_free (bench.keys);
+	g_rand_free (rand);
+}
+
+static guint64
+bench_decode (DecodeBench *bench, GTimer *timer)
+{
+	cairo_surface_t *surface = mapius_tile_decode (bench->bytes);
+
+	g_assert (surface);
+	cairo_surface_destroy (surface);
+
+	return 1;
+}
+
+static void
+tile_decoded (MapiusTileKey key, cairo_surface_t *surface, DecodeBench *bench)
+{
+	if (surface)
+		cairo_surface_destroy (surface);
+
+	if (++bench->decoded == DECODE_BATCH)
+		g_main_loop_quit (bench->loop);
+}
+
+static guint64
+bench_decode_parallel (DecodeBench *bench, GTimer *timer)
+{
+	guint i;
+
+	bench->decoded = 0;
+	for (i = 0; i < DECODE_BATCH; i++)
+		mapius_tile_decode_job_unref (mapius_tile_decoder_push (bench->decoder, MAPIUS_TILE_KEY (0, 16, i, 0), bench->bytes));
+	g_main_loop_run (bench->loop);
+
+	return DECODE_BATCH;
+}
+
+static void
+run_decode_benches (GdkPixbuf *pixbuf)
+{
+	DecodeBench bench;
+	const gchar *types[] = { "png", "jpeg" };
+	gchar *name;
+	guint i;
+
+	bench.decoder = mapius_tile_decoder_new (0, (MapiusTileDecodedFunc) tile_decoded, &bench);
+	bench.loop = g_main_loop_new (NULL, FALSE);
+
+	for (i = 0; i < G_N_ELEMENTS (types); i++) {
+		bench.bytes = encode_tile (pixbuf, types[i]);
+
+		name = g_strdup_printf ("decode/%s", types[i]);
+		run_bench (name, "tile", (BenchFunc) bench_decode, &bench);
+		g_free (name);
+
+		name = g_strdup_printf ("decode/%s-parallel", types[i]);
+		run_bench (name, "tile", (BenchFunc) bench_decode_parallel, &bench);
+		g_free (name);
+
+		g_bytes_unref (bench.bytes);
+	}
+
+	g_main_loop_unref (bench.loop);
+	mapius_tile_decoder_free (bench.decoder);
+}
+
+static guint64
+bench_url (UrlBench *bench, GTimer *timer)
+{
+	guint i;
+
+	for (i = 0; i < URL_BATCH; i++, bench->n++) {
+		gchar *url = mapius_map_source_get_url (bench->source, 18, bench->n & 0x3ffff, (bench->n >> 3) & 0x3ffff);
+		g_free (url);
+	}
+
+	return URL_BATCH;
+}
+
+/* The template and Python modules describe the same URLs, so the two
+ * paths must agree before their timings mean anything. */
+static void
+check_url_sources (GPtrArray *sources)
+{
+	MapiusMapSource *template_source = NULL, *python_source = NULL;
+	GRand *rand = g_rand_new_with_seed (42);
+	guint i;
+
+	for (i = 0; i < sources->len; i++) {
+		MapiusMapSource *source = g_ptr_array_index (sources, i);
+		if (g_strcmp0 (source->id, "bench") == 0)
+			template_source = source;
+		else if (g_strcmp0 (source->id, "bench_python") == 0)
+			python_source = source;
+	}
+
+	if (!template_source || !python_source || !mapius_map_source_prepare (template_source) || !mapius_map_source_prepare (python_source)) {
+		g_error ("Error loading benchmark maps");
+	}
+
+	for (i = 0; i < URL_CHECKS; i++) {
+		guint zoom = i % 19;
+		guint x = g_rand_int_range (rand, 0, 1 << zoom);
+		guint y = g_rand_int_range (rand, 0, 1 << zoom);
+		gchar *expected = mapius_map_source_get_url (python_source, zoom, x, y);
+		gchar *url = mapius_map_source_get_url (template_source, zoom, x, y);
+
+		if (g_strcmp0 (expected, url) != 0) {
+			g_printerr ("URL mismatch for %u/%u/%u: %s != %s\n", zoom, x, y, url, expected);
+			exit (EXIT_FAILURE);
+		}
+
+		g_free (url);
+		g_free (expected);
+	}
+
+	g_rand_free (rand);
+}
+
+static void
+run_url_benches (const gchar *dir)
+{
+	UrlBench bench;
+	GError *err = NULL;
+	guint i;
+
+	gchar *maps_dir = g_build_filename (dir, "maps", NULL);
+	gchar *manifest_file = g_build_filename (dir, "url.manifest", NULL);
+	GPtrArray *sources = mapius_map_source_load_all (maps_dir, manifest_file, &err);
+	if (!sources) {
+		g_error ("Error loading benchmark maps: %s", err->message);
+	}
+
+	check_url_sources (sources);
+
+	for (i = 0; i < sources->len; i++) {
+		bench.source = g_ptr_array_index (sources, i);
+		bench.n = 0;
+		if (!mapius_map_source_prepare (bench.source))
+			continue;
+
+		gchar *name = g_strdup_printf ("url/%s", g_strcmp0 (bench.source->id, "bench") == 0 ? "template" : "python");
+		run_bench (name, "url", (BenchFunc) bench_url, &bench);
+		g_free (name);
+	}
+
+	g_free (manifest_file);
+	g_free (maps_dir);
+}
+
+static guint64
+bench_draw (DrawBench *bench, GTimer *timer)
+{
+	if (bench->dx || bench->dy) {
+		g_timer_stop (timer);
+		bench->n++;
+		mapius_map_set_view (bench->map, bench->zoom, bench->x + bench->dx * (bench->n % 2), bench->y + bench->dy * (bench->n % 2));
+		g_timer_continue (timer);
+	}
+
+	gtk_widget_draw (GTK_WIDGET (bench->map), bench->cr);
+
+	return 1;
+}
+
+static void
+run_draw_bench (DrawBench *bench, const gchar *kind, guint zoom, gint tile_zoom, gint dx, gint dy, cairo_surface_t *tile)
+{
+	gint width = gtk_widget_get_allocated_width (GTK_WIDGET (bench->map));
+	gint height = gtk_widget_get_allocated_height (GTK_WIDGET (bench->map));
+	gdouble scale = ldexp (1, tile_zoom - (gint) zoom);
+	gint64 x, y;
+
+	bench->zoom = zoom;
+	bench->x = (1 << zoom) * 128 + 37;
+	bench->y = (1 << zoom) * 96 + 11;
+	bench->dx = dx;
+	bench->dy = dy;
+	bench->n = 0;
+
+	gint64 left = (bench->x - width / 2) * scale / 256;
+	gint64 top = (bench->y - height / 2) * scale / 256;
+	gint64 right = (bench->x + width / 2 + dx) * scale / 256;
+	gint64 bottom = (bench->y + height / 2 + dy) * scale / 256;
+	for (y = MAX (top - 1, 0); y <= bottom + 1; y++) {
+		for (x = MAX (left - 1, 0); x <= right + 1; x++)
+			mapius_map_insert_tile (bench->map, tile_zoom, x, y, tile);
+	}
+
+	mapius_map_set_view (bench->map, zoom, bench->x, bench->y);
+
+	gchar *name = g_strdup_printf ("draw/%s/%dx%d", kind, width, height);
+	run_bench (name, "frame", (BenchFunc) bench_draw, bench);
+	g_free (name);
+}
+
+/* Steps through the frames of a zoom-in animation, where the view starts
+ * drawn at half scale and render_scaled() covers four times the widget. */
+static guint64
+bench_zoom (DrawBench *bench, GTimer *timer)
+{
+	g_timer_stop (timer);
+	bench->n++;
+	mapius_map_set_zoom_scale (bench->map, 0.5 + 0.5 * (bench->n % ZOOM_FRAMES) / ZOOM_FRAMES);
+	g_timer_continue (timer);
+
+	gtk_widget_draw (GTK_WIDGET (bench->map), bench->cr);
+
+	return 1;
+}
+
+static void
+run_zoom_bench (DrawBench *bench, guint zoom, cairo_surface_t *tile)
+{
+	gint width = gtk_widget_get_allocated_width (GTK_WIDGET (bench->map));
+	gint height = gtk_widget_get_allocated_height (GTK_WIDGET (bench->map));
+	gint64 x, y;
+
+	bench->zoom = zoom;
+	bench->x = (1 << zoom) * 128 + 37;
+	bench->y = (1 << zoom) * 96 + 11;
+	bench->n = 0;
+
+	for (y = MAX ((bench->y - height) / 256 - 1, 0); y <= (bench->y + height) / 256 + 1; y++) {
+		for (x = MAX ((bench->x - width) / 256 - 1, 0); x <= (bench->x + width) / 256 + 1; x++)
+			mapius_map_insert_tile (bench->map, zoom, x, y, tile);
+	}
+
+	mapius_map_set_view (bench->map, zoom, bench->x, bench->y);
+
+	gchar *name = g_strdup_printf ("draw/zoom-scaled/%dx%d", width, height);
+	gdouble frame_time = run_bench (name, "frame", (BenchFunc) bench_zoom, bench);
+	if (frame_time > FRAME_BUDGET)
+		g_printerr ("%s: %.1f ms per frame exceeds the 60 fps budget of %.1f ms\n", name, frame_time * 1e3, FRAME_BUDGET * 1e3);
+	g_free (name);
+
+	mapius_map_set_zoom_scale (bench->map, 1.0);
+}
+
+static void
+run_draw_benches (cairo_surface_t *tile)
+{
+	DrawBench bench;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (viewports); i++) {
+		gint width = viewports[i][0];
+		gint height = viewports[i][1];
+
+		bench.window = gtk_offscreen_window_new ();
+		bench.map = MAPIUS_MAP (mapius_map_new ());
+		gtk_widget_set_size_request (GTK_WIDGET (bench.map), width, height);
+		gtk_container_add (GTK_CONTAINER (bench.window), GTK_WIDGET (bench.map));
+		gtk_widget_show_all (bench.window);
+		while (gtk_events_pending ())
+			gtk_main_iteration ();
+
+		cairo_surface_t *target = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+		bench.cr = cairo_create (target);
+
+		run_draw_bench (&bench, "blit", 12, 12, 0, 0, tile);
+		run_draw_bench (&bench, "pan", 12, 12, 17, 9, tile);
+		run_draw_bench (&bench, "full", 12, 12, width, 0, tile);
+		run_draw_bench (&bench, "fallback-parent", 15, 14, width, 0, tile);
+		run_draw_bench (&bench, "fallback-children", 9, 10, width, 0, tile);
+		run_zoom_bench (&bench, 13, tile);
+
+		cairo_destroy (bench.cr);
+		cairo_surface_destroy (target);
+		gtk_widget_destroy (bench.window);
+	}
+}
+
+static gchar *
+create_fixture (void)
+{
+	GKeyFile *settings;
+	gchar *dir = mapius_fixture_new ("bench", config, &settings);
+
+	mapius_fixture_add_map (dir, "bench", BENCH_MODULE);
+	mapius_fixture_add_map (dir, "bench_python", BENCH_PYTHON_MODULE);
+
+	g_key_file_set_integer (settings, "Cache", "MemorySize", 4096);
+	g_key_file_set_boolean (settings, "Cache", "PrefetchZoom", FALSE);
+	g_key_file_set_integer (settings, "Cache", "PrefetchMargin", 0);
+	mapius_fixture_save_settings (dir, settings);
+	g_key_file_free (settings);
+
+	return dir;
+}
+
+int main (int argc, char **argv)
+{
+	GError *err = NULL;
+
+	GOptionContext *context = g_option_context_new ("- benchmark rendering, tile cache, decoding and URL generation");
+	g_option_context_set_summary (context,
+		"Each benchmark prints one JSON object per line with its name, the number\n"
+		"of operations, elapsed seconds, ns_per_op and ops_per_sec.");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	gboolean have_display = gtk_init_check (&argc, &argv);
+
+	gchar *cwd = g_get_current_dir ();
+	gchar *dir = create_fixture ();
+
+	GdkPixbuf *pixbuf = create_tile_pixbuf ();
+	GBytes *png = encode_tile (pixbuf, "png");
+	cairo_surface_t *tile = mapius_tile_decode (png);
+	g_bytes_unref (png);
+
+	run_cache_benches (tile);
+	run_decode_benches (pixbuf);
+	run_url_benches (dir);
+
+	if (have_display) {
+		if (g_chdir (dir) != 0) {
+			g_error ("Error changing to %s", dir);
+		}
+		run_draw_benches (tile);
+		g_chdir (cwd);
+	}
+	else {
+		g_printerr ("No display, skipping draw benchmarks\n");
+	}
+
+	cairo_surface_destroy (tile);
+	g_object_unref (pixbuf);
+	mapius_fixture_free (dir);
+	g_free (cwd);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+
+#include "mapius-cache-index.h"
+#include "mapius-tile-table.h"
+
+typedef struct _Entry Entry;
+
+struct _Entry
+{
+	MapiusTileKey key;
+	guint64 size;
+	const gchar *format;
+	gboolean scanned;
+	Entry *prev;
+	Entry *next;
+};
+
+typedef struct
+{
+	gchar *id;
+	guint64 usage;
+} MapRecord;
+
+struct _MapiusCacheIndex
+{
+	GMutex lock;
+	MapiusTileTable *entries;
+	Entry *head;
+	Entry *tail;
+	GHashTable *map_ids;
+	GPtrArray *maps;
+	guint64 usage;
+	gboolean dirty;
+	gboolean touched;
+};
+
+static void
+entry_unlink (MapiusCacheIndex *index, Entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		index->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		index->tail = entry->prev;
+}
+
+static void
+entry_push_head (MapiusCacheIndex *index, Entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = index->head;
+	if (index->head)
+		index->head->prev = entry;
+	else
+		index->tail = entry;
+	index->head = entry;
+}
+
+static void
+entry_push_tail (MapiusCacheIndex *index, Entry *entry)
+{
+	entry->next = NULL;
+	entry->prev = index->tail;
+	if (index->tail)
+		index->tail->next = entry;
+	else
+		index->head = entry;
+	index->tail = entry;
+}
+
+static Entry *
+entry_new (MapiusCacheIndex *index, MapiusTileKey key)
+{
+	Entry *entry = g_new (Entry, 1);
+
+	entry->key = key;
+	entry->size = 0;
+	entry->format = NULL;
+	entry->scanned = FALSE;
+	mapius_tile_table_insert (index->entries, key, entry);
+
+	return entry;
+}
+
+static void
+entry_remove (MapiusCacheIndex *index, Entry *entry)
+{
+	MapRecord *map = g_ptr_array_index (index->maps, MAPIUS_TILE_KEY_MAP (entry->key));
+
+	entry_unlink (index, entry);
+	mapius_tile_table_remove (index->entries, entry->key);
+	map->usage -= entry->size;
+	index->usage -= entry->size;
+	g_free (entry);
+}
+
+static void
+map_record_free (MapRecord *map)
+{
+	g_free (map->id);
+	g_free (map);
+}
+
+static gint
+find_map (MapiusCacheIndex *index, const gchar *map_id)
+{
+	return GPOINTER_TO_INT (g_hash_table_lookup (index->map_ids, map_id)) - 1;
+}
+
+static guint
+get_map (MapiusCacheIndex *index, const gchar *map_id)
+{
+	gint i = find_map (index, map_id);
+	MapRecord *map;
+
+	if (i < 0) {
+		map = g_new (MapRecord, 1);
+		map->id = g_strdup (map_id);
+		map->usage = 0;
+
+		g_ptr_array_add (index->maps, map);
+		i = index->maps->len - 1;
+		g_hash_table_insert (index->map_ids, map->id, GINT_TO_POINTER (i + 1));
+	}
+
+	return i;
+}
+
+/* Formats are interned: a cache holds only a handful of distinct ones and
+ * each tile file keeps its own, so a map may mix formats on disk. */
+static void
+set_size (MapiusCacheIndex *index, Entry *entry, const gchar *format, guint64 size)
+{
+	MapRecord *map = g_ptr_array_index (index->maps, MAPIUS_TILE_KEY_MAP (entry->key));
+
+	map->usage += size - entry->size;
+	index->usage += size - entry->size;
+	entry->size = size;
+	entry->format = g_intern_string (format);
+	entry->scanned = TRUE;
+}
+
+MapiusCacheIndex *
+mapius_cache_index_new (void)
+{
+	MapiusCacheIndex *index = g_new (MapiusCacheIndex, 1);
+
+	g_mutex_init (&index->lock);
+	index->entries = mapius_tile_table_new (NULL);
+	index->head = NULL;
+	index->tail = NULL;
+	index->map_ids = g_hash_table_new (g_str_hash, g_str_equal);
+	index->maps = g_ptr_array_new_with_free_func ((GDestroyNotify) map_record_free);
+	index->usage = 0;
+	index->dirty = FALSE;
+	index->touched = FALSE;
+
+	return index;
+}
+
+void
+mapius_cache_index_free (MapiusCacheIndex *index)
+{
+	while (index->head) {
+		Entry *entry = index->head;
+		index->head = entry->next;
+		g_free (entry);
+	}
+
+	mapius_tile_table_free (index->entries);
+	g_hash_table_destroy (index->map_ids);
+	g_ptr_array_free (index->maps, TRUE);
+	g_mutex_clear (&index->lock);
+	g_free (index);
+}
+
+void
+mapius_cache_index_touch (MapiusCacheIndex *index, const gchar *map_id, guint zoom, guint x, guint y)
+{
+	g_mutex_lock (&index->lock);
+
+	gint map = find_map (index, map_id);
+	if (map >= 0) {
+		Entry *entry = mapius_tile_table_lookup (index->entries, MAPIUS_TILE_KEY (map, zoom, x, y));
+		if (entry && entry != index->head) {
+			entry_unlink (index, entry);
+			entry_push_head (index, entry);
+			index->touched = TRUE;
+		}
+	}
+
+	g_mutex_unlock (&index->lock);
+}
+
+void
+mapius_cache_index_update (MapiusCacheIndex *index, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, guint64 size)
+{
+	g_mutex_lock (&index->lock);
+
+	MapiusTileKey key = MAPIUS_TILE_KEY (get_map (index, map_id), zoom, x, y);
+	Entry *entry = mapius_tile_table_lookup (index->entries, key);
+	if (entry)
+		entry_unlink (index, entry);
+	else
+		entry = entry_new (index, key);
+
+	set_size (index, entry, format, size);
+	entry_push_head (index, entry);
+	index->dirty = TRUE;
+
+	g_mutex_unlock (&index->lock);
+}
+
+void
+mapius_cache_index_remove (MapiusCacheIndex *index, const gchar *map_id, guint zoom, guint x, guint y)
+{
+	g_mutex_lock (&index->lock);
+
+	gint map = find_map (index, map_id);
+	if (map >= 0) {
+		Entry *entry = mapius_tile_table_lookup (index->entries, MAPIUS_TILE_KEY (map, zoom, x, y));
+		if (entry) {
+			entry_remove (index, entry);
+			index->dirty = TRUE;
+		}
+	}
+
+	g_mutex_unlock (&index->lock);
+}
+
+void
+mapius_cache_index_add_scanned (MapiusCacheIndex *index, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, guint64 size)
+{
+	g_mutex_lock (&index->lock);
+
+	MapiusTileKey key = MAPIUS_TILE_KEY (get_map (index, map_id), zoom, x, y);
+	Entry *entry = mapius_tile_table_lookup (index->entries, key);
+	if (!entry) {
+		entry = entry_new (index, key);
+		entry_push_tail (index, entry);
+		set_size (index, entry, format, size);
+		index->dirty = TRUE;
+	}
+	else if (!entry->scanned) {
+		set_size (index, entry, format, size);
+	}
+
+	g_mutex_unlock (&index->lock);
+}
+
+void
+mapius_cache_index_prune_unscanned (MapiusCacheIndex *index)
+{
+	g_mutex_lock (&index->lock);
+
+	Entry *entry = index->head;
+	while (entry) {
+		Entry *next = entry->next;
+		if (!entry->scanned) {
+			entry_remove (index, entry);
+			index->dirty = TRUE;
+		}
+		entry = next;
+	}
+
+	g_mutex_unlock (&index->lock);
+}
+
+gboolean
+mapius_cache_index_pop_oldest (MapiusCacheIndex *index, gchar **map_id, gchar **format, guint *zoom, guint *x, guint *y)
+{
+	g_mutex_lock (&index->lock);
+
+	Entry *entry = index->tail;
+	if (entry) {
+		MapRecord *map = g_ptr_array_index (index->maps, MAPIUS_TILE_KEY_MAP (entry->key));
+
+		*map_id = g_strdup (map->id);
+		*format = g_strdup (entry->format);
+		*zoom = MAPIUS_TILE_KEY_ZOOM (entry->key);
+		*x = MAPIUS_TILE_KEY_X (entry->key);
+		*y = MAPIUS_TILE_KEY_Y (entry->key);
+
+		entry_remove (index, entry);
+		index->dirty = TRUE;
+	}
+
+	g_mutex_unlock (&index->lock);
+
+	return entry != NULL;
+}
+
+guint64
+mapius_cache_index_get_usage (MapiusCacheIndex *index, const gchar *map_id)
+{
+	guint64 usage = 0;
+
+	g_mutex_lock (&index->lock);
+
+	if (map_id) {
+		gint map = find_map (index, map_id);
+		if (map >= 0)
+			usage = ((MapRecord *) g_ptr_array_index (index->maps, map))->usage;
+	}
+	else {
+		usage = index->usage;
+	}
+
+	g_mutex_unlock (&index->lock);
+
+	return usage;
+}
+
+gboolean
+mapius_cache_index_is_dirty (MapiusCacheIndex *index)
+{
+	g_mutex_lock (&index->lock);
+	gboolean dirty = index->dirty;
+	g_mutex_unlock (&index->lock);
+
+	return dirty;
+}
+
+/* Whether reads have reordered entries since the last save; unlike a
+ * change in the set of tiles this is only worth saving now and then. */
+gboolean
+mapius_cache_index_is_touched (MapiusCacheIndex *index)
+{
+	g_mutex_lock (&index->lock);
+	gboolean touched = index->touched;
+	g_mutex_unlock (&index->lock);
+
+	return touched;
+}
+
+void
+mapius_cache_index_load (MapiusCacheIndex *index, const gchar *filename)
+{
+	gchar *contents;
+	gchar **lines;
+	guint i;
+
+	if (!g_file_get_contents (filename, &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	g_mutex_lock (&index->lock);
+
+	for (i = 0; lines[i]; i++) {
+		gchar **fields = g_strsplit (lines[i], " ", -1);
+
+		if (g_strv_length (fields) == 4) {
+			guint map = get_map (index, fields[0]);
+			MapiusTileKey key = MAPIUS_TILE_KEY (map, atoi (fields[1]), atoi (fields[2]), atoi (fields[3]));
+			Entry *entry = mapius_tile_table_lookup (index->entries, key);
+
+			if (entry)
+				entry_unlink (index, entry);
+			else
+				entry = entry_new (index, key);
+			entry_push_head (index, entry);
+		}
+
+		g_strfreev (fields);
+	}
+
+	g_mutex_unlock (&index->lock);
+
+	g_strfreev (lines);
+}
+
+gboolean
+mapius_cache_index_save (MapiusCacheIndex *index, const gchar *filename, GError **error)
+{
+	GString *str = g_string_new (NULL);
+	Entry *entry;
+
+	g_mutex_lock (&index->lock);
+
+	for (entry = index->tail; entry; entry = entry->prev) {
+		MapRecord *map = g_ptr_array_index (index->maps, MAPIUS_TILE_KEY_MAP (entry->key));
+
+		g_string_append_printf (
+			str,
+			"%s %u %u %u\n",
+			map->id,
+			MAPIUS_TILE_KEY_ZOOM (entry->key),
+			MAPIUS_TILE_KEY_X (entry->key),
+			MAPIUS_TILE_KEY_Y (entry->key)
+		);
+	}
+	index->dirty = FALSE;
+	index->touched = FALSE;
+
+	g_mutex_unlock (&index->lock);
+
+	gboolean result = g_file_set_contents (filename, str->str, str->len, error);
+	g_string_free (str, TRUE);
+
+	return result;
+}
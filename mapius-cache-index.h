@@ -0,0 +1,22 @@
+#ifndef __MAPIUS_CACHE_INDEX_H__
+#define __MAPIUS_CACHE_INDEX_H__
+
+#include <glib.h>
+
+typedef struct _MapiusCacheIndex MapiusCacheIndex;
+
+MapiusCacheIndex *mapius_cache_index_new (void);
+void mapius_cache_index_free (MapiusCacheIndex *index);
+void mapius_cache_index_touch (MapiusCacheIndex *index, const gchar *map_id, guint zoom, guint x, guint y);
+void mapius_cache_index_update (MapiusCacheIndex *index, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, guint64 size);
+void mapius_cache_index_remove (MapiusCacheIndex *index, const gchar *map_id, guint zoom, guint x, guint y);
+void mapius_cache_index_add_scanned (MapiusCacheIndex *index, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, guint64 size);
+void mapius_cache_index_prune_unscanned (MapiusCacheIndex *index);
+gboolean mapius_cache_index_pop_oldest (MapiusCacheIndex *index, gchar **map_id, gchar **format, guint *zoom, guint *x, guint *y);
+guint64 mapius_cache_index_get_usage (MapiusCacheIndex *index, const gchar *map_id);
+gboolean mapius_cache_index_is_dirty (MapiusCacheIndex *index);
+gboolean mapius_cache_index_is_touched (MapiusCacheIndex *index);
+void mapius_cache_index_load (MapiusCacheIndex *index, const gchar *filename);
+gboolean mapius_cache_index_save (MapiusCacheIndex *index, const gchar *filename, GError **error);
+
+#endif
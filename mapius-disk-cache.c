@@ -0,0 +1,994 @@
+#include <string.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "mapius-cache-index.h"
+#include "mapius-disk-cache.h"
+#include "mapius-tile-pack.h"
+
+#define PACK_BATCH_SIZE 256
+#define PACK_COMPACT_MIN_DEAD (16 * 1024 * 1024)
+#define JANITOR_INTERVAL 300
+#define INDEX_TOUCH_INTERVAL 3600
+
+struct _MapiusDiskCache
+{
+	gchar *dir;
+	MapiusDiskCacheFormat format;
+	GHashTable *packs;
+	GMutex packs_lock;
+	GPtrArray *batch;
+	GThreadPool *writer;
+	GHashTable *pending;
+	GMutex pending_lock;
+	GHashTable *reading;
+	guint64 reads;
+	guint64 redundant_reads;
+	MapiusCacheIndex *index;
+	guint64 max_size;
+	gint64 default_max_age;
+	GThread *janitor;
+	GMutex janitor_lock;
+	GCond janitor_cond;
+	gboolean janitor_wake;
+	gint janitor_quit;
+};
+
+typedef enum
+{
+	WRITE_STORE,
+	WRITE_META,
+	WRITE_REMOVE,
+	WRITE_COMPACT
+} WriteAction;
+
+typedef struct
+{
+	WriteAction action;
+	gchar *map_id;
+	guint zoom;
+	guint x;
+	guint y;
+	gchar *folder;
+	gchar *filename;
+	gchar *format;
+	GBytes *bytes;
+	GBytes *meta;
+} WriteJob;
+
+typedef struct
+{
+	MapiusDiskCache *cache;
+	gchar *map_id;
+	guint zoom;
+	guint x;
+	guint y;
+	gchar *filename;
+	MapiusDiskCacheLoadFunc func;
+	gpointer data;
+	GBytes *bytes;
+	GBytes *meta;
+} LoadJob;
+
+typedef struct
+{
+	GBytes *bytes;
+	GBytes *meta;
+} PendingTile;
+
+MapiusTileMeta *
+mapius_tile_meta_new (gint64 expires, const gchar *etag, const gchar *last_modified)
+{
+	MapiusTileMeta *meta = g_new (MapiusTileMeta, 1);
+
+	meta->expires = expires;
+	meta->etag = g_strdup (etag);
+	meta->last_modified = g_strdup (last_modified);
+
+	return meta;
+}
+
+MapiusTileMeta *
+mapius_tile_meta_copy (const MapiusTileMeta *meta)
+{
+	return mapius_tile_meta_new (meta->expires, meta->etag, meta->last_modified);
+}
+
+void
+mapius_tile_meta_free (MapiusTileMeta *meta)
+{
+	g_free (meta->etag);
+	g_free (meta->last_modified);
+	g_free (meta);
+}
+
+static GBytes *
+meta_to_bytes (const MapiusTileMeta *meta)
+{
+	gchar *str = g_strdup_printf (
+		"%" G_GINT64_FORMAT "\n%s\n%s\n",
+		meta->expires,
+		meta->etag ? meta->etag : "",
+		meta->last_modified ? meta->last_modified : ""
+	);
+
+	return g_bytes_new_take (str, strlen (str));
+}
+
+static MapiusTileMeta *
+meta_from_bytes (GBytes *bytes)
+{
+	gsize size;
+	const gchar *data = g_bytes_get_data (bytes, &size);
+	gchar *str = g_strndup (data, size);
+	gchar **lines = g_strsplit (str, "\n", 4);
+	MapiusTileMeta *meta = NULL;
+
+	if (g_strv_length (lines) >= 3) {
+		meta = mapius_tile_meta_new (
+			g_ascii_strtoll (lines[0], NULL, 10),
+			*lines[1] ? lines[1] : NULL,
+			*lines[2] ? lines[2] : NULL
+		);
+	}
+
+	g_strfreev (lines);
+	g_free (str);
+
+	return meta;
+}
+
+/* Tiles cached before metadata was recorded count as fresh for the default
+ * max age from the time they were written, rather than all revalidating at
+ * once on the first run over an existing cache.  Pack records carry no
+ * time of their own, so there it is when the pack was first opened. */
+static GBytes *
+legacy_meta (MapiusDiskCache *cache, gint64 written)
+{
+	MapiusTileMeta meta = { 0, NULL, NULL };
+
+	meta.expires = written + cache->default_max_age;
+
+	return meta_to_bytes (&meta);
+}
+
+static void
+pending_tile_free (PendingTile *pending)
+{
+	g_bytes_unref (pending->bytes);
+	if (pending->meta)
+		g_bytes_unref (pending->meta);
+	g_free (pending);
+}
+
+static void
+load_job_finish (LoadJob *job)
+{
+	MapiusTileMeta *meta = job->meta ? meta_from_bytes (job->meta) : NULL;
+
+	job->func (job->bytes, meta, job->data);
+
+	if (meta)
+		mapius_tile_meta_free (meta);
+	if (job->bytes)
+		g_bytes_unref (job->bytes);
+	if (job->meta)
+		g_bytes_unref (job->meta);
+	g_free (job->map_id);
+	g_free (job->filename);
+	g_free (job);
+}
+
+static gchar *
+tile_folder (MapiusDiskCache *cache, const gchar *map_id, guint zoom, guint x)
+{
+	return g_strdup_printf (
+		"%s%c%s%c%d%c%d",
+		cache->dir,
+		G_DIR_SEPARATOR,
+		map_id,
+		G_DIR_SEPARATOR,
+		zoom,
+		G_DIR_SEPARATOR,
+		x
+	);
+}
+
+static gchar *
+tile_filename (const gchar *folder, const gchar *format, guint y)
+{
+	return g_strdup_printf ("%s%c%d.%s", folder, G_DIR_SEPARATOR, y, format);
+}
+
+static MapiusTilePack *
+get_pack (MapiusDiskCache *cache, const gchar *map_id)
+{
+	GError *err = NULL;
+
+	g_mutex_lock (&cache->packs_lock);
+
+	MapiusTilePack *pack = g_hash_table_lookup (cache->packs, map_id);
+	if (!pack && !g_hash_table_contains (cache->packs, map_id)) {
+		gchar *dir = g_build_filename (cache->dir, map_id, NULL);
+
+		pack = mapius_tile_pack_open (dir, &err);
+		if (err) {
+			g_warning ("Error opening tile pack: %s", err->message);
+			g_error_free (err);
+		}
+		g_hash_table_insert (cache->packs, g_strdup (map_id), pack);
+
+		g_free (dir);
+	}
+
+	g_mutex_unlock (&cache->packs_lock);
+
+	return pack;
+}
+
+static void
+write_job_free (WriteJob *job)
+{
+	g_free (job->map_id);
+	g_free (job->folder);
+	g_free (job->filename);
+	g_free (job->format);
+	if (job->bytes)
+		g_bytes_unref (job->bytes);
+	if (job->meta)
+		g_bytes_unref (job->meta);
+	g_free (job);
+}
+
+static void
+tile_stored (MapiusDiskCache *cache, WriteJob *job)
+{
+	mapius_cache_index_update (cache->index, job->map_id, job->format, job->zoom, job->x, job->y, g_bytes_get_size (job->bytes));
+
+	if (cache->max_size && mapius_cache_index_get_usage (cache->index, NULL) > cache->max_size) {
+		g_mutex_lock (&cache->janitor_lock);
+		cache->janitor_wake = TRUE;
+		g_cond_signal (&cache->janitor_cond);
+		g_mutex_unlock (&cache->janitor_lock);
+	}
+}
+
+static gboolean
+keep_tile (guint zoom, guint x, guint y, guint64 size, gpointer data)
+{
+	return TRUE;
+}
+
+static void
+write_job_done (WriteJob *job, MapiusDiskCache *cache)
+{
+	g_mutex_lock (&cache->pending_lock);
+	PendingTile *pending = g_hash_table_lookup (cache->pending, job->filename);
+	if (pending && pending->bytes == job->bytes)
+		g_hash_table_remove (cache->pending, job->filename);
+	g_mutex_unlock (&cache->pending_lock);
+
+	write_job_free (job);
+}
+
+static void
+flush_batch (MapiusDiskCache *cache)
+{
+	GError *err = NULL;
+	guint i;
+
+	for (i = 0; i < cache->batch->len; i++) {
+		WriteJob *job = g_ptr_array_index (cache->batch, i);
+		MapiusTilePack *pack = get_pack (cache, job->map_id);
+
+		if (pack && !mapius_tile_pack_flush (pack, &err)) {
+			g_warning ("Error writing tile pack: %s", err->message);
+			g_clear_error (&err);
+		}
+	}
+
+	g_ptr_array_foreach (cache->batch, (GFunc) write_job_done, cache);
+	g_ptr_array_set_size (cache->batch, 0);
+}
+
+/* Removed and superseded records stay in a pack as dead space; rewriting
+ * it only pays off once that is a sizeable share of the file. */
+static void
+compact_pack (MapiusDiskCache *cache, const gchar *map_id)
+{
+	GError *err = NULL;
+	guint64 total;
+
+	MapiusTilePack *pack = get_pack (cache, map_id);
+	if (!pack)
+		return;
+
+	flush_batch (cache);
+
+	guint64 dead = mapius_tile_pack_get_dead_size (pack, &total);
+	if (dead < PACK_COMPACT_MIN_DEAD || dead < total / 4)
+		return;
+
+	g_debug ("Compacting tile pack for %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes dead", map_id, dead, total);
+	if (!mapius_tile_pack_compact (pack, keep_tile, NULL, &err)) {
+		g_warning ("Error compacting tile pack: %s", err->message);
+		g_error_free (err);
+	}
+}
+
+static void
+write_tile (WriteJob *job, MapiusDiskCache *cache)
+{
+	GError *err = NULL;
+
+	if (job->action == WRITE_COMPACT) {
+		compact_pack (cache, job->map_id);
+		write_job_free (job);
+		return;
+	}
+
+	if (job->action == WRITE_REMOVE)
+		mapius_cache_index_remove (cache->index, job->map_id, job->zoom, job->x, job->y);
+
+	if (cache->format == MAPIUS_DISK_CACHE_PACK) {
+		MapiusTilePack *pack = get_pack (cache, job->map_id);
+
+		if (job->action == WRITE_REMOVE) {
+			if (pack && !mapius_tile_pack_remove (pack, job->zoom, job->x, job->y, &err)) {
+				g_warning ("Error writing tile pack: %s", err->message);
+				g_error_free (err);
+			}
+
+			g_ptr_array_add (cache->batch, job);
+			if (cache->batch->len >= PACK_BATCH_SIZE || g_thread_pool_unprocessed (cache->writer) == 0)
+				flush_batch (cache);
+
+			return;
+		}
+
+		if (pack && !mapius_tile_pack_append (pack, job->zoom, job->x, job->y, job->meta, job->bytes, &err)) {
+			g_warning ("Error writing tile pack: %s", err->message);
+			g_error_free (err);
+		}
+		else if (pack) {
+			tile_stored (cache, job);
+		}
+
+		g_ptr_array_add (cache->batch, job);
+		if (cache->batch->len >= PACK_BATCH_SIZE || g_thread_pool_unprocessed (cache->writer) == 0)
+			flush_batch (cache);
+
+		return;
+	}
+
+	if (job->action == WRITE_REMOVE) {
+		gchar *meta_filename = g_strconcat (job->filename, ".meta", NULL);
+
+		g_unlink (job->filename);
+		g_unlink (meta_filename);
+		g_rmdir (job->folder);
+
+		g_free (meta_filename);
+		write_job_done (job, cache);
+		return;
+	}
+
+	gsize size;
+	const gchar *data;
+
+	if (job->action == WRITE_META) {
+		gchar *meta_filename = g_strconcat (job->filename, ".meta", NULL);
+
+		data = g_bytes_get_data (job->meta, &size);
+		if (g_file_test (job->filename, G_FILE_TEST_IS_REGULAR) && !g_file_set_contents (meta_filename, data, size, &err)) {
+			g_warning ("Error writing tile metadata: %s", err->message);
+			g_error_free (err);
+		}
+
+		g_free (meta_filename);
+		write_job_done (job, cache);
+		return;
+	}
+
+	data = g_bytes_get_data (job->bytes, &size);
+
+	if (g_mkdir_with_parents (job->folder, 0755) != 0) {
+		g_warning ("Error creating tile download directory: %s", job->folder);
+	}
+	else if (!g_file_set_contents (job->filename, data, size, &err)) {
+		g_warning ("Error writing tile: %s", err->message);
+		g_error_free (err);
+	}
+	else {
+		gchar *meta_filename = g_strconcat (job->filename, ".meta", NULL);
+
+		if (job->meta) {
+			data = g_bytes_get_data (job->meta, &size);
+			if (!g_file_set_contents (meta_filename, data, size, &err)) {
+				g_warning ("Error writing tile metadata: %s", err->message);
+				g_error_free (err);
+			}
+		}
+		else {
+			g_unlink (meta_filename);
+		}
+
+		g_free (meta_filename);
+		tile_stored (cache, job);
+	}
+
+	write_job_done (job, cache);
+}
+
+static gboolean
+parse_number (const gchar *str, guint *value, const gchar **end)
+{
+	gchar *str_end;
+	guint64 result = g_ascii_strtoull (str, &str_end, 10);
+
+	if (str_end == str || result > G_MAXUINT)
+		return FALSE;
+
+	*value = result;
+	*end = str_end;
+
+	return TRUE;
+}
+
+/* A plain tile format suffix; rejects ".meta" sidecars and the temporary
+ * files g_file_set_contents() leaves behind when interrupted. */
+static gboolean
+is_format (const gchar *str)
+{
+	if (!*str)
+		return FALSE;
+
+	for (; *str; str++) {
+		if (!g_ascii_isalnum (*str))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+janitor_quit (MapiusDiskCache *cache)
+{
+	return g_atomic_int_get (&cache->janitor_quit);
+}
+
+static void
+scan_files (MapiusDiskCache *cache, const gchar *map_id, const gchar *map_dir)
+{
+	const gchar *zoom_name, *x_name, *y_name, *end;
+	guint zoom, x, y;
+	GStatBuf buf;
+
+	GDir *zoom_dir = g_dir_open (map_dir, 0, NULL);
+	if (!zoom_dir)
+		return;
+
+	while (!janitor_quit (cache) && (zoom_name = g_dir_read_name (zoom_dir))) {
+		gchar *zoom_path = g_build_filename (map_dir, zoom_name, NULL);
+		GDir *x_dir;
+
+		if (!parse_number (zoom_name, &zoom, &end) || *end || zoom > 24 || !(x_dir = g_dir_open (zoom_path, 0, NULL))) {
+			g_free (zoom_path);
+			continue;
+		}
+
+		while (!janitor_quit (cache) && (x_name = g_dir_read_name (x_dir))) {
+			gchar *x_path = g_build_filename (zoom_path, x_name, NULL);
+			GDir *y_dir;
+
+			if (!parse_number (x_name, &x, &end) || *end || !(y_dir = g_dir_open (x_path, 0, NULL))) {
+				g_free (x_path);
+				continue;
+			}
+
+			while ((y_name = g_dir_read_name (y_dir))) {
+				if (!parse_number (y_name, &y, &end) || *end != '.' || !is_format (end + 1))
+					continue;
+
+				gchar *y_path = g_build_filename (x_path, y_name, NULL);
+				if (g_stat (y_path, &buf) == 0)
+					mapius_cache_index_add_scanned (cache->index, map_id, end + 1, zoom, x, y, buf.st_size);
+				g_free (y_path);
+			}
+
+			g_dir_close (y_dir);
+			g_free (x_path);
+		}
+
+		g_dir_close (x_dir);
+		g_free (zoom_path);
+	}
+
+	g_dir_close (zoom_dir);
+}
+
+typedef struct
+{
+	MapiusDiskCache *cache;
+	const gchar *map_id;
+} ScanData;
+
+static gboolean
+scan_pack_tile (guint zoom, guint x, guint y, guint64 size, ScanData *data)
+{
+	mapius_cache_index_add_scanned (data->cache->index, data->map_id, NULL, zoom, x, y, size);
+
+	return TRUE;
+}
+
+static void
+scan_cache (MapiusDiskCache *cache)
+{
+	const gchar *name;
+
+	GDir *dir = g_dir_open (cache->dir, 0, NULL);
+	if (!dir)
+		return;
+
+	while (!janitor_quit (cache) && (name = g_dir_read_name (dir))) {
+		gchar *map_dir = g_build_filename (cache->dir, name, NULL);
+
+		if (cache->format == MAPIUS_DISK_CACHE_PACK) {
+			gchar *pack_filename = g_build_filename (map_dir, "tiles.pack", NULL);
+
+			if (g_file_test (pack_filename, G_FILE_TEST_IS_REGULAR)) {
+				MapiusTilePack *pack = get_pack (cache, name);
+				ScanData data = { cache, name };
+
+				if (pack)
+					mapius_tile_pack_foreach (pack, (MapiusTilePackFunc) scan_pack_tile, &data);
+			}
+
+			g_free (pack_filename);
+		}
+		else if (g_file_test (map_dir, G_FILE_TEST_IS_DIR)) {
+			scan_files (cache, name, map_dir);
+		}
+
+		g_free (map_dir);
+	}
+
+	g_dir_close (dir);
+}
+
+/* Removals go through the writer like stores do, so they cannot race a
+ * store into the same folder; in a pack they are batched tombstones. */
+static void
+queue_remove (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y)
+{
+	WriteJob *job = g_new0 (WriteJob, 1);
+
+	job->action = WRITE_REMOVE;
+	job->map_id = g_strdup (map_id);
+	job->zoom = zoom;
+	job->x = x;
+	job->y = y;
+	job->format = g_strdup (format);
+	job->folder = tile_folder (cache, map_id, zoom, x);
+	job->filename = tile_filename (job->folder, format ? format : "", y);
+
+	g_mutex_lock (&cache->pending_lock);
+	g_hash_table_remove (cache->pending, job->filename);
+	g_mutex_unlock (&cache->pending_lock);
+
+	g_thread_pool_push (cache->writer, job, NULL);
+}
+
+static void
+evict_tiles (MapiusDiskCache *cache)
+{
+	guint64 target = cache->max_size / 10 * 9;
+	gchar *map_id, *format;
+	guint zoom, x, y;
+	guint count = 0;
+
+	while (mapius_cache_index_get_usage (cache->index, NULL) > target
+		&& mapius_cache_index_pop_oldest (cache->index, &map_id, &format, &zoom, &x, &y)) {
+		if (cache->format == MAPIUS_DISK_CACHE_PACK || format)
+			queue_remove (cache, map_id, format, zoom, x, y);
+
+		g_free (map_id);
+		g_free (format);
+		count++;
+	}
+
+	g_debug ("Evicted %u tiles from disk cache", count);
+}
+
+/* The writer owns the packs, so the janitor only asks it to look; each job
+ * lands behind the removals already queued and compacts past a threshold. */
+static void
+queue_compaction (MapiusDiskCache *cache)
+{
+	GHashTableIter iter;
+	gpointer map_id, pack;
+
+	g_mutex_lock (&cache->packs_lock);
+	g_hash_table_iter_init (&iter, cache->packs);
+	while (g_hash_table_iter_next (&iter, &map_id, &pack)) {
+		if (!pack)
+			continue;
+
+		WriteJob *job = g_new0 (WriteJob, 1);
+		job->action = WRITE_COMPACT;
+		job->map_id = g_strdup (map_id);
+		g_thread_pool_push (cache->writer, job, NULL);
+	}
+	g_mutex_unlock (&cache->packs_lock);
+}
+
+static gpointer
+janitor_run (MapiusDiskCache *cache)
+{
+	GError *err = NULL;
+	gchar *index_filename = g_build_filename (cache->dir, "access.log", NULL);
+
+	mapius_cache_index_load (cache->index, index_filename);
+	scan_cache (cache);
+	if (!janitor_quit (cache))
+		mapius_cache_index_prune_unscanned (cache->index);
+
+	g_debug ("Disk cache usage: %" G_GUINT64_FORMAT " bytes", mapius_cache_index_get_usage (cache->index, NULL));
+
+	gint64 saved = g_get_monotonic_time ();
+
+	while (!janitor_quit (cache)) {
+		if (cache->max_size && mapius_cache_index_get_usage (cache->index, NULL) > cache->max_size)
+			evict_tiles (cache);
+
+		if (cache->format == MAPIUS_DISK_CACHE_PACK)
+			queue_compaction (cache);
+
+		/* Reads alone only reorder recency, which can wait for a while;
+		 * a rewrite of the whole log on every pass would not. */
+		gboolean save = mapius_cache_index_is_dirty (cache->index)
+			|| (mapius_cache_index_is_touched (cache->index) && g_get_monotonic_time () - saved >= INDEX_TOUCH_INTERVAL * G_TIME_SPAN_SECOND);
+
+		if (save) {
+			if (!mapius_cache_index_save (cache->index, index_filename, &err)) {
+				g_warning ("Error saving disk cache index: %s", err->message);
+				g_clear_error (&err);
+			}
+			saved = g_get_monotonic_time ();
+		}
+
+		gint64 deadline = g_get_monotonic_time () + JANITOR_INTERVAL * G_TIME_SPAN_SECOND;
+
+		g_mutex_lock (&cache->janitor_lock);
+		while (!cache->janitor_wake && !janitor_quit (cache)) {
+			if (!g_cond_wait_until (&cache->janitor_cond, &cache->janitor_lock, deadline))
+				break;
+		}
+		cache->janitor_wake = FALSE;
+		g_mutex_unlock (&cache->janitor_lock);
+	}
+
+	if ((mapius_cache_index_is_dirty (cache->index) || mapius_cache_index_is_touched (cache->index))
+		&& !mapius_cache_index_save (cache->index, index_filename, &err)) {
+		g_warning ("Error saving disk cache index: %s", err->message);
+		g_error_free (err);
+	}
+
+	g_free (index_filename);
+
+	return NULL;
+}
+
+MapiusDiskCache *
+mapius_disk_cache_new (const gchar *dir, MapiusDiskCacheFormat format, guint64 max_size, gint64 default_max_age)
+{
+	MapiusDiskCache *cache = g_new (MapiusDiskCache, 1);
+	GError *err = NULL;
+
+	cache->dir = g_strdup (dir);
+	cache->format = format;
+	cache->packs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	g_mutex_init (&cache->packs_lock);
+	cache->batch = g_ptr_array_new ();
+	cache->writer = g_thread_pool_new ((GFunc) write_tile, cache, 1, FALSE, &err);
+	if (err) {
+		g_error ("Error creating cache writer thread: %s", err->message);
+	}
+	cache->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) pending_tile_free);
+	g_mutex_init (&cache->pending_lock);
+	cache->reading = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	cache->reads = 0;
+	cache->redundant_reads = 0;
+	cache->index = mapius_cache_index_new ();
+	cache->max_size = max_size;
+	cache->default_max_age = default_max_age;
+	g_mutex_init (&cache->janitor_lock);
+	g_cond_init (&cache->janitor_cond);
+	cache->janitor_wake = FALSE;
+	cache->janitor_quit = FALSE;
+	cache->janitor = g_thread_new ("cache-janitor", (GThreadFunc) janitor_run, cache);
+
+	return cache;
+}
+
+void
+mapius_disk_cache_free (MapiusDiskCache *cache)
+{
+	GHashTableIter iter;
+	gpointer pack;
+
+	g_mutex_lock (&cache->janitor_lock);
+	g_atomic_int_set (&cache->janitor_quit, TRUE);
+	g_cond_signal (&cache->janitor_cond);
+	g_mutex_unlock (&cache->janitor_lock);
+	g_thread_join (cache->janitor);
+	g_mutex_clear (&cache->janitor_lock);
+	g_cond_clear (&cache->janitor_cond);
+
+	g_thread_pool_free (cache->writer, FALSE, TRUE);
+	flush_batch (cache);
+	g_ptr_array_free (cache->batch, TRUE);
+
+	g_hash_table_iter_init (&iter, cache->packs);
+	while (g_hash_table_iter_next (&iter, NULL, &pack)) {
+		if (pack)
+			mapius_tile_pack_close (pack);
+	}
+	g_hash_table_destroy (cache->packs);
+	g_mutex_clear (&cache->packs_lock);
+
+	g_hash_table_destroy (cache->pending);
+	g_mutex_clear (&cache->pending_lock);
+	g_hash_table_destroy (cache->reading);
+	mapius_cache_index_free (cache->index);
+	g_free (cache->dir);
+	g_free (cache);
+}
+
+static void
+tile_meta_loaded (GObject *file, GAsyncResult *res, gpointer data)
+{
+	LoadJob *job = (LoadJob *) data;
+	gchar *contents;
+	gsize length;
+	GStatBuf buf;
+
+	if (g_file_load_contents_finish (G_FILE (file), res, &contents, &length, NULL, NULL))
+		job->meta = g_bytes_new_take (contents, length);
+	else if (g_stat (job->filename, &buf) == 0)
+		job->meta = legacy_meta (job->cache, buf.st_mtime);
+
+	g_object_unref (file);
+	load_job_finish (job);
+}
+
+static void
+tile_file_loaded (GObject *file, GAsyncResult *res, gpointer data)
+{
+	LoadJob *job = (LoadJob *) data;
+	gchar *contents;
+	gsize length;
+
+	guint count = GPOINTER_TO_UINT (g_hash_table_lookup (job->cache->reading, job->filename));
+	if (count > 1)
+		g_hash_table_insert (job->cache->reading, g_strdup (job->filename), GUINT_TO_POINTER (count - 1));
+	else
+		g_hash_table_remove (job->cache->reading, job->filename);
+
+	gboolean loaded = g_file_load_contents_finish (G_FILE (file), res, &contents, &length, NULL, NULL);
+	g_object_unref (file);
+
+	if (loaded) {
+		gchar *meta_filename = g_strconcat (job->filename, ".meta", NULL);
+		GFile *meta_file = g_file_new_for_path (meta_filename);
+
+		job->bytes = g_bytes_new_take (contents, length);
+		g_file_load_contents_async (meta_file, NULL, tile_meta_loaded, job);
+
+		g_free (meta_filename);
+	}
+	else {
+		load_job_finish (job);
+	}
+}
+
+/* Returns TRUE if the map's pack has already been opened (or failed to). */
+static gboolean
+peek_pack (MapiusDiskCache *cache, const gchar *map_id, MapiusTilePack **pack)
+{
+	g_mutex_lock (&cache->packs_lock);
+	gboolean opened = g_hash_table_lookup_extended (cache->packs, map_id, NULL, (gpointer *) pack);
+	g_mutex_unlock (&cache->packs_lock);
+
+	return opened;
+}
+
+static void
+pack_tile_lookup (LoadJob *job, MapiusTilePack *pack)
+{
+	if (pack)
+		job->bytes = mapius_tile_pack_lookup (pack, job->zoom, job->x, job->y, &job->meta);
+
+	if (job->bytes && !job->meta)
+		job->meta = legacy_meta (job->cache, mapius_tile_pack_get_created (pack));
+}
+
+/* Opening a pack maps it and loads (or rebuilds) its whole index, so the
+ * first read of a map runs on a worker; later reads for the same map wait
+ * on packs_lock there until the open completes. */
+static void
+pack_tile_thread (GTask *task, gpointer source, LoadJob *job, GCancellable *cancellable)
+{
+	pack_tile_lookup (job, get_pack (job->cache, job->map_id));
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+pack_tile_loaded (GObject *source, GAsyncResult *res, gpointer data)
+{
+	load_job_finish ((LoadJob *) data);
+}
+
+static gboolean
+pending_tile_loaded (LoadJob *job)
+{
+	load_job_finish (job);
+
+	return FALSE;
+}
+
+void
+mapius_disk_cache_load_async (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, MapiusDiskCacheLoadFunc func, gpointer data)
+{
+	gchar *folder = tile_folder (cache, map_id, zoom, x);
+	gchar *filename = tile_filename (folder, format, y);
+	LoadJob *job = g_new (LoadJob, 1);
+
+	job->cache = cache;
+	job->map_id = g_strdup (map_id);
+	job->zoom = zoom;
+	job->x = x;
+	job->y = y;
+	job->filename = filename;
+	job->func = func;
+	job->data = data;
+	job->bytes = NULL;
+	job->meta = NULL;
+
+	mapius_cache_index_touch (cache->index, map_id, zoom, x, y);
+
+	g_mutex_lock (&cache->pending_lock);
+	PendingTile *pending = g_hash_table_lookup (cache->pending, filename);
+	if (pending) {
+		job->bytes = g_bytes_ref (pending->bytes);
+		if (pending->meta)
+			job->meta = g_bytes_ref (pending->meta);
+	}
+	g_mutex_unlock (&cache->pending_lock);
+
+	if (!job->bytes && cache->format == MAPIUS_DISK_CACHE_PACK) {
+		MapiusTilePack *pack;
+
+		cache->reads++;
+
+		if (peek_pack (cache, map_id, &pack)) {
+			pack_tile_lookup (job, pack);
+			g_idle_add ((GSourceFunc) pending_tile_loaded, job);
+		}
+		else {
+			GTask *task = g_task_new (NULL, NULL, pack_tile_loaded, job);
+			g_task_set_task_data (task, job, NULL);
+			g_task_run_in_thread (task, (GTaskThreadFunc) pack_tile_thread);
+			g_object_unref (task);
+		}
+	}
+	else if (job->bytes) {
+		g_idle_add ((GSourceFunc) pending_tile_loaded, job);
+	}
+	else {
+		guint count = GPOINTER_TO_UINT (g_hash_table_lookup (cache->reading, filename));
+		if (count > 0)
+			cache->redundant_reads++;
+		g_hash_table_insert (cache->reading, g_strdup (filename), GUINT_TO_POINTER (count + 1));
+		cache->reads++;
+
+		GFile *file = g_file_new_for_path (filename);
+		g_file_load_contents_async (file, NULL, tile_file_loaded, job);
+	}
+
+	g_free (folder);
+}
+
+gboolean
+mapius_disk_cache_contains (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y)
+{
+	gchar *folder = tile_folder (cache, map_id, zoom, x);
+	gchar *filename = tile_filename (folder, format, y);
+	gboolean result;
+
+	g_mutex_lock (&cache->pending_lock);
+	result = g_hash_table_contains (cache->pending, filename);
+	g_mutex_unlock (&cache->pending_lock);
+
+	if (!result && cache->format == MAPIUS_DISK_CACHE_PACK) {
+		MapiusTilePack *pack = get_pack (cache, map_id);
+		GBytes *bytes = pack ? mapius_tile_pack_lookup (pack, zoom, x, y, NULL) : NULL;
+		if (bytes) {
+			g_bytes_unref (bytes);
+			result = TRUE;
+		}
+	}
+	else if (!result) {
+		result = g_file_test (filename, G_FILE_TEST_IS_REGULAR);
+	}
+
+	g_free (filename);
+	g_free (folder);
+
+	return result;
+}
+
+void
+mapius_disk_cache_get_stats (MapiusDiskCache *cache, guint64 *reads, guint64 *redundant_reads)
+{
+	*reads = cache->reads;
+	*redundant_reads = cache->redundant_reads;
+}
+
+guint64
+mapius_disk_cache_get_usage (MapiusDiskCache *cache, const gchar *map_id)
+{
+	return mapius_cache_index_get_usage (cache->index, map_id);
+}
+
+static void
+queue_write (MapiusDiskCache *cache, WriteAction action, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, GBytes *bytes, const MapiusTileMeta *meta)
+{
+	WriteJob *job = g_new (WriteJob, 1);
+	PendingTile *pending = g_new (PendingTile, 1);
+
+	job->action = action;
+	job->map_id = g_strdup (map_id);
+	job->zoom = zoom;
+	job->x = x;
+	job->y = y;
+	job->format = g_strdup (format);
+	job->folder = tile_folder (cache, map_id, zoom, x);
+	job->filename = tile_filename (job->folder, format, y);
+	job->bytes = g_bytes_ref (bytes);
+	job->meta = meta ? meta_to_bytes (meta) : NULL;
+
+	pending->bytes = g_bytes_ref (bytes);
+	pending->meta = job->meta ? g_bytes_ref (job->meta) : NULL;
+
+	g_mutex_lock (&cache->pending_lock);
+	g_hash_table_replace (cache->pending, g_strdup (job->filename), pending);
+	g_mutex_unlock (&cache->pending_lock);
+
+	g_thread_pool_push (cache->writer, job, NULL);
+}
+
+void
+mapius_disk_cache_store (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, GBytes *bytes, const MapiusTileMeta *meta)
+{
+	queue_write (cache, WRITE_STORE, map_id, format, zoom, x, y, bytes, meta);
+}
+
+/* Refreshes only the metadata of a cached tile, e.g. after a 304.  @bytes
+ * is the cached tile itself; it is served to readers until the update
+ * lands.  A pack never patches records, so there the tile is appended
+ * again with the new metadata and the old record left to compaction. */
+void
+mapius_disk_cache_store_meta (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, GBytes *bytes, const MapiusTileMeta *meta)
+{
+	queue_write (cache, WRITE_META, map_id, format, zoom, x, y, bytes, meta);
+}
+
+/* Drops a tile, e.g. one that failed to decode.  Queued behind any pending
+ * store of the same tile so the bad bytes cannot be written back after.  In
+ * a pack this only writes a tombstone; the janitor reclaims the space. */
+void
+mapius_disk_cache_remove (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y)
+{
+	queue_remove (cache, map_id, format, zoom, x, y);
+}
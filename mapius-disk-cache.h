@@ -0,0 +1,37 @@
+#ifndef __MAPIUS_DISK_CACHE_H__
+#define __MAPIUS_DISK_CACHE_H__
+
+#include <glib.h>
+
+typedef struct _MapiusDiskCache MapiusDiskCache;
+typedef struct _MapiusTileMeta MapiusTileMeta;
+typedef void (*MapiusDiskCacheLoadFunc) (GBytes *bytes, const MapiusTileMeta *meta, gpointer data);
+
+struct _MapiusTileMeta
+{
+	gint64 expires;
+	gchar *etag;
+	gchar *last_modified;
+};
+
+typedef enum
+{
+	MAPIUS_DISK_CACHE_FILES,
+	MAPIUS_DISK_CACHE_PACK
+} MapiusDiskCacheFormat;
+
+MapiusTileMeta *mapius_tile_meta_new (gint64 expires, const gchar *etag, const gchar *last_modified);
+MapiusTileMeta *mapius_tile_meta_copy (const MapiusTileMeta *meta);
+void mapius_tile_meta_free (MapiusTileMeta *meta);
+
+MapiusDiskCache *mapius_disk_cache_new (const gchar *dir, MapiusDiskCacheFormat format, guint64 max_size, gint64 default_max_age);
+void mapius_disk_cache_free (MapiusDiskCache *cache);
+void mapius_disk_cache_load_async (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, MapiusDiskCacheLoadFunc func, gpointer data);
+gboolean mapius_disk_cache_contains (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y);
+void mapius_disk_cache_get_stats (MapiusDiskCache *cache, guint64 *reads, guint64 *redundant_reads);
+guint64 mapius_disk_cache_get_usage (MapiusDiskCache *cache, const gchar *map_id);
+void mapius_disk_cache_store (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, GBytes *bytes, const MapiusTileMeta *meta);
+void mapius_disk_cache_store_meta (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y, GBytes *bytes, const MapiusTileMeta *meta);
+void mapius_disk_cache_remove (MapiusDiskCache *cache, const gchar *map_id, const gchar *format, guint zoom, guint x, guint y);
+
+#endif
@@ -0,0 +1,356 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <cairo.h>
+
+#include "mapius-headless.h"
+#include "mapius-image-writer.h"
+#include "mapius-tile-decoder.h"
+
+static gchar *bbox = NULL;
+static gint zoom = -1;
+static gchar *output = NULL;
+static gint concurrency = 8;
+static gint threads = 0;
+static gint bands_in_flight = 2;
+static gboolean cache_only = FALSE;
+static gchar *config = "mapius.ini";
+
+static GOptionEntry entries[] = {
+	{ "bbox", 'b', 0, G_OPTION_ARG_STRING, &bbox, "Area to export", "MIN_LON,MIN_LAT,MAX_LON,MAX_LAT" },
+	{ "zoom", 'z', 0, G_OPTION_ARG_INT, &zoom, "Zoom level", "ZOOM" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Output image, .png or .tif", "FILE" },
+	{ "concurrency", 'c', 0, G_OPTION_ARG_INT, &concurrency, "Maximum number of parallel requests (default 8)", "N" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Decoder threads (default: number of processors)", "N" },
+	{ "bands", 0, 0, G_OPTION_ARG_INT, &bands_in_flight, "Tile rows loaded and decoded ahead of the writer (default 2)", "N" },
+	{ "cache-only", 0, 0, G_OPTION_ARG_NONE, &cache_only, "Do not download tiles missing from the cache", NULL },
+	{ "config", 0, 0, G_OPTION_ARG_FILENAME, &config, "Settings file (default mapius.ini)", "FILE" },
+	{ NULL }
+};
+
+typedef struct
+{
+	guint row;
+	guint pending;
+	guint32 *pixels;
+} Band;
+
+typedef struct
+{
+	MapiusHeadless *headless;
+	MapiusTileDecoder *decoder;
+	MapiusImageWriter *writer;
+	gint64 left;
+	gint64 top;
+	guint width;
+	guint height;
+	guint min_x;
+	guint max_x;
+	guint min_y;
+	guint max_y;
+	Band *bands;
+	guint next_row;
+	guint write_row;
+	guint64 tiles;
+	guint64 missing;
+	guint64 bytes;
+	gint64 start_time;
+	GError *error;
+	GMainLoop *loop;
+} Exporter;
+
+typedef struct
+{
+	Exporter *exporter;
+	guint x;
+	guint y;
+} TileRequest;
+
+static void exporter_start_band (Exporter *exporter, guint row);
+
+static Band *
+get_band (Exporter *exporter, guint row)
+{
+	return &exporter->bands[row % bands_in_flight];
+}
+
+static void
+exporter_write_bands (Exporter *exporter)
+{
+	Band *band;
+
+	while (exporter->write_row <= exporter->max_y && (band = get_band (exporter, exporter->write_row))->pending == 0) {
+		gint64 band_top = (gint64) band->row * 256;
+		guint first = MAX (exporter->top - band_top, 0);
+		guint last = MIN (exporter->top + exporter->height - band_top, 256);
+		gint stride = exporter->width * 4;
+
+		if (!exporter->error) {
+			mapius_image_writer_write_rows (exporter->writer,
+				(const guchar *) band->pixels + (gsize) first * stride,
+				stride, last - first, &exporter->error);
+		}
+
+		g_free (band->pixels);
+		band->pixels = NULL;
+
+		exporter->write_row++;
+		if (exporter->next_row <= exporter->max_y && !exporter->error)
+			exporter_start_band (exporter, exporter->next_row++);
+	}
+
+	if (exporter->write_row > exporter->max_y || (exporter->error && exporter->write_row == exporter->next_row))
+		g_main_loop_quit (exporter->loop);
+}
+
+static void
+tile_done (Exporter *exporter, guint y, gboolean found)
+{
+	if (!found)
+		exporter->missing++;
+
+	if (--get_band (exporter, y)->pending == 0)
+		exporter_write_bands (exporter);
+}
+
+static void
+blit_tile (Exporter *exporter, Band *band, cairo_surface_t *surface, gint64 offset)
+{
+	gboolean alpha = cairo_image_surface_get_format (surface) == CAIRO_FORMAT_ARGB32;
+	gint stride = cairo_image_surface_get_stride (surface);
+	const guchar *data = cairo_image_surface_get_data (surface);
+	gint first = MAX (-offset, 0);
+	gint last = MIN (cairo_image_surface_get_width (surface), exporter->width - offset);
+	gint rows = MIN (cairo_image_surface_get_height (surface), 256);
+	gint x, y;
+
+	cairo_surface_flush (surface);
+
+	for (y = 0; y < rows; y++) {
+		const guint32 *src = (const guint32 *) (data + (gsize) y * stride);
+		guint32 *dst = band->pixels + (gsize) y * exporter->width + offset;
+
+		for (x = first; x < last; x++) {
+			guint32 p = src[x];
+			guint32 a = p >> 24;
+
+			if (!alpha || a == 0xff) {
+				dst[x] = p;
+			}
+			else {
+				guint32 white = 0xff - a;
+				dst[x] = (MIN (((p >> 16) & 0xff) + white, 0xff) << 16)
+					| (MIN (((p >> 8) & 0xff) + white, 0xff) << 8)
+					| MIN ((p & 0xff) + white, 0xff);
+			}
+		}
+	}
+}
+
+static void
+tile_decoded (MapiusTileKey key, cairo_surface_t *surface, Exporter *exporter)
+{
+	guint x = MAPIUS_TILE_KEY_X (key);
+	guint y = MAPIUS_TILE_KEY_Y (key);
+
+	if (surface) {
+		blit_tile (exporter, get_band (exporter, y), surface, (gint64) x * 256 - exporter->left);
+		cairo_surface_destroy (surface);
+	}
+
+	tile_done (exporter, y, surface != NULL);
+}
+
+static void
+tile_bytes_ready (Exporter *exporter, guint x, guint y, GBytes *bytes)
+{
+	exporter->tiles++;
+	exporter->bytes += g_bytes_get_size (bytes);
+	mapius_tile_decode_job_unref (mapius_tile_decoder_push (exporter->decoder, MAPIUS_TILE_KEY (0, zoom, x, y), bytes));
+}
+
+static void
+tile_downloaded (GBytes *bytes, guint status, TileRequest *request)
+{
+	if (bytes)
+		tile_bytes_ready (request->exporter, request->x, request->y, bytes);
+	else
+		tile_done (request->exporter, request->y, FALSE);
+
+	g_free (request);
+}
+
+static void
+local_tile_loaded (GBytes *bytes, const MapiusTileMeta *meta, TileRequest *request)
+{
+	Exporter *exporter = request->exporter;
+
+	if (bytes) {
+		tile_bytes_ready (exporter, request->x, request->y, bytes);
+	}
+	else if (!cache_only && mapius_headless_download (exporter->headless, zoom, request->x, request->y, request->y - exporter->min_y, (MapiusDownloadFunc) tile_downloaded, request)) {
+		return;
+	}
+	else {
+		tile_done (exporter, request->y, FALSE);
+	}
+
+	g_free (request);
+}
+
+static void
+exporter_start_band (Exporter *exporter, guint row)
+{
+	MapiusMapSource *source = exporter->headless->source;
+	Band *band = get_band (exporter, row);
+	guint x;
+
+	band->row = row;
+	band->pending = exporter->max_x - exporter->min_x + 1;
+	band->pixels = g_malloc ((gsize) exporter->width * 256 * 4);
+	memset (band->pixels, 0xff, (gsize) exporter->width * 256 * 4);
+
+	for (x = exporter->min_x; x <= exporter->max_x; x++) {
+		TileRequest *request = g_new (TileRequest, 1);
+		request->exporter = exporter;
+		request->x = x;
+		request->y = row;
+
+		mapius_disk_cache_load_async (exporter->headless->cache, source->id, source->format, zoom, x, row,
+			(MapiusDiskCacheLoadFunc) local_tile_loaded, request);
+	}
+}
+
+static void
+exporter_report (Exporter *exporter)
+{
+	struct rusage usage;
+	gdouble elapsed = MAX ((g_get_monotonic_time () - exporter->start_time) / (gdouble) G_USEC_PER_SEC, 0.001);
+	gdouble pixels = (gdouble) exporter->width * exporter->height;
+
+	getrusage (RUSAGE_SELF, &usage);
+
+	g_print (
+		"%ux%u px, %" G_GUINT64_FORMAT " tiles, %" G_GUINT64_FORMAT " missing, %.1f s\n"
+		"%.2f Mpx/s, %.1f tiles/s, %.2f MB/s of tile data, peak RSS %.1f MB\n",
+		exporter->width, exporter->height, exporter->tiles, exporter->missing, elapsed,
+		pixels / elapsed / 1e6, exporter->tiles / elapsed, exporter->bytes / elapsed / (1024 * 1024),
+		usage.ru_maxrss / 1024.0
+	);
+}
+
+int main (int argc, char **argv)
+{
+	GError *err = NULL;
+	Exporter exporter;
+	MapiusImageFormat format;
+	gdouble min_lon, min_lat, max_lon, max_lat;
+	gdouble left, top, right, bottom;
+	guint i;
+
+	GOptionContext *context = g_option_context_new ("MAP_ID - export an area of a map to a single image");
+	g_option_context_set_summary (context,
+		"The image is written one row of tiles at a time, so memory use depends\n"
+		"on the image width and --bands, not on the size of the area.");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	if (argc != 2 || !bbox || !output || zoom < 0) {
+		g_printerr ("Usage: %s --bbox MIN_LON,MIN_LAT,MAX_LON,MAX_LAT --zoom Z --output FILE MAP_ID\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!mapius_parse_bbox (bbox, &min_lon, &min_lat, &max_lon, &max_lat)) {
+		g_printerr ("Bad bounding box: %s\n", bbox);
+		return EXIT_FAILURE;
+	}
+
+	if (zoom > 24) {
+		g_printerr ("Bad zoom level: %d\n", zoom);
+		return EXIT_FAILURE;
+	}
+
+	if (g_str_has_suffix (output, ".png")) {
+		format = MAPIUS_IMAGE_PNG;
+	}
+	else if (g_str_has_suffix (output, ".tif") || g_str_has_suffix (output, ".tiff")) {
+		format = MAPIUS_IMAGE_TIFF;
+	}
+	else {
+		g_printerr ("Unknown image format: %s\n", output);
+		return EXIT_FAILURE;
+	}
+
+	concurrency = MAX (concurrency, 1);
+	threads = MAX (threads, 0);
+	bands_in_flight = MAX (bands_in_flight, 1);
+
+	memset (&exporter, 0, sizeof (Exporter));
+	exporter.headless = mapius_headless_new (config, argv[1], concurrency, &err);
+	if (!exporter.headless) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+
+	mapius_headless_get_pixel (exporter.headless, min_lon, max_lat, zoom, &left, &top);
+	mapius_headless_get_pixel (exporter.headless, max_lon, min_lat, zoom, &right, &bottom);
+	exporter.left = floor (left);
+	exporter.top = floor (top);
+	exporter.width = MAX (ceil (right) - exporter.left, 1);
+	exporter.height = MAX (ceil (bottom) - exporter.top, 1);
+	exporter.max_x = MIN ((exporter.left + exporter.width - 1) / 256, (1 << zoom) - 1);
+	exporter.max_y = MIN ((exporter.top + exporter.height - 1) / 256, (1 << zoom) - 1);
+	exporter.min_x = MIN (exporter.left / 256, exporter.max_x);
+	exporter.min_y = MIN (exporter.top / 256, exporter.max_y);
+
+	if (exporter.width > G_MAXINT / 4 || exporter.height > G_MAXINT) {
+		g_printerr ("Image too large: %ux%u\n", exporter.width, exporter.height);
+		return EXIT_FAILURE;
+	}
+
+	exporter.writer = mapius_image_writer_new (output, format, exporter.width, exporter.height, &err);
+	if (!exporter.writer) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+
+	g_print ("Exporting %s zoom %d to %s, %ux%u px, %.1f MB per band\n",
+		exporter.headless->source->id, zoom, output, exporter.width, exporter.height,
+		exporter.width * 256.0 * 4 / (1024 * 1024));
+
+	exporter.decoder = mapius_tile_decoder_new (threads, (MapiusTileDecodedFunc) tile_decoded, &exporter);
+	exporter.bands = g_new0 (Band, bands_in_flight);
+	exporter.next_row = exporter.min_y;
+	exporter.write_row = exporter.min_y;
+	exporter.start_time = g_get_monotonic_time ();
+	exporter.loop = g_main_loop_new (NULL, FALSE);
+
+	for (i = 0; i < (guint) bands_in_flight && exporter.next_row <= exporter.max_y; i++)
+		exporter_start_band (&exporter, exporter.next_row++);
+
+	g_main_loop_run (exporter.loop);
+
+	if (!exporter.error)
+		mapius_image_writer_close (exporter.writer, &exporter.error);
+
+	mapius_tile_decoder_free (exporter.decoder);
+	mapius_image_writer_free (exporter.writer);
+
+	if (exporter.error) {
+		g_printerr ("%s\n", exporter.error->message);
+		return EXIT_FAILURE;
+	}
+
+	exporter_report (&exporter);
+
+	mapius_headless_free (exporter.headless);
+	g_main_loop_unref (exporter.loop);
+	g_free (exporter.bands);
+
+	return EXIT_SUCCESS;
+}
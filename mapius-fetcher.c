@@ -0,0 +1,379 @@
+#include "mapius-fetcher.h"
+
+#define LATENCY_SMOOTHING 0.2
+#define BASELINE_DRIFT 1.01
+#define CONGESTION_FACTOR 2.0
+
+typedef struct
+{
+	MapiusHostStats stats;
+	gdouble baseline;
+	GPtrArray *mirrors;
+} FetchHost;
+
+struct _MapiusFetcher
+{
+	SoupSession *session;
+	guint max_active;
+	guint max_per_host;
+	guint active;
+	GPtrArray *queue;
+	gboolean queue_sorted;
+	GHashTable *hosts;
+};
+
+struct _MapiusFetch
+{
+	MapiusFetcher *fetcher;
+	SoupMessage *msg;
+	gint priority;
+	gboolean active;
+	FetchHost *host;
+	gint64 start_time;
+	MapiusFetchFunc func;
+	gpointer data;
+};
+
+static void mapius_fetcher_dispatch (MapiusFetcher *fetcher);
+
+static void
+fetch_host_free (FetchHost *host)
+{
+	if (host->mirrors)
+		g_ptr_array_unref (host->mirrors);
+	g_free (host->stats.host);
+	g_free (host);
+}
+
+MapiusFetcher *
+mapius_fetcher_new (SoupSession *session, guint max_active, guint max_per_host)
+{
+	MapiusFetcher *fetcher = g_new (MapiusFetcher, 1);
+
+	fetcher->session = g_object_ref (session);
+	fetcher->max_active = MAX (max_active, 1);
+	fetcher->max_per_host = MAX (max_per_host, 1);
+	fetcher->active = 0;
+	fetcher->queue = g_ptr_array_new ();
+	fetcher->queue_sorted = TRUE;
+	fetcher->hosts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) fetch_host_free);
+
+	return fetcher;
+}
+
+void
+mapius_fetcher_free (MapiusFetcher *fetcher)
+{
+	while (fetcher->queue->len > 0)
+		mapius_fetcher_cancel (fetcher, g_ptr_array_index (fetcher->queue, fetcher->queue->len - 1));
+
+	soup_session_abort (fetcher->session);
+	g_object_unref (fetcher->session);
+	g_ptr_array_free (fetcher->queue, TRUE);
+	g_hash_table_destroy (fetcher->hosts);
+	g_free (fetcher);
+}
+
+static FetchHost *
+get_host (MapiusFetcher *fetcher, const gchar *name)
+{
+	FetchHost *host = g_hash_table_lookup (fetcher->hosts, name);
+
+	if (!host) {
+		host = g_new0 (FetchHost, 1);
+		host->stats.host = g_strdup (name);
+		host->stats.limit = MAX (fetcher->max_per_host / 2, 1);
+		g_hash_table_insert (fetcher->hosts, host->stats.host, host);
+	}
+
+	return host;
+}
+
+void
+mapius_fetcher_add_mirrors (MapiusFetcher *fetcher, const gchar * const *hosts)
+{
+	GPtrArray *mirrors = g_ptr_array_new ();
+
+	for (; *hosts; hosts++) {
+		FetchHost *host = get_host (fetcher, *hosts);
+		if (host->mirrors)
+			continue;
+
+		host->mirrors = g_ptr_array_ref (mirrors);
+		g_ptr_array_add (mirrors, host);
+	}
+
+	g_ptr_array_unref (mirrors);
+}
+
+static gboolean
+fetch_host_available (FetchHost *host)
+{
+	return host->stats.active < (guint) host->stats.limit;
+}
+
+static gdouble
+fetch_host_load (FetchHost *host)
+{
+	return (host->stats.active + 1) * MAX (host->stats.latency, 1) / host->stats.limit;
+}
+
+static FetchHost *
+choose_host (MapiusFetcher *fetcher, MapiusFetch *fetch)
+{
+	FetchHost *host = get_host (fetcher, soup_message_get_uri (fetch->msg)->host);
+	FetchHost *best = NULL;
+	guint i;
+
+	if (!host->mirrors)
+		return fetch_host_available (host) ? host : NULL;
+
+	for (i = 0; i < host->mirrors->len; i++) {
+		FetchHost *mirror = g_ptr_array_index (host->mirrors, i);
+		if (fetch_host_available (mirror) && (!best || fetch_host_load (mirror) < fetch_host_load (best)))
+			best = mirror;
+	}
+
+	return best;
+}
+
+static void
+fetch_host_update (MapiusFetcher *fetcher, FetchHost *host, SoupMessage *msg, gdouble latency)
+{
+	MapiusHostStats *stats = &host->stats;
+
+	if (msg->status_code == SOUP_STATUS_CANCELLED)
+		return;
+
+	stats->requests++;
+
+	if (SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code)
+		|| SOUP_STATUS_IS_SERVER_ERROR (msg->status_code)
+		|| msg->status_code == 429) {
+		stats->errors++;
+		stats->limit = MAX (stats->limit / 2, 1);
+		return;
+	}
+
+	stats->latency = stats->latency ? stats->latency + LATENCY_SMOOTHING * (latency - stats->latency) : latency;
+	host->baseline = host->baseline ? MIN (host->baseline * BASELINE_DRIFT, latency) : latency;
+
+	if (stats->latency > host->baseline * CONGESTION_FACTOR)
+		stats->limit = MAX (stats->limit - 1 / stats->limit, 1);
+	else
+		stats->limit = MIN (stats->limit + 1 / stats->limit, fetcher->max_per_host);
+}
+
+static gint
+compare_fetches (MapiusFetch **a, MapiusFetch **b)
+{
+	return (*b)->priority - (*a)->priority;
+}
+
+static void
+fetch_finished (SoupSession *session, SoupMessage *msg, gpointer data)
+{
+	MapiusFetch *fetch = (MapiusFetch *) data;
+	MapiusFetcher *fetcher = fetch->fetcher;
+
+	fetcher->active--;
+	fetch->host->stats.active--;
+	fetch_host_update (fetcher, fetch->host, msg, (g_get_monotonic_time () - fetch->start_time) / 1000.0);
+
+	fetch->func (fetch, msg, fetch->data);
+	g_free (fetch);
+
+	mapius_fetcher_dispatch (fetcher);
+}
+
+static void
+fetch_start (MapiusFetcher *fetcher, MapiusFetch *fetch, FetchHost *host)
+{
+	SoupURI *uri = soup_message_get_uri (fetch->msg);
+
+	if (g_strcmp0 (uri->host, host->stats.host) != 0) {
+		uri = soup_uri_copy (uri);
+		soup_uri_set_host (uri, host->stats.host);
+		soup_message_set_uri (fetch->msg, uri);
+		soup_uri_free (uri);
+	}
+
+	fetch->active = TRUE;
+	fetch->host = host;
+	fetch->start_time = g_get_monotonic_time ();
+	fetcher->active++;
+	host->stats.active++;
+	soup_session_queue_message (fetcher->session, fetch->msg, fetch_finished, fetch);
+}
+
+static void
+mapius_fetcher_dispatch (MapiusFetcher *fetcher)
+{
+	FetchHost *host = NULL;
+	guint i;
+
+	while (fetcher->active < fetcher->max_active && fetcher->queue->len > 0) {
+		if (!fetcher->queue_sorted) {
+			g_ptr_array_sort (fetcher->queue, (GCompareFunc) compare_fetches);
+			fetcher->queue_sorted = TRUE;
+		}
+
+		for (i = fetcher->queue->len; i > 0; i--) {
+			host = choose_host (fetcher, g_ptr_array_index (fetcher->queue, i - 1));
+			if (host)
+				break;
+		}
+		if (i == 0)
+			break;
+
+		fetch_start (fetcher, g_ptr_array_remove_index (fetcher->queue, i - 1), host);
+	}
+}
+
+MapiusFetch *
+mapius_fetcher_queue (MapiusFetcher *fetcher, SoupMessage *msg, gint priority, MapiusFetchFunc func, gpointer data)
+{
+	MapiusFetch *fetch = g_new (MapiusFetch, 1);
+
+	fetch->fetcher = fetcher;
+	fetch->msg = msg;
+	fetch->priority = priority;
+	fetch->active = FALSE;
+	fetch->host = NULL;
+	fetch->start_time = 0;
+	fetch->func = func;
+	fetch->data = data;
+
+	g_ptr_array_add (fetcher->queue, fetch);
+	fetcher->queue_sorted = FALSE;
+
+	mapius_fetcher_dispatch (fetcher);
+
+	return fetch;
+}
+
+void
+mapius_fetcher_set_priority (MapiusFetcher *fetcher, MapiusFetch *fetch, gint priority)
+{
+	if (!fetch->active && fetch->priority != priority) {
+		fetch->priority = priority;
+		fetcher->queue_sorted = FALSE;
+	}
+}
+
+void
+mapius_fetcher_cancel (MapiusFetcher *fetcher, MapiusFetch *fetch)
+{
+	if (fetch->active) {
+		soup_session_cancel_message (fetcher->session, fetch->msg, SOUP_STATUS_CANCELLED);
+	}
+	else {
+		g_ptr_array_remove (fetcher->queue, fetch);
+
+		soup_message_set_status (fetch->msg, SOUP_STATUS_CANCELLED);
+		fetch->func (fetch, fetch->msg, fetch->data);
+		g_object_unref (fetch->msg);
+		g_free (fetch);
+	}
+}
+
+guint
+mapius_fetcher_get_queued (MapiusFetcher *fetcher)
+{
+	return fetcher->queue->len;
+}
+
+guint
+mapius_fetcher_get_active (MapiusFetcher *fetcher)
+{
+	return fetcher->active;
+}
+
+guint
+mapius_fetcher_get_available (MapiusFetcher *fetcher)
+{
+	GHashTableIter iter;
+	FetchHost *host;
+	guint available = 0;
+
+	if (fetcher->active >= fetcher->max_active)
+		return 0;
+
+	if (g_hash_table_size (fetcher->hosts) == 0)
+		return fetcher->max_active - fetcher->active;
+
+	g_hash_table_iter_init (&iter, fetcher->hosts);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &host)) {
+		if (fetch_host_available (host))
+			available += (guint) host->stats.limit - host->stats.active;
+	}
+
+	return MIN (available, fetcher->max_active - fetcher->active);
+}
+
+static void
+host_stats_clear (MapiusHostStats *stats)
+{
+	g_free (stats->host);
+}
+
+GArray *
+mapius_fetcher_get_host_stats (MapiusFetcher *fetcher)
+{
+	GArray *result = g_array_sized_new (FALSE, FALSE, sizeof (MapiusHostStats), g_hash_table_size (fetcher->hosts));
+	GHashTableIter iter;
+	FetchHost *host;
+
+	g_array_set_clear_func (result, (GDestroyNotify) host_stats_clear);
+
+	g_hash_table_iter_init (&iter, fetcher->hosts);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &host)) {
+		MapiusHostStats stats = host->stats;
+		stats.host = g_strdup (host->stats.host);
+		g_array_append_val (result, stats);
+	}
+
+	return result;
+}
+
+MapiusTileMeta *
+mapius_tile_meta_from_message (SoupMessage *msg, const MapiusTileMeta *old, gint64 default_max_age)
+{
+	SoupMessageHeaders *headers = msg->response_headers;
+	const gchar *etag = soup_message_headers_get_one (headers, "ETag");
+	const gchar *last_modified = soup_message_headers_get_one (headers, "Last-Modified");
+	const gchar *cache_control = soup_message_headers_get_list (headers, "Cache-Control");
+	const gchar *expires = soup_message_headers_get_one (headers, "Expires");
+	gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+	gint64 max_age = default_max_age;
+
+	if (cache_control) {
+		GHashTable *params = soup_header_parse_param_list (cache_control);
+		const gchar *value;
+
+		if (g_hash_table_contains (params, "no-cache") || g_hash_table_contains (params, "no-store"))
+			max_age = 0;
+		else if ((value = g_hash_table_lookup (params, "max-age")))
+			max_age = g_ascii_strtoll (value, NULL, 10);
+
+		soup_header_free_param_list (params);
+	}
+	else if (expires) {
+		SoupDate *date = soup_date_new_from_string (expires);
+
+		if (date) {
+			max_age = soup_date_to_time_t (date) - now;
+			soup_date_free (date);
+		}
+		else {
+			max_age = 0;
+		}
+	}
+
+	if (old && !etag)
+		etag = old->etag;
+	if (old && !last_modified)
+		last_modified = old->last_modified;
+
+	return mapius_tile_meta_new (now + MAX (max_age, 0), etag, last_modified);
+}
@@ -0,0 +1,35 @@
+#ifndef __MAPIUS_FETCHER_H__
+#define __MAPIUS_FETCHER_H__
+
+#include <libsoup/soup.h>
+
+#include "mapius-disk-cache.h"
+
+typedef struct _MapiusFetcher MapiusFetcher;
+typedef struct _MapiusFetch MapiusFetch;
+typedef struct _MapiusHostStats MapiusHostStats;
+typedef void (*MapiusFetchFunc) (MapiusFetch *fetch, SoupMessage *msg, gpointer data);
+
+struct _MapiusHostStats
+{
+	gchar *host;
+	guint active;
+	gdouble limit;
+	gdouble latency;
+	guint64 requests;
+	guint64 errors;
+};
+
+MapiusFetcher *mapius_fetcher_new (SoupSession *session, guint max_active, guint max_per_host);
+void mapius_fetcher_free (MapiusFetcher *fetcher);
+void mapius_fetcher_add_mirrors (MapiusFetcher *fetcher, const gchar * const *hosts);
+MapiusFetch *mapius_fetcher_queue (MapiusFetcher *fetcher, SoupMessage *msg, gint priority, MapiusFetchFunc func, gpointer data);
+void mapius_fetcher_set_priority (MapiusFetcher *fetcher, MapiusFetch *fetch, gint priority);
+void mapius_fetcher_cancel (MapiusFetcher *fetcher, MapiusFetch *fetch);
+guint mapius_fetcher_get_queued (MapiusFetcher *fetcher);
+guint mapius_fetcher_get_active (MapiusFetcher *fetcher);
+guint mapius_fetcher_get_available (MapiusFetcher *fetcher);
+GArray *mapius_fetcher_get_host_stats (MapiusFetcher *fetcher);
+MapiusTileMeta *mapius_tile_meta_from_message (SoupMessage *msg, const MapiusTileMeta *old, gint64 default_max_age);
+
+#endif
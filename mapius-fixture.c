@@ -0,0 +1,89 @@
+#include <glib/gstdio.h>
+
+#include "mapius-fixture.h"
+
+static void
+remove_recursive (const gchar *path)
+{
+	GDir *dir = g_dir_open (path, 0, NULL);
+	const gchar *name;
+
+	if (dir) {
+		while ((name = g_dir_read_name (dir))) {
+			gchar *child = g_build_filename (path, name, NULL);
+			remove_recursive (child);
+			g_free (child);
+		}
+		g_dir_close (dir);
+	}
+
+	g_remove (path);
+}
+
+/* Creates a scratch directory with an empty maps directory and returns the
+ * settings from @config, pointed at the scratch cache and maps, for the
+ * caller to adjust and pass to mapius_fixture_save_settings(). */
+gchar *
+mapius_fixture_new (const gchar *name, const gchar *config, GKeyFile **settings)
+{
+	GError *err = NULL;
+
+	gchar *template = g_strdup_printf ("mapius-%s-XXXXXX", name);
+	gchar *dir = g_dir_make_tmp (template, &err);
+	g_free (template);
+	if (!dir) {
+		g_error ("Error creating %s directory: %s", name, err->message);
+	}
+
+	gchar *maps_dir = g_build_filename (dir, "maps", NULL);
+	gchar *cache_dir = g_build_filename (dir, "cache", NULL);
+
+	g_mkdir_with_parents (maps_dir, 0755);
+
+	*settings = g_key_file_new ();
+	if (!g_key_file_load_from_file (*settings, config, G_KEY_FILE_NONE, &err)) {
+		g_error ("Error loading settings file: %s", err->message);
+	}
+	g_key_file_set_string (*settings, "Paths", "Cache", cache_dir);
+	g_key_file_set_string (*settings, "Paths", "Maps", maps_dir);
+
+	g_free (cache_dir);
+	g_free (maps_dir);
+
+	return dir;
+}
+
+void
+mapius_fixture_add_map (const gchar *dir, const gchar *map_id, const gchar *source)
+{
+	GError *err = NULL;
+	gchar *module_name = g_strconcat (map_id, ".py", NULL);
+	gchar *module = g_build_filename (dir, "maps", module_name, NULL);
+
+	if (!g_file_set_contents (module, source, -1, &err)) {
+		g_error ("Error writing map '%s': %s", map_id, err->message);
+	}
+
+	g_free (module);
+	g_free (module_name);
+}
+
+void
+mapius_fixture_save_settings (const gchar *dir, GKeyFile *settings)
+{
+	GError *err = NULL;
+	gchar *settings_file = g_build_filename (dir, "mapius.ini", NULL);
+
+	if (!g_key_file_save_to_file (settings, settings_file, &err)) {
+		g_error ("Error writing settings: %s", err->message);
+	}
+
+	g_free (settings_file);
+}
+
+void
+mapius_fixture_free (gchar *dir)
+{
+	remove_recursive (dir);
+	g_free (dir);
+}
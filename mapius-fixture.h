@@ -0,0 +1,11 @@
+#ifndef __MAPIUS_FIXTURE_H__
+#define __MAPIUS_FIXTURE_H__
+
+#include <glib.h>
+
+gchar *mapius_fixture_new (const gchar *name, const gchar *config, GKeyFile **settings);
+void mapius_fixture_add_map (const gchar *dir, const gchar *map_id, const gchar *source);
+void mapius_fixture_save_settings (const gchar *dir, GKeyFile *settings);
+void mapius_fixture_free (gchar *dir);
+
+#endif
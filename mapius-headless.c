@@ -0,0 +1,216 @@
+#include <stdio.h>
+
+#include "mapius-headless.h"
+#include "mapius-projection.h"
+#include "mapius-util.h"
+
+typedef struct
+{
+	MapiusHeadless *headless;
+	guint zoom;
+	guint x;
+	guint y;
+	MapiusDownloadFunc func;
+	gpointer data;
+} Download;
+
+static gchar *
+get_setting (GKeyFile *settings, const gchar *group, const gchar *key, GError **error)
+{
+	GError *err = NULL;
+
+	gchar *value = g_key_file_get_string (settings, group, key, &err);
+	if (err)
+		g_propagate_prefixed_error (error, err, "Error loading settings: ");
+
+	return value;
+}
+
+static gboolean
+get_integer_setting (GKeyFile *settings, const gchar *group, const gchar *key, gint *value, GError **error)
+{
+	GError *err = NULL;
+
+	*value = g_key_file_get_integer (settings, group, key, &err);
+	if (err) {
+		g_propagate_prefixed_error (error, err, "Error loading settings: ");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+MapiusHeadless *
+mapius_headless_new (const gchar *config, const gchar *map_id, guint concurrency, GError **error)
+{
+	GError *err = NULL;
+	gchar *cache_dir = NULL;
+	gchar *maps_dir = NULL;
+	gchar *cache_format = NULL;
+	gchar *user_agent = NULL;
+	gint cache_max_size, default_max_age;
+	MapiusDiskCacheFormat disk_cache_format;
+	guint i;
+
+	GKeyFile *settings = g_key_file_new();
+	if (!g_key_file_load_from_file (settings, config, G_KEY_FILE_NONE, &err)) {
+		g_propagate_prefixed_error (error, err, "Error loading settings file: ");
+		goto fail;
+	}
+
+	if (!(cache_dir = get_setting (settings, "Paths", "Cache", error))
+		|| !(maps_dir = get_setting (settings, "Paths", "Maps", error))
+		|| !(cache_format = get_setting (settings, "Paths", "CacheFormat", error))
+		|| !(user_agent = get_setting (settings, "Network", "UserAgent", error))
+		|| !get_integer_setting (settings, "Paths", "CacheMaxSize", &cache_max_size, error)
+		|| !get_integer_setting (settings, "Cache", "DefaultMaxAge", &default_max_age, error))
+		goto fail;
+	mapius_make_abs_path (&cache_dir);
+	mapius_make_abs_path (&maps_dir);
+
+	if (g_strcmp0 (cache_format, "files") == 0) {
+		disk_cache_format = MAPIUS_DISK_CACHE_FILES;
+	}
+	else if (g_strcmp0 (cache_format, "pack") == 0) {
+		disk_cache_format = MAPIUS_DISK_CACHE_PACK;
+	}
+	else {
+		g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE, "Unknown cache format: %s", cache_format);
+		goto fail;
+	}
+
+	g_key_file_free (settings);
+	settings = NULL;
+	g_free (cache_format);
+	cache_format = NULL;
+
+	gchar *manifest_file = g_build_filename (cache_dir, "maps.manifest", NULL);
+	GPtrArray *sources = mapius_map_source_load_all (maps_dir, manifest_file, error);
+	g_free (manifest_file);
+	g_free (maps_dir);
+	maps_dir = NULL;
+	if (!sources)
+		goto fail;
+
+	MapiusMapSource *source = NULL;
+	for (i = 0; i < sources->len; i++) {
+		MapiusMapSource *candidate = g_ptr_array_index (sources, i);
+		if (g_strcmp0 (candidate->id, map_id) == 0)
+			source = candidate;
+	}
+
+	if (!source || !mapius_map_source_prepare (source)) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, source ? "Map '%s' failed to load" : "Unknown map: %s", map_id);
+		g_ptr_array_unref (sources);
+		goto fail;
+	}
+
+	if (!mapius_projection_for_epsg (source->epsg)) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unknown projection %d for map '%s'", source->epsg, map_id);
+		g_ptr_array_unref (sources);
+		goto fail;
+	}
+
+	MapiusHeadless *headless = g_new (MapiusHeadless, 1);
+	headless->source = source;
+	headless->sources = sources;
+	headless->default_max_age = MAX (default_max_age, 0);
+	headless->cache = mapius_disk_cache_new (cache_dir, disk_cache_format, (guint64) MAX (cache_max_size, 0) * 1024 * 1024, headless->default_max_age);
+	headless->session = soup_session_async_new_with_options (
+		SOUP_SESSION_MAX_CONNS, concurrency,
+		SOUP_SESSION_MAX_CONNS_PER_HOST, concurrency,
+		SOUP_SESSION_USER_AGENT, user_agent,
+		NULL);
+	headless->fetcher = mapius_fetcher_new (headless->session, concurrency, concurrency);
+
+	const gchar * const *mirrors = mapius_map_source_get_mirrors (source);
+	if (mirrors)
+		mapius_fetcher_add_mirrors (headless->fetcher, mirrors);
+
+	g_free (user_agent);
+	g_free (cache_dir);
+
+	return headless;
+
+fail:
+	if (settings)
+		g_key_file_free (settings);
+	g_free (cache_dir);
+	g_free (maps_dir);
+	g_free (cache_format);
+	g_free (user_agent);
+	return NULL;
+}
+
+void
+mapius_headless_free (MapiusHeadless *headless)
+{
+	mapius_fetcher_free (headless->fetcher);
+	mapius_disk_cache_free (headless->cache);
+	g_object_unref (headless->session);
+	g_ptr_array_unref (headless->sources);
+	g_free (headless);
+}
+
+static void
+download_finished (MapiusFetch *fetch, SoupMessage *msg, Download *download)
+{
+	MapiusHeadless *headless = download->headless;
+	GBytes *bytes = NULL;
+
+	if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+		SoupBuffer *buffer = soup_message_body_flatten (msg->response_body);
+		MapiusTileMeta *meta = mapius_tile_meta_from_message (msg, NULL, headless->default_max_age);
+		bytes = soup_buffer_get_as_bytes (buffer);
+		soup_buffer_free (buffer);
+
+		mapius_disk_cache_store (headless->cache, headless->source->id, headless->source->format, download->zoom, download->x, download->y, bytes, meta);
+		mapius_tile_meta_free (meta);
+	}
+	else if (msg->status_code != SOUP_STATUS_CANCELLED) {
+		g_debug ("%s/%d/%d/%d: %d %s", headless->source->id, download->zoom, download->x, download->y, msg->status_code, msg->reason_phrase);
+	}
+
+	download->func (bytes, msg->status_code, download->data);
+
+	if (bytes)
+		g_bytes_unref (bytes);
+	g_free (download);
+}
+
+gboolean
+mapius_headless_download (MapiusHeadless *headless, guint zoom, guint x, guint y, gint priority, MapiusDownloadFunc func, gpointer data)
+{
+	gchar *url = mapius_map_source_get_url (headless->source, zoom, x, y);
+	SoupMessage *msg = url ? soup_message_new ("GET", url) : NULL;
+	g_free (url);
+	if (!msg)
+		return FALSE;
+
+	Download *download = g_new (Download, 1);
+	download->headless = headless;
+	download->zoom = zoom;
+	download->x = x;
+	download->y = y;
+	download->func = func;
+	download->data = data;
+
+	mapius_fetcher_queue (headless->fetcher, msg, priority, (MapiusFetchFunc) download_finished, download);
+
+	return TRUE;
+}
+
+void
+mapius_headless_get_pixel (MapiusHeadless *headless, gdouble lon, gdouble lat, guint zoom, gdouble *x, gdouble *y)
+{
+	mapius_projection_get_pixel (mapius_projection_for_epsg (headless->source->epsg), lon, lat, zoom, x, y);
+}
+
+gboolean
+mapius_parse_bbox (const gchar *bbox, gdouble *min_lon, gdouble *min_lat, gdouble *max_lon, gdouble *max_lat)
+{
+	return bbox
+		&& sscanf (bbox, "%lf,%lf,%lf,%lf", min_lon, min_lat, max_lon, max_lat) == 4
+		&& *min_lon < *max_lon
+		&& *min_lat < *max_lat;
+}
@@ -0,0 +1,29 @@
+#ifndef __MAPIUS_HEADLESS_H__
+#define __MAPIUS_HEADLESS_H__
+
+#include <libsoup/soup.h>
+
+#include "mapius-disk-cache.h"
+#include "mapius-fetcher.h"
+#include "mapius-map-source.h"
+
+typedef struct _MapiusHeadless MapiusHeadless;
+typedef void (*MapiusDownloadFunc) (GBytes *bytes, guint status, gpointer data);
+
+struct _MapiusHeadless
+{
+	MapiusMapSource *source;
+	MapiusDiskCache *cache;
+	MapiusFetcher *fetcher;
+	SoupSession *session;
+	gint64 default_max_age;
+	GPtrArray *sources;
+};
+
+MapiusHeadless *mapius_headless_new (const gchar *config, const gchar *map_id, guint concurrency, GError **error);
+void mapius_headless_free (MapiusHeadless *headless);
+gboolean mapius_headless_download (MapiusHeadless *headless, guint zoom, guint x, guint y, gint priority, MapiusDownloadFunc func, gpointer data);
+void mapius_headless_get_pixel (MapiusHeadless *headless, gdouble lon, gdouble lat, guint zoom, gdouble *x, gdouble *y);
+gboolean mapius_parse_bbox (const gchar *bbox, gdouble *min_lon, gdouble *min_lat, gdouble *max_lon, gdouble *max_lat);
+
+#endif
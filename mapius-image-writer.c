@@ -0,0 +1,359 @@
+#include <string.h>
+#include <gio/gio.h>
+
+#include "mapius-image-writer.h"
+
+#define DEFLATE_BUFFER_SIZE 65536
+#define TIFF_ROWS_PER_STRIP 16
+
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_LONG8 16
+
+struct _MapiusImageWriter
+{
+	GFileOutputStream *file;
+	GOutputStream *stream;
+	MapiusImageFormat format;
+	guint width;
+	guint height;
+	guint rows_written;
+	guchar *row;
+	guchar *filtered_row;
+	GConverter *deflate;
+	guchar *deflate_buffer;
+	gsize deflate_length;
+	gboolean big_tiff;
+	guint64 data_offset;
+};
+
+static guint32 crc_table[256];
+
+static void
+init_crc_table (void)
+{
+	guint32 c;
+	guint n, k;
+
+	if (crc_table[1])
+		return;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static guint32
+update_crc (guint32 crc, const guchar *data, gsize size)
+{
+	while (size--)
+		crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static void
+put_be32 (guchar *p, guint32 value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void
+append_le (GByteArray *array, guint64 value, guint size)
+{
+	guchar bytes[8];
+	guint i;
+
+	for (i = 0; i < size; i++)
+		bytes[i] = value >> (i * 8);
+	g_byte_array_append (array, bytes, size);
+}
+
+static gboolean
+png_write_chunk (MapiusImageWriter *writer, const gchar *type, const guchar *data, gsize size, GError **error)
+{
+	guchar header[8];
+	guchar footer[4];
+
+	put_be32 (header, size);
+	memcpy (header + 4, type, 4);
+	put_be32 (footer, update_crc (update_crc (0xffffffff, header + 4, 4), data, size) ^ 0xffffffff);
+
+	return g_output_stream_write_all (writer->stream, header, sizeof (header), NULL, NULL, error)
+		&& g_output_stream_write_all (writer->stream, data, size, NULL, NULL, error)
+		&& g_output_stream_write_all (writer->stream, footer, sizeof (footer), NULL, NULL, error);
+}
+
+static gboolean
+png_deflate (MapiusImageWriter *writer, const guchar *data, gsize size, gboolean finish, GError **error)
+{
+	GConverterResult result;
+	gsize bytes_read, bytes_written;
+
+	do {
+		result = g_converter_convert (
+			writer->deflate,
+			data, size,
+			writer->deflate_buffer + writer->deflate_length, DEFLATE_BUFFER_SIZE - writer->deflate_length,
+			finish ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+			&bytes_read, &bytes_written,
+			error
+		);
+		if (result == G_CONVERTER_ERROR)
+			return FALSE;
+
+		data += bytes_read;
+		size -= bytes_read;
+		writer->deflate_length += bytes_written;
+
+		if (writer->deflate_length == DEFLATE_BUFFER_SIZE || (result == G_CONVERTER_FINISHED && writer->deflate_length > 0)) {
+			if (!png_write_chunk (writer, "IDAT", writer->deflate_buffer, writer->deflate_length, error))
+				return FALSE;
+			writer->deflate_length = 0;
+		}
+	} while (size > 0 || (finish && result != G_CONVERTER_FINISHED));
+
+	return TRUE;
+}
+
+static gboolean
+png_write_header (MapiusImageWriter *writer, GError **error)
+{
+	static const guchar signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	guchar ihdr[13];
+
+	put_be32 (ihdr, writer->width);
+	put_be32 (ihdr + 4, writer->height);
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+
+	return g_output_stream_write_all (writer->stream, signature, sizeof (signature), NULL, NULL, error)
+		&& png_write_chunk (writer, "IHDR", ihdr, sizeof (ihdr), error);
+}
+
+static gboolean
+png_write_row (MapiusImageWriter *writer, GError **error)
+{
+	gsize size = (gsize) writer->width * 3;
+	guchar *row = writer->row + 1;
+	guchar *filtered = writer->filtered_row + 1;
+	gsize i;
+
+	/* Sub filter: cheap and compresses flat map areas well */
+	writer->filtered_row[0] = 1;
+	for (i = 0; i < size; i++)
+		filtered[i] = i < 3 ? row[i] : row[i] - row[i - 3];
+
+	return png_deflate (writer, writer->filtered_row, size + 1, FALSE, error);
+}
+
+static gboolean
+png_finish (MapiusImageWriter *writer, GError **error)
+{
+	return png_deflate (writer, NULL, 0, TRUE, error)
+		&& png_write_chunk (writer, "IEND", NULL, 0, error);
+}
+
+static gboolean
+tiff_write_header (MapiusImageWriter *writer, GError **error)
+{
+	GByteArray *header = g_byte_array_new ();
+	gboolean result;
+
+	g_byte_array_append (header, (const guchar *) "II", 2);
+	if (writer->big_tiff) {
+		append_le (header, 43, 2);
+		append_le (header, 8, 2);
+		append_le (header, 0, 2);
+		append_le (header, 0, 8);
+	}
+	else {
+		append_le (header, 42, 2);
+		append_le (header, 0, 4);
+	}
+	writer->data_offset = header->len;
+
+	result = g_output_stream_write_all (writer->stream, header->data, header->len, NULL, NULL, error);
+	g_byte_array_unref (header);
+
+	return result;
+}
+
+static void
+tiff_append_entry (MapiusImageWriter *writer, GByteArray *ifd, guint16 tag, guint16 type, guint64 count, guint64 value)
+{
+	append_le (ifd, tag, 2);
+	append_le (ifd, type, 2);
+	append_le (ifd, count, writer->big_tiff ? 8 : 4);
+	append_le (ifd, value, writer->big_tiff ? 8 : 4);
+}
+
+static gboolean
+tiff_finish (MapiusImageWriter *writer, GError **error)
+{
+	gsize row_size = (gsize) writer->width * 3;
+	guint strips = (writer->height + TIFF_ROWS_PER_STRIP - 1) / TIFF_ROWS_PER_STRIP;
+	guint offset_size = writer->big_tiff ? 8 : 4;
+	guint16 offset_type = writer->big_tiff ? TIFF_LONG8 : TIFF_LONG;
+	guint64 position = writer->data_offset + (guint64) row_size * writer->height;
+	GByteArray *trailer = g_byte_array_new ();
+	GByteArray *ifd = g_byte_array_new ();
+	guint64 bits_offset, offsets_offset, counts_offset, ifd_offset;
+	guint i;
+	gboolean result;
+
+	if (position % 2)
+		append_le (trailer, 0, 1);
+
+	bits_offset = position + trailer->len;
+	if (!writer->big_tiff) {
+		for (i = 0; i < 3; i++)
+			append_le (trailer, 8, 2);
+	}
+
+	offsets_offset = position + trailer->len;
+	for (i = 0; i < strips; i++)
+		append_le (trailer, writer->data_offset + (guint64) i * TIFF_ROWS_PER_STRIP * row_size, offset_size);
+
+	counts_offset = position + trailer->len;
+	for (i = 0; i < strips; i++)
+		append_le (trailer, (guint64) MIN (TIFF_ROWS_PER_STRIP, writer->height - i * TIFF_ROWS_PER_STRIP) * row_size, offset_size);
+
+	ifd_offset = position + trailer->len;
+
+	append_le (ifd, 10, writer->big_tiff ? 8 : 2);
+	tiff_append_entry (writer, ifd, 256, TIFF_LONG, 1, writer->width);
+	tiff_append_entry (writer, ifd, 257, TIFF_LONG, 1, writer->height);
+	tiff_append_entry (writer, ifd, 258, TIFF_SHORT, 3, writer->big_tiff ? G_GUINT64_CONSTANT (0x000800080008) : bits_offset);
+	tiff_append_entry (writer, ifd, 259, TIFF_SHORT, 1, 1);
+	tiff_append_entry (writer, ifd, 262, TIFF_SHORT, 1, 2);
+	tiff_append_entry (writer, ifd, 273, offset_type, strips, strips == 1 ? writer->data_offset : offsets_offset);
+	tiff_append_entry (writer, ifd, 277, TIFF_SHORT, 1, 3);
+	tiff_append_entry (writer, ifd, 278, TIFF_LONG, 1, TIFF_ROWS_PER_STRIP);
+	tiff_append_entry (writer, ifd, 279, offset_type, strips, strips == 1 ? (guint64) row_size * writer->height : counts_offset);
+	tiff_append_entry (writer, ifd, 284, TIFF_SHORT, 1, 1);
+	append_le (ifd, 0, offset_size);
+
+	g_byte_array_append (trailer, ifd->data, ifd->len);
+	g_byte_array_set_size (ifd, 0);
+	append_le (ifd, ifd_offset, offset_size);
+
+	result = g_output_stream_write_all (writer->stream, trailer->data, trailer->len, NULL, NULL, error)
+		&& g_seekable_seek (G_SEEKABLE (writer->file), writer->big_tiff ? 8 : 4, G_SEEK_SET, NULL, error)
+		&& g_output_stream_write_all (writer->stream, ifd->data, ifd->len, NULL, NULL, error);
+
+	g_byte_array_unref (trailer);
+	g_byte_array_unref (ifd);
+
+	return result;
+}
+
+MapiusImageWriter *
+mapius_image_writer_new (const gchar *filename, MapiusImageFormat format, guint width, guint height, GError **error)
+{
+	GFile *file = g_file_new_for_path (filename);
+	GFileOutputStream *stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL, error);
+	gboolean result;
+
+	g_object_unref (file);
+	if (!stream)
+		return NULL;
+
+	MapiusImageWriter *writer = g_new0 (MapiusImageWriter, 1);
+	writer->file = stream;
+	writer->stream = G_OUTPUT_STREAM (stream);
+	writer->format = format;
+	writer->width = width;
+	writer->height = height;
+	writer->row = g_malloc ((gsize) width * 3 + 1);
+	writer->filtered_row = g_malloc ((gsize) width * 3 + 1);
+
+	if (format == MAPIUS_IMAGE_PNG) {
+		init_crc_table ();
+		writer->deflate = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, 6));
+		writer->deflate_buffer = g_malloc (DEFLATE_BUFFER_SIZE);
+		result = png_write_header (writer, error);
+	}
+	else {
+		guint64 data_size = (guint64) width * height * 3;
+		guint64 strips = (height + TIFF_ROWS_PER_STRIP - 1) / TIFF_ROWS_PER_STRIP;
+		writer->big_tiff = data_size + strips * 8 + 4096 > G_MAXUINT32;
+		result = tiff_write_header (writer, error);
+	}
+
+	if (!result) {
+		mapius_image_writer_free (writer);
+		return NULL;
+	}
+
+	return writer;
+}
+
+gboolean
+mapius_image_writer_write_rows (MapiusImageWriter *writer, const guchar *data, gint stride, guint rows, GError **error)
+{
+	guint y, x;
+
+	if (writer->rows_written + rows > writer->height) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Too many rows for a %ux%u image", writer->width, writer->height);
+		return FALSE;
+	}
+
+	for (y = 0; y < rows; y++) {
+		const guint32 *src = (const guint32 *) (data + (gsize) y * stride);
+		guchar *dst = writer->row + 1;
+
+		for (x = 0; x < writer->width; x++) {
+			*dst++ = src[x] >> 16;
+			*dst++ = src[x] >> 8;
+			*dst++ = src[x];
+		}
+
+		if (writer->format == MAPIUS_IMAGE_PNG) {
+			if (!png_write_row (writer, error))
+				return FALSE;
+		}
+		else if (!g_output_stream_write_all (writer->stream, writer->row + 1, (gsize) writer->width * 3, NULL, NULL, error)) {
+			return FALSE;
+		}
+	}
+
+	writer->rows_written += rows;
+
+	return TRUE;
+}
+
+gboolean
+mapius_image_writer_close (MapiusImageWriter *writer, GError **error)
+{
+	if (writer->rows_written != writer->height) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "Only %u of %u rows written", writer->rows_written, writer->height);
+		return FALSE;
+	}
+
+	if (writer->format == MAPIUS_IMAGE_PNG ? !png_finish (writer, error) : !tiff_finish (writer, error))
+		return FALSE;
+
+	return g_output_stream_close (writer->stream, NULL, error);
+}
+
+void
+mapius_image_writer_free (MapiusImageWriter *writer)
+{
+	if (writer->deflate)
+		g_object_unref (writer->deflate);
+	g_object_unref (writer->file);
+	g_free (writer->deflate_buffer);
+	g_free (writer->filtered_row);
+	g_free (writer->row);
+	g_free (writer);
+}
@@ -0,0 +1,19 @@
+#ifndef __MAPIUS_IMAGE_WRITER_H__
+#define __MAPIUS_IMAGE_WRITER_H__
+
+#include <glib.h>
+
+typedef struct _MapiusImageWriter MapiusImageWriter;
+
+typedef enum
+{
+	MAPIUS_IMAGE_PNG,
+	MAPIUS_IMAGE_TIFF
+} MapiusImageFormat;
+
+MapiusImageWriter *mapius_image_writer_new (const gchar *filename, MapiusImageFormat format, guint width, guint height, GError **error);
+gboolean mapius_image_writer_write_rows (MapiusImageWriter *writer, const guchar *data, gint stride, guint rows, GError **error);
+gboolean mapius_image_writer_close (MapiusImageWriter *writer, GError **error);
+void mapius_image_writer_free (MapiusImageWriter *writer);
+
+#endif
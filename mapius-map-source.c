@@ -0,0 +1,351 @@
+#include <Python.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "mapius-map-source.h"
+#include "mapius-url-template.h"
+
+typedef struct
+{
+	MapiusMapSource source;
+	PyObject *module;
+	PyObject *url_func;
+	MapiusUrlTemplate *url_template;
+	gchar **mirrors;
+	gboolean prepared;
+	gboolean ready;
+} MapSource;
+
+static gchar *python_path = NULL;
+
+static PyObject *
+import_map_module (const gchar *map_id)
+{
+	if (!Py_IsInitialized ()) {
+		g_debug ("Initializing Python");
+		Py_Initialize();
+		PySys_SetPath (python_path);
+	}
+
+	PyObject *name = PyString_FromString (map_id);
+	PyObject *module = PyImport_Import (name);
+	Py_DECREF (name);
+
+	if (!module) {
+		PyErr_Print();
+		g_warning ("Error loading map '%s'", map_id);
+	}
+
+	return module;
+}
+
+static MapiusUrlTemplate *
+load_url_template (PyObject *module, const gchar *map_id)
+{
+	GError *err = NULL;
+	gchar **subdomains = NULL;
+	Py_ssize_t i, n;
+
+	PyObject *value = PyObject_GetAttrString (module, "url_template");
+	if (!value) {
+		PyErr_Clear();
+		return NULL;
+	}
+	if (!PyString_Check (value)) {
+		g_warning ("Bad 'url_template' for map '%s'", map_id);
+		Py_DECREF (value);
+		return NULL;
+	}
+	gchar *pattern = g_strdup (PyString_AsString (value));
+	Py_DECREF (value);
+
+	value = PyObject_GetAttrString (module, "subdomains");
+	if (!value) {
+		PyErr_Clear();
+	}
+	else if (PyString_Check (value)) {
+		const gchar *str = PyString_AsString (value);
+		n = strlen (str);
+		subdomains = g_new0 (gchar *, n + 1);
+		for (i = 0; i < n; i++)
+			subdomains[i] = g_strndup (str + i, 1);
+	}
+	else if (PySequence_Check (value)) {
+		n = PySequence_Size (value);
+		subdomains = g_new0 (gchar *, n + 1);
+		gsize n_subdomains = 0;
+		for (i = 0; i < n; i++) {
+			PyObject *item = PySequence_GetItem (value, i);
+			if (item && PyString_Check (item))
+				subdomains[n_subdomains++] = g_strdup (PyString_AsString (item));
+			else {
+				PyErr_Clear();
+				g_warning ("Skipping bad entry %zd in 'subdomains' for map '%s'", i, map_id);
+			}
+			Py_XDECREF (item);
+		}
+	}
+	Py_XDECREF (value);
+
+	MapiusUrlTemplate *url_template = mapius_url_template_new (pattern, (const gchar * const *) subdomains, &err);
+	if (err) {
+		g_warning ("Bad 'url_template' for map '%s': %s", map_id, err->message);
+		g_error_free (err);
+	}
+
+	g_strfreev (subdomains);
+	g_free (pattern);
+
+	return url_template;
+}
+
+static gchar *
+get_module_string (PyObject *module, const gchar *attr)
+{
+	PyObject *value = PyObject_GetAttrString (module, attr);
+	if (!value) {
+		PyErr_Clear();
+		return NULL;
+	}
+
+	gchar *result = PyString_Check (value) ? g_strdup (PyString_AsString (value)) : NULL;
+	Py_DECREF (value);
+
+	return result;
+}
+
+static void
+manifest_update_entry (GKeyFile *manifest, const gchar *map_id, gint64 mtime, PyObject *module)
+{
+	g_key_file_remove_group (manifest, map_id, NULL);
+	g_key_file_set_int64 (manifest, map_id, "MTime", mtime);
+
+	if (!module) {
+		g_key_file_set_boolean (manifest, map_id, "Invalid", TRUE);
+		return;
+	}
+
+	gchar *title = get_module_string (module, "title");
+	gchar *key = get_module_string (module, "key");
+	gchar *format = get_module_string (module, "format");
+
+	PyObject *value = PyObject_GetAttrString (module, "proj");
+	if (!value)
+		PyErr_Clear();
+
+	if (!title) {
+		g_warning ("No title for map '%s'", map_id);
+		g_key_file_set_boolean (manifest, map_id, "Invalid", TRUE);
+	}
+	else if (!format) {
+		g_warning ("No format for map '%s'", map_id);
+		g_key_file_set_boolean (manifest, map_id, "Invalid", TRUE);
+	}
+	else if (!value) {
+		g_warning ("No projection for map '%s'", map_id);
+		g_key_file_set_boolean (manifest, map_id, "Invalid", TRUE);
+	}
+	else if (!PyInt_Check (value)) {
+		g_warning ("Bad projection for map '%s'", map_id);
+		g_key_file_set_boolean (manifest, map_id, "Invalid", TRUE);
+	}
+	else {
+		g_key_file_set_string (manifest, map_id, "Title", title);
+		if (key)
+			g_key_file_set_string (manifest, map_id, "Key", key);
+		g_key_file_set_string (manifest, map_id, "Format", format);
+		g_key_file_set_integer (manifest, map_id, "Proj", PyInt_AsLong (value));
+	}
+
+	Py_XDECREF (value);
+	g_free (title);
+	g_free (key);
+	g_free (format);
+}
+
+static gchar **
+load_mirrors (PyObject *module, const gchar *map_id)
+{
+	Py_ssize_t i, n;
+
+	PyObject *value = PyObject_GetAttrString (module, "mirrors");
+	if (!value) {
+		PyErr_Clear();
+		return NULL;
+	}
+	if (!PySequence_Check (value) || PyString_Check (value)) {
+		g_warning ("Bad 'mirrors' for map '%s'", map_id);
+		Py_DECREF (value);
+		return NULL;
+	}
+
+	n = PySequence_Size (value);
+	gchar **hosts = g_new0 (gchar *, n + 1);
+	gsize n_hosts = 0;
+	for (i = 0; i < n; i++) {
+		PyObject *item = PySequence_GetItem (value, i);
+		if (item && PyString_Check (item))
+			hosts[n_hosts++] = g_strdup (PyString_AsString (item));
+		else {
+			PyErr_Clear();
+			g_warning ("Skipping bad entry %zd in 'mirrors' for map '%s'", i, map_id);
+		}
+		Py_XDECREF (item);
+	}
+	Py_DECREF (value);
+
+	return hosts;
+}
+
+GPtrArray *
+mapius_map_source_load_all (const gchar *maps_dir, const gchar *manifest_file, GError **error)
+{
+	PyObject *module;
+	GError *err = NULL;
+	GStatBuf st;
+	const gchar *fn;
+	gsize i, n_groups;
+
+	GDir *dir = g_dir_open (maps_dir, 0, error);
+	if (!dir)
+		return NULL;
+
+	g_free (python_path);
+	python_path = g_strdup (maps_dir);
+
+	GKeyFile *manifest = g_key_file_new ();
+	g_key_file_load_from_file (manifest, manifest_file, G_KEY_FILE_NONE, NULL);
+	gboolean manifest_dirty = FALSE;
+
+	GHashTable *found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	GPtrArray *sources = g_ptr_array_new ();
+
+	while ((fn = g_dir_read_name (dir))) {
+		if (!g_str_has_suffix (fn, ".py"))
+			continue;
+
+		gchar *map_id = g_strndup (fn, strlen(fn) - 3);
+		g_hash_table_add (found, map_id);
+
+		gchar *path = g_build_filename (maps_dir, fn, NULL);
+		gint64 mtime = g_stat (path, &st) == 0 ? (gint64) st.st_mtime : 0;
+		g_free (path);
+
+		module = NULL;
+		if (!g_key_file_has_group (manifest, map_id) || g_key_file_get_int64 (manifest, map_id, "MTime", NULL) != mtime) {
+			g_debug ("  %s (updating manifest)", map_id);
+			module = import_map_module (map_id);
+			manifest_update_entry (manifest, map_id, mtime, module);
+			manifest_dirty = TRUE;
+		}
+		else {
+			g_debug ("  %s", map_id);
+		}
+
+		if (g_key_file_get_boolean (manifest, map_id, "Invalid", NULL)) {
+			Py_XDECREF (module);
+			continue;
+		}
+
+		MapSource *source = g_new0 (MapSource, 1);
+		source->source.id = g_strdup (map_id);
+		source->source.title = g_key_file_get_string (manifest, map_id, "Title", NULL);
+		source->source.key = g_key_file_get_string (manifest, map_id, "Key", NULL);
+		source->source.format = g_key_file_get_string (manifest, map_id, "Format", NULL);
+		source->source.epsg = g_key_file_get_integer (manifest, map_id, "Proj", NULL);
+		source->module = module;
+		g_ptr_array_add (sources, source);
+	}
+
+	g_dir_close (dir);
+
+	gchar **groups = g_key_file_get_groups (manifest, &n_groups);
+	for (i = 0; i < n_groups; i++) {
+		if (!g_hash_table_contains (found, groups[i])) {
+			g_key_file_remove_group (manifest, groups[i], NULL);
+			manifest_dirty = TRUE;
+		}
+	}
+	g_strfreev (groups);
+	g_hash_table_destroy (found);
+
+	if (manifest_dirty) {
+		gchar *manifest_dir = g_path_get_dirname (manifest_file);
+		g_mkdir_with_parents (manifest_dir, 0755);
+		g_free (manifest_dir);
+
+		if (!g_key_file_save_to_file (manifest, manifest_file, &err)) {
+			g_warning ("Error saving maps manifest: %s", err->message);
+			g_clear_error (&err);
+		}
+	}
+	g_key_file_free (manifest);
+
+	return sources;
+}
+
+gboolean
+mapius_map_source_prepare (MapiusMapSource *source)
+{
+	MapSource *map_source = (MapSource *) source;
+
+	if (map_source->prepared)
+		return map_source->ready;
+
+	map_source->prepared = TRUE;
+
+	if (!map_source->module)
+		map_source->module = import_map_module (source->id);
+	if (!map_source->module)
+		return FALSE;
+
+	map_source->url_func = PyObject_GetAttrString (map_source->module, "url");
+	if (!map_source->url_func)
+		PyErr_Clear();
+
+	map_source->url_template = load_url_template (map_source->module, source->id);
+	if (!map_source->url_func && !map_source->url_template) {
+		g_warning ("No 'url' function or 'url_template' for map '%s'", source->id);
+		return FALSE;
+	}
+
+	map_source->mirrors = load_mirrors (map_source->module, source->id);
+	map_source->ready = TRUE;
+
+	return TRUE;
+}
+
+gchar *
+mapius_map_source_get_url (MapiusMapSource *source, guint zoom, guint x, guint y)
+{
+	MapSource *map_source = (MapSource *) source;
+
+	if (!mapius_map_source_prepare (source))
+		return NULL;
+
+	if (map_source->url_template)
+		return mapius_url_template_expand_dup (map_source->url_template, zoom, x, y);
+
+	PyObject *value = PyObject_CallFunction (map_source->url_func, "(iii)", x, y, zoom);
+	if (!value) {
+		PyErr_Print();
+		g_warning ("get_tile_url failed for map '%s'", source->id);
+		return NULL;
+	}
+
+	gchar *result = g_strdup (PyString_AsString (value));
+	Py_DECREF (value);
+
+	return result;
+}
+
+const gchar * const *
+mapius_map_source_get_mirrors (MapiusMapSource *source)
+{
+	MapSource *map_source = (MapSource *) source;
+
+	if (!mapius_map_source_prepare (source))
+		return NULL;
+
+	return (const gchar * const *) map_source->mirrors;
+}
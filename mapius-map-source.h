@@ -0,0 +1,22 @@
+#ifndef __MAPIUS_MAP_SOURCE_H__
+#define __MAPIUS_MAP_SOURCE_H__
+
+#include <glib.h>
+
+typedef struct _MapiusMapSource MapiusMapSource;
+
+struct _MapiusMapSource
+{
+	gchar *id;
+	gchar *title;
+	gchar *key;
+	gchar *format;
+	gint epsg;
+};
+
+GPtrArray *mapius_map_source_load_all (const gchar *maps_dir, const gchar *manifest_file, GError **error);
+gboolean mapius_map_source_prepare (MapiusMapSource *source);
+gchar *mapius_map_source_get_url (MapiusMapSource *source, guint zoom, guint x, guint y);
+const gchar * const *mapius_map_source_get_mirrors (MapiusMapSource *source);
+
+#endif
@@ -1,24 +1,68 @@
-#include <Python.h>
+#include <errno.h>
 #include <glib/gstdio.h>
 #include <libsoup/soup.h>
-#include <proj_api.h>
 
+#include "mapius-disk-cache.h"
+#include "mapius-fetcher.h"
 #include "mapius-map.h"
-
-#define SPHERICAL_MERCATOR_PROJ "+proj=merc +lon_0=0 +k=1 +x_0=0 +y_0=0 +a=6378137 +b=6378137 +units=m +no_defs"
-#define ELLIPSE_MERCATOR_PROJ "+proj=merc +lon_0=0 +k=1 +x_0=0 +y_0=0 +ellps=WGS84 +datum=WGS84 +units=m +no_defs"
-#define EQUATOR_HALFLENGTH 20037508.34
+#include "mapius-map-source.h"
+#include "mapius-negative-cache.h"
+#include "mapius-projection.h"
+#include "mapius-tile-cache.h"
+#include "mapius-tile-decoder.h"
+#include "mapius-tile-table.h"
+#include "mapius-util.h"
+
+#define EQUATOR_HALFLENGTH MAPIUS_EQUATOR_HALFLENGTH
+
+#define PRIORITY_BAND (G_MAXINT / 4)
+#define PRIORITY_VISIBLE 0
+#define PRIORITY_PREFETCH PRIORITY_BAND
+#define PRIORITY_PREFETCH_ZOOM (PRIORITY_BAND * 2)
+#define PRIORITY_REVALIDATE (PRIORITY_BAND * 3)
+#define PREFETCH_LOOKAHEAD 500
+#define ZOOM_DURATION 250000
+#define ZOOM_SNAP_DELAY 300
+#define KINETIC_MIN_VELOCITY 0.02
+#define KINETIC_RELEASE_DELAY 50
 
 typedef struct
 {
+	guint index;
 	gchar *id;
 	gchar *title;
 	gchar *format;
 	projPJ proj;
-	PyObject *module;
-	PyObject *url_func;
+	MapiusMapSource *source;
+	gboolean loaded;
 } MapInfo;
 
+typedef struct
+{
+	guint map;
+	guint zoom;
+	guint min_x;
+	guint max_x;
+	guint min_y;
+	guint max_y;
+} TileRange;
+
+typedef struct
+{
+	guint zoom;
+	guint tile_x;
+	guint tile_y;
+	gint priority;
+} TileCandidate;
+
+typedef struct
+{
+	TileRange range;
+	gint priority;
+	gint64 center_x;
+	gint64 center_y;
+} PrefetchArea;
+
 struct _MapiusMapPrivate
 {
 	gint center_x;
@@ -28,45 +72,147 @@ struct _MapiusMapPrivate
 	guint start_x;
 	guint start_y;
 	guint zoom;
-	GHashTable *tiles;
-	GHashTable *loading;
+	MapiusTileCache *tiles;
+	MapiusTileTable *requests;
+	guint reading;
+	guint downloading;
+	guint decoding;
+	MapiusMapStats stats;
+	gboolean show_stats;
+	guint stats_source_id;
+	gchar *stats_file;
+	guint stats_interval;
+	guint stats_elapsed;
+	MapiusTileDecoder *decoder;
+	MapiusDiskCache *disk_cache;
+	MapiusNegativeCache *negative_cache;
+	guint negative_cache_save_id;
 	SoupSession *soup_session;
+	MapiusFetcher *fetcher;
+	gint64 default_max_age;
+	TileRange scheduled_range;
+	guint update_source_id;
+	PrefetchArea prefetch_areas[4];
+	guint n_prefetch_areas;
+	guint prefetch_margin;
+	gboolean prefetch_zoom;
+	guint prefetch_source_id;
+	gdouble velocity_x;
+	gdouble velocity_y;
+	guint32 motion_time;
 	gboolean button_press;
-	guint current_ts;
-	projPJ spherical_mercator_proj;
-	projPJ ellipse_mercator_proj;
 	GHashTable *maps;
+	GPtrArray *map_list;
 	MapInfo *current_map;
 	gchar *cache_dir;
 	gchar *maps_dir;
 	guint cursor_x;
 	guint cursor_y;
 	guint cursor_timeout_id;
+	guint evict_source_id;
+	cairo_surface_t *backing;
+	cairo_surface_t *backing_scratch;
+	cairo_region_t *backing_damage;
+	gint backing_width;
+	gint backing_height;
+	MapInfo *backing_map;
+	guint backing_zoom;
+	gint backing_x;
+	gint backing_y;
+	cairo_region_t *backing_missing;
+	cairo_region_t *redraw_region;
+	guint redraw_tick_id;
+	gdouble zoom_scale;
+	gdouble zoom_start_scale;
+	gdouble zoom_target_scale;
+	gint64 zoom_start_time;
+	gdouble zoom_anchor_x;
+	gdouble zoom_anchor_y;
+	guint zoom_tick_id;
+	gdouble scroll_delta;
+	guint zoom_snap_id;
+	cairo_filter_t render_filter;
+	gdouble friction;
+	guint kinetic_tick_id;
+	gint64 kinetic_time;
+	gdouble kinetic_x;
+	gdouble kinetic_y;
+	gint64 request_center_x;
+	gint64 request_center_y;
 };
 
-typedef struct
+typedef enum
 {
-	GdkPixbuf *pixbuf;
-	guint ts;
-} Tile;
+	TILE_ABSENT,
+	TILE_READING,
+	TILE_DOWNLOADING,
+	TILE_DECODING,
+	TILE_READY,
+	TILE_REVALIDATING,
+	TILE_FAILED
+} TileState;
 
 typedef struct
 {
 	MapiusMap *map;
-	gchar *folder;
-	gchar *filename;
+	MapInfo *map_info;
+	MapiusTileKey key;
+	guint zoom;
 	guint tile_x;
 	guint tile_y;
+	TileState state;
+	gint priority;
+	MapiusFetch *fetch;
+	MapiusTileDecodeJob *decode_job;
+	GBytes *stale_bytes;
+	MapiusTileMeta *stale_meta;
+	GBytes *fetched_bytes;
+	MapiusTileMeta *fetched_meta;
+	gboolean from_disk;
+	gboolean cancelled;
+	guint ref_count;
 } TileInfo;
 
+enum
+{
+	PROP_0,
+	PROP_SHOW_STATS,
+	PROP_STATS
+};
+
 G_DEFINE_TYPE (MapiusMap, mapius_map, GTK_TYPE_DRAWING_AREA);
 
+static MapiusMapStats *
+mapius_map_stats_copy (MapiusMapStats *stats)
+{
+	MapiusMapStats *copy = g_new (MapiusMapStats, 1);
+	*copy = *stats;
+
+	return copy;
+}
+
+static void
+mapius_map_stats_free (MapiusMapStats *stats)
+{
+	g_free (stats);
+}
+
+G_DEFINE_BOXED_TYPE (MapiusMapStats, mapius_map_stats, mapius_map_stats_copy, mapius_map_stats_free);
+
 static gboolean mapius_map_draw (GtkWidget *widget, cairo_t *cr);
 static gboolean mapius_map_key_press (GtkWidget *widget, GdkEventKey *event);
 static gboolean mapius_map_button_press (GtkWidget *widget, GdkEventButton *event);
 static gboolean mapius_map_button_release (GtkWidget *widget, GdkEventButton *event);
 static gboolean mapius_map_motion_notify (GtkWidget *widget, GdkEventMotion *event);
 static gboolean mapius_map_scroll (GtkWidget *widget, GdkEventScroll *event);
+static void tile_decoded (MapiusTileKey key, cairo_surface_t *surface, MapiusMap *map);
+static void tile_info_release (TileInfo *info);
+static void mapius_map_schedule_prefetch (MapiusMap *map);
+static gboolean tile_info_fetch (TileInfo *info, gint priority);
+static void mapius_map_destroy (GtkWidget *widget);
+static void mapius_map_damage_tile (MapiusMap *map, MapiusTileKey key);
+static void mapius_map_stop_kinetic (MapiusMap *map);
+static gboolean mapius_map_update_stats (MapiusMap *map);
 
 GtkWidget *
 mapius_map_new()
@@ -95,30 +241,225 @@ mapius_map_change_map (MapiusMap *map, gchar *id)
 
 		priv->current_map = map_info;
 
-		soup_session_abort (priv->soup_session);
-		g_hash_table_remove_all (priv->loading);
-
-		priv->current_ts++;
-
 		g_signal_emit_by_name (GTK_WIDGET (map), "map-changed", map_info->title);
 
 		gtk_widget_queue_draw (GTK_WIDGET (map));
 	}
 }
 
+static gboolean
+mapius_map_evict_tiles (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	priv->evict_source_id = 0;
+
+	guint res = mapius_tile_cache_evict (priv->tiles);
+	priv->stats.evictions += res;
+	g_debug ("Evicted %d tiles, left %d (%" G_GSIZE_FORMAT " bytes)", res, mapius_tile_cache_size (priv->tiles), mapius_tile_cache_get_usage (priv->tiles));
+
+	return FALSE;
+}
+
+static void
+mapius_map_schedule_eviction (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	if (!priv->evict_source_id && mapius_tile_cache_over_budget (priv->tiles))
+		priv->evict_source_id = g_idle_add_full (G_PRIORITY_LOW, (GSourceFunc) mapius_map_evict_tiles, map, NULL);
+}
+
+void
+mapius_map_set_cache_budget (MapiusMap *map, gsize bytes)
+{
+	mapius_tile_cache_set_budget (map->priv->tiles, bytes);
+	mapius_map_schedule_eviction (map);
+}
+
+gsize
+mapius_map_get_cache_budget (MapiusMap *map)
+{
+	return mapius_tile_cache_get_budget (map->priv->tiles);
+}
+
+gsize
+mapius_map_get_cache_usage (MapiusMap *map)
+{
+	return mapius_tile_cache_get_usage (map->priv->tiles);
+}
+
+void
+mapius_map_get_stats (MapiusMap *map, MapiusMapStats *stats)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	*stats = priv->stats;
+	mapius_disk_cache_get_stats (priv->disk_cache, &stats->disk_reads, &stats->redundant_reads);
+	stats->disk_usage = mapius_disk_cache_get_usage (priv->disk_cache, priv->current_map->id);
+	stats->memory_usage = mapius_tile_cache_get_usage (priv->tiles);
+	mapius_tile_decoder_get_stats (priv->decoder, &stats->decode_queued, &stats->decode_time);
+	stats->reading = priv->reading;
+	stats->downloading = priv->downloading;
+	stats->decoding = priv->decoding;
+	stats->fetch_queued = mapius_fetcher_get_queued (priv->fetcher);
+	stats->fetch_active = mapius_fetcher_get_active (priv->fetcher);
+}
+
+static void
+mapius_map_update_stats_timer (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+	gboolean wanted = priv->show_stats || priv->stats_file;
+
+	if (wanted && !priv->stats_source_id) {
+		priv->stats_source_id = g_timeout_add_seconds (1, (GSourceFunc) mapius_map_update_stats, map);
+	}
+	else if (!wanted && priv->stats_source_id) {
+		g_source_remove (priv->stats_source_id);
+		priv->stats_source_id = 0;
+	}
+}
+
+void
+mapius_map_set_show_stats (MapiusMap *map, gboolean show)
+{
+	show = !!show;
+	if (map->priv->show_stats == show)
+		return;
+
+	map->priv->show_stats = show;
+	mapius_map_update_stats_timer (map);
+	gtk_widget_queue_draw (GTK_WIDGET (map));
+	g_object_notify (G_OBJECT (map), "show-stats");
+}
+
+gboolean
+mapius_map_get_show_stats (MapiusMap *map)
+{
+	return map->priv->show_stats;
+}
+
+GArray *
+mapius_map_get_host_stats (MapiusMap *map)
+{
+	return mapius_fetcher_get_host_stats (map->priv->fetcher);
+}
+
+void
+mapius_map_set_view (MapiusMap *map, guint zoom, gint x, gint y)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	mapius_map_stop_kinetic (map);
+	priv->velocity_x = 0;
+	priv->velocity_y = 0;
+	priv->center_x = x;
+	priv->center_y = y;
+
+	zoom = MIN (zoom, 24);
+	if (zoom != priv->zoom) {
+		priv->zoom = zoom;
+		priv->zoom_scale = 1.0;
+		g_signal_emit_by_name (GTK_WIDGET (map), "zoom-changed", priv->zoom);
+	}
+
+	gtk_widget_queue_draw (GTK_WIDGET (map));
+}
+
+void
+mapius_map_get_view (MapiusMap *map, guint *zoom, gint *x, gint *y)
+{
+	*zoom = map->priv->zoom;
+	*x = map->priv->center_x;
+	*y = map->priv->center_y;
+}
+
+/* Holds the view at one frame of a zoom animation around the widget
+ * center, e.g. to time mapius_map_render_scaled(). */
+void
+mapius_map_set_zoom_scale (MapiusMap *map, gdouble scale)
+{
+	GtkWidget *widget = GTK_WIDGET (map);
+	MapiusMapPrivate *priv = map->priv;
+
+	if (priv->zoom_tick_id) {
+		gtk_widget_remove_tick_callback (widget, priv->zoom_tick_id);
+		priv->zoom_tick_id = 0;
+	}
+
+	priv->zoom_anchor_x = gtk_widget_get_allocated_width (widget) / 2;
+	priv->zoom_anchor_y = gtk_widget_get_allocated_height (widget) / 2;
+	priv->zoom_scale = scale;
+
+	gtk_widget_queue_draw (widget);
+}
+
+const gchar *
+mapius_map_get_map_id (MapiusMap *map)
+{
+	return map->priv->current_map->id;
+}
+
+void
+mapius_map_insert_tile (MapiusMap *map, guint zoom, guint x, guint y, cairo_surface_t *surface)
+{
+	MapiusMapPrivate *priv = map->priv;
+	MapiusTileKey key = MAPIUS_TILE_KEY (priv->current_map->index, zoom, x, y);
+
+	mapius_tile_cache_insert (priv->tiles, key, cairo_surface_reference (surface));
+	mapius_map_schedule_eviction (map);
+	mapius_map_damage_tile (map, key);
+}
+
+static void
+mapius_map_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	switch (prop_id) {
+	case PROP_SHOW_STATS:
+		mapius_map_set_show_stats (MAPIUS_MAP (object), g_value_get_boolean (value));
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+	}
+}
+
+static void
+mapius_map_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	MapiusMapStats stats;
+
+	switch (prop_id) {
+	case PROP_SHOW_STATS:
+		g_value_set_boolean (value, mapius_map_get_show_stats (MAPIUS_MAP (object)));
+		break;
+	case PROP_STATS:
+		mapius_map_get_stats (MAPIUS_MAP (object), &stats);
+		g_value_set_boxed (value, &stats);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+	}
+}
+
 static void
 mapius_map_class_init (MapiusMapClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
 	g_type_class_add_private (klass, sizeof (MapiusMapPrivate));
 
+	object_class->set_property = mapius_map_set_property;
+	object_class->get_property = mapius_map_get_property;
+
 	widget_class->draw = mapius_map_draw;
 	widget_class->key_press_event = mapius_map_key_press;
 	widget_class->button_press_event = mapius_map_button_press;
 	widget_class->button_release_event = mapius_map_button_release;
 	widget_class->motion_notify_event = mapius_map_motion_notify;
 	widget_class->scroll_event = mapius_map_scroll;
+	widget_class->destroy = mapius_map_destroy;
 
 	g_signal_new ("loading", MAPIUS_TYPE_MAP,
 		G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
@@ -131,6 +472,18 @@ mapius_map_class_init (MapiusMapClass *klass)
 	g_signal_new ("map-changed", MAPIUS_TYPE_MAP,
 		G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
 		g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 1, G_TYPE_STRING);
+
+	g_signal_new ("stats-updated", MAPIUS_TYPE_MAP,
+		G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
+		g_cclosure_marshal_VOID__BOXED, G_TYPE_NONE, 1, MAPIUS_TYPE_MAP_STATS | G_SIGNAL_TYPE_STATIC_SCOPE);
+
+	g_object_class_install_property (object_class, PROP_SHOW_STATS,
+		g_param_spec_boolean ("show-stats", "Show statistics", "Whether to draw the statistics overlay",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (object_class, PROP_STATS,
+		g_param_spec_boxed ("stats", "Statistics", "Snapshot of the performance counters",
+			MAPIUS_TYPE_MAP_STATS, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 }
 
 static gint
@@ -139,121 +492,74 @@ compare_maps (MapiusMapInfo *a, MapiusMapInfo *b)
 	return g_strcmp0 (a->title, b->title);
 }
 
+static gboolean
+map_info_load (MapiusMap *map, MapInfo *map_info)
+{
+	const gchar * const *mirrors;
+
+	if (!map_info->loaded) {
+		map_info->loaded = TRUE;
+		mirrors = mapius_map_source_get_mirrors (map_info->source);
+		if (mirrors)
+			mapius_fetcher_add_mirrors (map->priv->fetcher, mirrors);
+	}
+
+	return mapius_map_source_prepare (map_info->source);
+}
+
 static void
 mapius_map_init_maps (MapiusMap *map)
 {
 	MapiusMapPrivate *priv = map->priv;
-	PyObject *name, *module, *func, *value;
 	GError *err = NULL;
-	GDir *dir;
-	const gchar *fn;
-	gchar *map_id;
+	guint i;
 
-	Py_Initialize();
-	PySys_SetPath (priv->maps_dir);
+	g_debug ("Loading maps");
 
-	dir = g_dir_open (priv->maps_dir, 0, &err);
+	gchar *manifest_file = g_build_filename (priv->cache_dir, "maps.manifest", NULL);
+	GPtrArray *sources = mapius_map_source_load_all (priv->maps_dir, manifest_file, &err);
 	if (err) {
 		g_error ("Error opening maps directory: %s", err->message);
 	}
+	g_free (manifest_file);
 
-	g_debug ("Loading maps");
-
-	priv->maps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	priv->maps = g_hash_table_new (g_str_hash, g_str_equal);
+	priv->map_list = g_ptr_array_new ();
 	priv->current_map = NULL;
 
-	while ((fn = g_dir_read_name (dir))) {
-		if (!g_str_has_suffix (fn, ".py"))
-			continue;
-
-		map_id = g_strndup (fn, strlen(fn) - 3);
-
-		g_debug ("  %s", map_id);
-
-		name = PyString_FromString (map_id);
-		module = PyImport_Import (name);
-		Py_DECREF (name);
-
-		if (!module) {
-			PyErr_Print();
-			g_warning ("Error loading map '%s'", map_id);
-			continue;
-		}
-
-		func = PyObject_GetAttrString (module, "url");
-		if (!func) {
-			g_warning ("No 'url' function for map '%s'\n", map_id);
-			continue;
-		}
-
-		value = PyObject_GetAttrString (module, "title");
-		if (!value) {
-			g_warning ("No title for map '%s'", map_id);
-			continue;
-		}
-		gchar *title = g_strdup (PyString_AsString (value));
-		Py_DECREF (value);
+	for (i = 0; i < sources->len; i++) {
+		MapiusMapSource *source = g_ptr_array_index (sources, i);
 
 		guint keyval = 0;
-		value = PyObject_GetAttrString (module, "key");
-		if (value) {
-			gchar *key = g_strdup (PyString_AsString (value));
-			Py_DECREF (value);
-			keyval = gdk_keyval_from_name (key);
-			g_free (key);
+		if (source->key) {
+			keyval = gdk_keyval_from_name (source->key);
 			if (keyval == GDK_KEY_VoidSymbol)
 				keyval = 0;
 		}
 
-		value = PyObject_GetAttrString (module, "format");
-		if (!value) {
-			g_warning ("No format for map '%s'", map_id);
+		projPJ proj = mapius_projection_for_epsg (source->epsg);
+		if (!proj) {
+			g_warning ("Unknown projection %d for map '%s'", source->epsg, source->id);
 			continue;
 		}
-		gchar *format = g_strdup (PyString_AsString (value));
-		Py_DECREF (value);
 
-		value = PyObject_GetAttrString (module, "proj");
-		if (!value) {
-			g_warning ("No projection for map '%s'", map_id);
-			continue;
-		}
-		if (!PyInt_Check (value)) {
-			g_warning ("Bad projection for map '%s'", map_id);
-			Py_DECREF (value);
-			continue;
-		}
-		int epsg = PyInt_AsLong (value);
-		Py_DECREF (value);
-
-		projPJ proj;
-		if (epsg == 3857) {
-			proj = priv->spherical_mercator_proj;
-		}
-		else if (epsg == 3395) {
-			proj = priv->ellipse_mercator_proj;
-		}
-		else {
-			g_warning ("Unknown projection %d for map '%s'", epsg, map_id);
-			continue;
-		}
-
-		MapInfo *map_info = g_new (MapInfo, 1);
-		map_info->id = map_id;
-		map_info->title = title;
-		map_info->format = format;
+		MapInfo *map_info = g_new0 (MapInfo, 1);
+		map_info->index = priv->map_list->len;
+		map_info->id = source->id;
+		map_info->title = source->title;
+		map_info->format = source->format;
 		map_info->proj = proj;
-		map_info->module = module;
-		map_info->url_func = func;
-		g_hash_table_insert (priv->maps, map_id, map_info);
+		map_info->source = source;
+		g_hash_table_insert (priv->maps, source->id, map_info);
+		g_ptr_array_add (priv->map_list, map_info);
 
-		if (!priv->current_map || g_strcmp0 (map_id, "osmmapMapnik") == 0) {
+		if (!priv->current_map || g_strcmp0 (source->id, "osmmapMapnik") == 0) {
 			priv->current_map = map_info;
 		}
 
 		MapiusMapInfo *info = g_new (MapiusMapInfo, 1);
-		info->id = map_id;
-		info->title = title;
+		info->id = source->id;
+		info->title = source->title;
 		info->accel_key = keyval;
 		if (keyval) {
 			if (gdk_keyval_is_lower (keyval)) {
@@ -266,6 +572,8 @@ mapius_map_init_maps (MapiusMap *map)
 		map->maps = g_slist_prepend (map->maps, info);
 	}
 
+	g_ptr_array_free (sources, TRUE);
+
 	if (g_hash_table_size (priv->maps) == 0) {
 		g_error ("Maps not found");
 	}
@@ -273,23 +581,172 @@ mapius_map_init_maps (MapiusMap *map)
 	map->maps = g_slist_sort (map->maps, (GCompareFunc) compare_maps);
 }
 
+static gchar *
+negative_cache_filename (guint map_index, MapiusMap *map)
+{
+	MapInfo *map_info = g_ptr_array_index (map->priv->map_list, map_index);
+
+	return g_build_filename (map->priv->cache_dir, map_info->id, "negative.cache", NULL);
+}
+
 static void
-tile_free (Tile *tile)
+mapius_map_load_negative_cache (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+	guint i;
+
+	for (i = 0; i < priv->map_list->len; i++) {
+		gchar *filename = negative_cache_filename (i, map);
+		mapius_negative_cache_load (priv->negative_cache, i, filename);
+		g_free (filename);
+	}
+}
+
+static gboolean
+mapius_map_save_negative_cache (MapiusMap *map)
+{
+	if (mapius_negative_cache_is_dirty (map->priv->negative_cache))
+		mapius_negative_cache_save (map->priv->negative_cache, (MapiusNegativeCacheFileFunc) negative_cache_filename, map);
+
+	return TRUE;
+}
+
+static void
+mapius_map_dump_stats (MapiusMap *map, MapiusMapStats *stats)
+{
+	MapiusMapPrivate *priv = map->priv;
+	guint i;
+
+	const struct { const gchar *name; guint64 value; } counters[] = {
+		{ "frames", stats->frames },
+		{ "frame_time_total_us", stats->frame_time_total },
+		{ "frame_time_max_us", stats->frame_time_max },
+		{ "cache_hits", stats->cache_hits },
+		{ "cache_misses", stats->cache_misses },
+		{ "memory_usage", stats->memory_usage },
+		{ "evictions", stats->evictions },
+		{ "disk_reads", stats->disk_reads },
+		{ "redundant_reads", stats->redundant_reads },
+		{ "disk_hits", stats->disk_hits },
+		{ "disk_usage", stats->disk_usage },
+		{ "downloads", stats->downloads },
+		{ "bytes_fetched", stats->bytes_fetched },
+		{ "failures", stats->failures },
+		{ "negative_hits", stats->negative_hits },
+		{ "revalidations", stats->revalidations },
+		{ "not_modified", stats->not_modified },
+		{ "deduplicated", stats->deduplicated },
+		{ "cancelled", stats->cancelled },
+		{ "prefetches", stats->prefetches },
+		{ "decodes", stats->decodes },
+		{ "decode_time_us", stats->decode_time },
+		{ "reading", stats->reading },
+		{ "downloading", stats->downloading },
+		{ "decoding", stats->decoding },
+		{ "fetch_queued", stats->fetch_queued },
+		{ "fetch_active", stats->fetch_active },
+		{ "decode_queued", stats->decode_queued },
+	};
+
+	gchar *map_id = mapius_json_escape (priv->current_map->id);
+	GString *line = g_string_new (NULL);
+	g_string_append_printf (line, "{\"time\": %" G_GINT64_FORMAT ", \"map\": \"%s\"",
+		g_get_real_time () / G_USEC_PER_SEC, map_id);
+	g_free (map_id);
+	for (i = 0; i < G_N_ELEMENTS (counters); i++)
+		g_string_append_printf (line, ", \"%s\": %" G_GUINT64_FORMAT, counters[i].name, counters[i].value);
+	g_string_append (line, ", \"frame_times\": [");
+	for (i = 0; i < MAPIUS_MAP_FRAME_BUCKETS; i++)
+		g_string_append_printf (line, i ? ", %" G_GUINT64_FORMAT : "%" G_GUINT64_FORMAT, stats->frame_times[i]);
+	g_string_append (line, "]}\n");
+
+	FILE *file = g_fopen (priv->stats_file, "a");
+	if (file) {
+		fputs (line->str, file);
+		fclose (file);
+	}
+	else {
+		g_warning ("Error writing statistics to %s: %s", priv->stats_file, g_strerror (errno));
+	}
+
+	g_string_free (line, TRUE);
+}
+
+static gboolean
+mapius_map_update_stats (MapiusMap *map)
 {
-	g_object_unref (tile->pixbuf);
-	g_free (tile);
+	MapiusMapPrivate *priv = map->priv;
+	MapiusMapStats stats;
+
+	mapius_map_get_stats (map, &stats);
+	g_signal_emit_by_name (map, "stats-updated", &stats);
+
+	if (priv->stats_file && ++priv->stats_elapsed >= priv->stats_interval) {
+		priv->stats_elapsed = 0;
+		mapius_map_dump_stats (map, &stats);
+	}
+
+	if (priv->show_stats)
+		gtk_widget_queue_draw (GTK_WIDGET (map));
+
+	return TRUE;
 }
 
 static void
-make_abs_path (gchar **path)
+mapius_map_destroy (GtkWidget *widget)
 {
-	if (!g_path_is_absolute (*path)) {
-		gchar *cur_dir = g_get_current_dir();
-		gchar *abs_path = g_build_filename (cur_dir, *path, NULL);
-		g_free (cur_dir);
-		g_free (*path);
-		*path = abs_path;
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
+
+	if (priv->stats_file) {
+		MapiusMapStats stats;
+		mapius_map_get_stats (MAPIUS_MAP (widget), &stats);
+		mapius_map_dump_stats (MAPIUS_MAP (widget), &stats);
+	}
+	priv->show_stats = FALSE;
+	g_clear_pointer (&priv->stats_file, g_free);
+	mapius_map_update_stats_timer (MAPIUS_MAP (widget));
+
+	if (priv->negative_cache_save_id) {
+		g_source_remove (priv->negative_cache_save_id);
+		priv->negative_cache_save_id = 0;
+		mapius_map_save_negative_cache (MAPIUS_MAP (widget));
+	}
+
+	if (priv->update_source_id) {
+		g_source_remove (priv->update_source_id);
+		priv->update_source_id = 0;
+	}
+
+	if (priv->prefetch_source_id) {
+		g_source_remove (priv->prefetch_source_id);
+		priv->prefetch_source_id = 0;
+	}
+
+	if (priv->redraw_tick_id) {
+		gtk_widget_remove_tick_callback (widget, priv->redraw_tick_id);
+		priv->redraw_tick_id = 0;
 	}
+
+	if (priv->zoom_tick_id) {
+		gtk_widget_remove_tick_callback (widget, priv->zoom_tick_id);
+		priv->zoom_tick_id = 0;
+	}
+
+	if (priv->zoom_snap_id) {
+		g_source_remove (priv->zoom_snap_id);
+		priv->zoom_snap_id = 0;
+	}
+
+	if (priv->kinetic_tick_id) {
+		gtk_widget_remove_tick_callback (widget, priv->kinetic_tick_id);
+		priv->kinetic_tick_id = 0;
+	}
+
+	g_clear_pointer (&priv->backing, cairo_surface_destroy);
+	g_clear_pointer (&priv->backing_scratch, cairo_surface_destroy);
+	priv->backing_map = NULL;
+
+	GTK_WIDGET_CLASS (mapius_map_parent_class)->destroy (widget);
 }
 
 static void
@@ -304,6 +761,11 @@ mapius_map_init (MapiusMap *map)
 		g_error ("Error loading settings file: %s", err->message);
 	}
 
+	int max_conns = g_key_file_get_integer (settings, "Network", "MaxConns", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
 	int max_conns_per_host = g_key_file_get_integer (settings, "Network", "MaxConnsPerHost", &err);
 	if (err) {
 		g_error ("Error loading settings: %s", err->message);
@@ -318,16 +780,110 @@ mapius_map_init (MapiusMap *map)
 	if (err) {
 		g_error ("Error loading settings: %s", err->message);
 	}
-	make_abs_path (&cache_dir);
+	mapius_make_abs_path (&cache_dir);
 	g_debug ("Cache directory: %s", cache_dir);
 
+	gchar *cache_format = g_key_file_get_string (settings, "Paths", "CacheFormat", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+	MapiusDiskCacheFormat disk_cache_format;
+	if (g_strcmp0 (cache_format, "files") == 0) {
+		disk_cache_format = MAPIUS_DISK_CACHE_FILES;
+	}
+	else if (g_strcmp0 (cache_format, "pack") == 0) {
+		disk_cache_format = MAPIUS_DISK_CACHE_PACK;
+	}
+	else {
+		g_error ("Unknown cache format: %s", cache_format);
+	}
+	g_free (cache_format);
+
+	int cache_max_size = g_key_file_get_integer (settings, "Paths", "CacheMaxSize", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
 	gchar *maps_dir = g_key_file_get_string (settings, "Paths", "Maps", &err);
 	if (err) {
 		g_error ("Error loading settings: %s", err->message);
 	}
-	make_abs_path (&maps_dir);
+	mapius_make_abs_path (&maps_dir);
 	g_debug ("Maps directory: %s", maps_dir);
 
+	int memory_size = g_key_file_get_integer (settings, "Cache", "MemorySize", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int decoder_threads = g_key_file_get_integer (settings, "Cache", "DecoderThreads", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int not_found_ttl = g_key_file_get_integer (settings, "Cache", "NotFoundTTL", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int decode_error_ttl = g_key_file_get_integer (settings, "Cache", "DecodeErrorTTL", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int retry_backoff = g_key_file_get_integer (settings, "Cache", "RetryBackoff", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int retry_backoff_max = g_key_file_get_integer (settings, "Cache", "RetryBackoffMax", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int default_max_age = g_key_file_get_integer (settings, "Cache", "DefaultMaxAge", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	int prefetch_margin = g_key_file_get_integer (settings, "Cache", "PrefetchMargin", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	gboolean prefetch_zoom = g_key_file_get_boolean (settings, "Cache", "PrefetchZoom", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	gdouble friction = g_key_file_get_double (settings, "View", "Friction", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	gchar *stats_file = g_key_file_get_string (settings, "Debug", "StatsFile", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+	if (*stats_file) {
+		mapius_make_abs_path (&stats_file);
+		g_debug ("Statistics file: %s", stats_file);
+	}
+	else {
+		g_free (stats_file);
+		stats_file = NULL;
+	}
+
+	int stats_interval = g_key_file_get_integer (settings, "Debug", "StatsInterval", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
+	gboolean show_stats = g_key_file_get_boolean (settings, "Debug", "ShowStats", &err);
+	if (err) {
+		g_error ("Error loading settings: %s", err->message);
+	}
+
 	g_key_file_free (settings);
 
 	map->priv = G_TYPE_INSTANCE_GET_PRIVATE (map, MAPIUS_TYPE_MAP, MapiusMapPrivate);
@@ -335,131 +891,719 @@ mapius_map_init (MapiusMap *map)
 	map->priv->center_x = 128;
 	map->priv->center_y = 128;
 	map->priv->zoom = 0;
-	map->priv->tiles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) tile_free);
-	map->priv->loading = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	map->priv->tiles = mapius_tile_cache_new ((gsize) memory_size * 1024 * 1024);
+	map->priv->requests = mapius_tile_table_new ((GDestroyNotify) tile_info_release);
+	map->priv->reading = 0;
+	map->priv->downloading = 0;
+	map->priv->decoding = 0;
+	memset (&map->priv->stats, 0, sizeof (MapiusMapStats));
+	map->priv->show_stats = show_stats;
+	map->priv->stats_file = stats_file;
+	map->priv->stats_interval = MAX (stats_interval, 1);
+	map->priv->stats_elapsed = 0;
+	map->priv->decoder = mapius_tile_decoder_new (MAX (decoder_threads, 0), (MapiusTileDecodedFunc) tile_decoded, map);
 	map->priv->soup_session = soup_session_async_new_with_options (
+		SOUP_SESSION_MAX_CONNS, max_conns,
 		SOUP_SESSION_MAX_CONNS_PER_HOST, max_conns_per_host,
 		SOUP_SESSION_USER_AGENT, user_agent,
 		NULL);
-	map->priv->current_ts = 0;
-	map->priv->spherical_mercator_proj = pj_init_plus (SPHERICAL_MERCATOR_PROJ);
-	map->priv->ellipse_mercator_proj = pj_init_plus (ELLIPSE_MERCATOR_PROJ);
+	map->priv->fetcher = mapius_fetcher_new (map->priv->soup_session, max_conns, max_conns_per_host);
+	map->priv->default_max_age = MAX (default_max_age, 0);
+	map->priv->update_source_id = 0;
+	memset (&map->priv->scheduled_range, 0, sizeof (TileRange));
+	map->priv->n_prefetch_areas = 0;
+	map->priv->prefetch_margin = MAX (prefetch_margin, 0);
+	map->priv->prefetch_zoom = prefetch_zoom;
+	map->priv->prefetch_source_id = 0;
+	map->priv->velocity_x = 0;
+	map->priv->velocity_y = 0;
+	map->priv->motion_time = 0;
 	map->priv->cache_dir = cache_dir;
+	map->priv->disk_cache = mapius_disk_cache_new (cache_dir, disk_cache_format, (guint64) MAX (cache_max_size, 0) * 1024 * 1024, map->priv->default_max_age);
+	map->priv->negative_cache = mapius_negative_cache_new (not_found_ttl, decode_error_ttl, retry_backoff, retry_backoff_max);
 	map->priv->maps_dir = maps_dir;
 	map->priv->cursor_timeout_id = 0;
+	map->priv->evict_source_id = 0;
+	map->priv->backing = NULL;
+	map->priv->backing_scratch = NULL;
+	map->priv->backing_damage = cairo_region_create ();
+	map->priv->backing_map = NULL;
+	map->priv->backing_missing = cairo_region_create ();
+	map->priv->redraw_region = cairo_region_create ();
+	map->priv->redraw_tick_id = 0;
+	map->priv->zoom_scale = 1.0;
+	map->priv->zoom_target_scale = 1.0;
+	map->priv->zoom_tick_id = 0;
+	map->priv->scroll_delta = 0;
+	map->priv->zoom_snap_id = 0;
+	map->priv->render_filter = CAIRO_FILTER_GOOD;
+	map->priv->friction = friction;
+	map->priv->kinetic_tick_id = 0;
+
+	mapius_map_init_maps (map);
+	mapius_map_load_negative_cache (map);
+	map->priv->negative_cache_save_id = g_timeout_add_seconds (60, (GSourceFunc) mapius_map_save_negative_cache, map);
+	map->priv->stats_source_id = 0;
+	mapius_map_update_stats_timer (map);
+
+	gtk_widget_add_events (
+		GTK_WIDGET (map),
+		GDK_POINTER_MOTION_HINT_MASK
+		| GDK_POINTER_MOTION_MASK
+		| GDK_BUTTON_PRESS_MASK
+		| GDK_BUTTON_RELEASE_MASK
+		| GDK_SCROLL_MASK
+		| GDK_SMOOTH_SCROLL_MASK
+		| GDK_KEY_PRESS_MASK
+	);
+	gtk_widget_set_can_focus (GTK_WIDGET (map), TRUE);
+
+	g_free (user_agent);
+}
+
+static TileInfo *
+tile_info_new (MapiusMap *map, guint zoom, guint tile_x, guint tile_y)
+{
+	MapiusMapPrivate *priv = map->priv;
+	TileInfo *info = g_new0 (TileInfo, 1);
+
+	info->map = map;
+	info->map_info = priv->current_map;
+	info->key = MAPIUS_TILE_KEY (priv->current_map->index, zoom, tile_x, tile_y);
+	info->zoom = zoom;
+	info->tile_x = tile_x;
+	info->tile_y = tile_y;
+	info->state = TILE_ABSENT;
+	info->priority = 0;
+	info->fetch = NULL;
+	info->decode_job = NULL;
+	info->stale_bytes = NULL;
+	info->stale_meta = NULL;
+	info->fetched_bytes = NULL;
+	info->fetched_meta = NULL;
+	info->from_disk = FALSE;
+	info->cancelled = FALSE;
+	info->ref_count = 1;
+
+	return info;
+}
+
+static TileInfo *
+tile_info_ref (TileInfo *info)
+{
+	info->ref_count++;
+	return info;
+}
+
+static void
+tile_info_clear_stale (TileInfo *info)
+{
+	if (info->stale_bytes) {
+		g_bytes_unref (info->stale_bytes);
+		info->stale_bytes = NULL;
+	}
+
+	if (info->stale_meta) {
+		mapius_tile_meta_free (info->stale_meta);
+		info->stale_meta = NULL;
+	}
+}
+
+static void
+tile_info_clear_fetched (TileInfo *info)
+{
+	if (info->fetched_bytes) {
+		g_bytes_unref (info->fetched_bytes);
+		info->fetched_bytes = NULL;
+	}
+
+	if (info->fetched_meta) {
+		mapius_tile_meta_free (info->fetched_meta);
+		info->fetched_meta = NULL;
+	}
+}
+
+static void
+tile_info_unref (TileInfo *info)
+{
+	if (--info->ref_count == 0) {
+		tile_info_clear_stale (info);
+		tile_info_clear_fetched (info);
+		g_free (info);
+	}
+}
+
+static void
+tile_info_set_state (TileInfo *info, TileState state)
+{
+	MapiusMapPrivate *priv = info->map->priv;
+
+	if (info->state == state)
+		return;
+
+	if (info->state == TILE_READING)
+		priv->reading--;
+	else if (info->state == TILE_DOWNLOADING)
+		priv->downloading--;
+	else if (info->state == TILE_DECODING)
+		priv->decoding--;
+
+	if (state == TILE_READING)
+		priv->reading++;
+	else if (state == TILE_DOWNLOADING)
+		priv->downloading++;
+	else if (state == TILE_DECODING)
+		priv->decoding++;
+
+	gboolean loading_changed = info->state == TILE_DOWNLOADING || state == TILE_DOWNLOADING;
+	info->state = state;
+
+	if (loading_changed)
+		g_signal_emit_by_name (info->map, "loading", priv->downloading);
+}
+
+static void
+tile_info_release (TileInfo *info)
+{
+	MapiusMapPrivate *priv = info->map->priv;
+
+	tile_info_set_state (info, TILE_ABSENT);
+	info->cancelled = TRUE;
+
+	if (info->fetch)
+		mapius_fetcher_cancel (priv->fetcher, info->fetch);
+
+	if (info->decode_job) {
+		mapius_tile_decode_job_cancel (info->decode_job);
+		mapius_tile_decode_job_unref (info->decode_job);
+		info->decode_job = NULL;
+	}
+
+	tile_info_unref (info);
+}
+
+static void
+tile_info_failed (TileInfo *info, guint status)
+{
+	MapiusMapPrivate *priv = info->map->priv;
+
+	tile_info_set_state (info, TILE_FAILED);
+	priv->stats.failures++;
+	mapius_negative_cache_add (priv->negative_cache, info->key, status);
+	mapius_tile_table_remove (priv->requests, info->key);
+	mapius_map_schedule_prefetch (info->map);
+}
+
+static void
+tile_info_decode (TileInfo *info, GBytes *bytes)
+{
+	MapiusMapPrivate *priv = info->map->priv;
+
+	if (info->decode_job)
+		mapius_tile_decode_job_unref (info->decode_job);
+
+	tile_info_set_state (info, TILE_DECODING);
+	info->decode_job = mapius_tile_decoder_push (priv->decoder, info->key, bytes);
+}
+
+static void
+tile_decoded (MapiusTileKey key, cairo_surface_t *surface, MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+	TileInfo *info = mapius_tile_table_lookup (priv->requests, key);
+
+	priv->stats.decodes++;
+
+	if (surface) {
+		mapius_tile_cache_insert (priv->tiles, key, surface);
+		mapius_map_schedule_eviction (map);
+
+		/* Downloads reach the disk cache only once they are known to
+		 * decode, so a bad response costs nothing there. */
+		if (info && info->fetched_bytes) {
+			mapius_disk_cache_store (priv->disk_cache, info->map_info->id, info->map_info->format, info->zoom, info->tile_x, info->tile_y, info->fetched_bytes, info->fetched_meta);
+			tile_info_clear_fetched (info);
+		}
+
+		if (info && info->stale_bytes) {
+			priv->stats.revalidations++;
+			tile_info_set_state (info, TILE_REVALIDATING);
+			if (!tile_info_fetch (info, PRIORITY_REVALIDATE + info->priority % PRIORITY_BAND))
+				mapius_tile_table_remove (priv->requests, key);
+		}
+		else if (info) {
+			mapius_tile_table_remove (priv->requests, key);
+		}
+
+		mapius_map_schedule_prefetch (map);
+		mapius_map_damage_tile (map, key);
+	}
+	else if (info && info->state == TILE_DECODING) {
+		tile_info_clear_fetched (info);
+
+		/* Corrupt bytes from the cache are dropped there and fetched again
+		 * at once; a bad download was never stored. */
+		if (info->from_disk) {
+			mapius_disk_cache_remove (priv->disk_cache, info->map_info->id, info->map_info->format, info->zoom, info->tile_x, info->tile_y);
+			info->from_disk = FALSE;
+			tile_info_clear_stale (info);
+			tile_info_set_state (info, TILE_DOWNLOADING);
+			if (!tile_info_fetch (info, info->priority))
+				tile_info_failed (info, MAPIUS_NEGATIVE_DECODE_ERROR);
+		}
+		else {
+			tile_info_failed (info, MAPIUS_NEGATIVE_DECODE_ERROR);
+		}
+	}
+}
+
+static void
+tile_loaded (MapiusFetch *fetch, SoupMessage *msg, gpointer data)
+{
+	TileInfo *info = (TileInfo *) data;
+	MapiusMapPrivate *priv = info->map->priv;
+
+	info->fetch = NULL;
+
+	g_debug ("%s/%d/%d/%d: %d %s", info->map_info->id, info->zoom, info->tile_x, info->tile_y, msg->status_code, msg->reason_phrase);
+
+	if (!info->cancelled) {
+		if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+			SoupBuffer *buffer = soup_message_body_flatten (msg->response_body);
+			GBytes *bytes = soup_buffer_get_as_bytes (buffer);
+			MapiusTileMeta *meta = mapius_tile_meta_from_message (msg, NULL, priv->default_max_age);
+			soup_buffer_free (buffer);
+
+			priv->stats.bytes_fetched += g_bytes_get_size (bytes);
+			tile_info_clear_stale (info);
+			mapius_negative_cache_clear (priv->negative_cache, info->key);
+			info->from_disk = FALSE;
+			tile_info_clear_fetched (info);
+			info->fetched_bytes = g_bytes_ref (bytes);
+			info->fetched_meta = meta;
+			tile_info_decode (info, bytes);
+
+			g_bytes_unref (bytes);
+		}
+		else if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && info->stale_bytes) {
+			MapiusTileMeta *meta = mapius_tile_meta_from_message (msg, info->stale_meta, priv->default_max_age);
+
+			priv->stats.not_modified++;
+			mapius_disk_cache_store_meta (priv->disk_cache, info->map_info->id, info->map_info->format, info->zoom, info->tile_x, info->tile_y, info->stale_bytes, meta);
+			mapius_tile_table_remove (priv->requests, info->key);
+
+			mapius_tile_meta_free (meta);
+		}
+		else if (msg->status_code == SOUP_STATUS_CANCELLED || info->state == TILE_REVALIDATING) {
+			mapius_tile_table_remove (priv->requests, info->key);
+		}
+		else {
+			tile_info_failed (info, msg->status_code);
+		}
+	}
+
+	tile_info_unref (info);
+}
+
+static gchar *
+get_tile_url (MapiusMap *map, MapInfo *map_info, int zoom, int x, int y)
+{
+	if (!map_info_load (map, map_info))
+		return NULL;
+
+	return mapius_map_source_get_url (map_info->source, zoom, x, y);
+}
+
+static gboolean
+tile_info_fetch (TileInfo *info, gint priority)
+{
+	MapiusMapPrivate *priv = info->map->priv;
+	gchar *url = get_tile_url (info->map, info->map_info, info->zoom, info->tile_x, info->tile_y);
+
+	SoupMessage *msg = url ? soup_message_new ("GET", url) : NULL;
+	if (!msg) {
+		if (url)
+			g_warning ("Bad tile URL for %s/%d/%d/%d: %s", info->map_info->id, info->zoom, info->tile_x, info->tile_y, url);
+		g_free (url);
+		return FALSE;
+	}
+
+	if (info->stale_meta && info->stale_meta->etag)
+		soup_message_headers_replace (msg->request_headers, "If-None-Match", info->stale_meta->etag);
+	if (info->stale_meta && info->stale_meta->last_modified)
+		soup_message_headers_replace (msg->request_headers, "If-Modified-Since", info->stale_meta->last_modified);
+
+	priv->stats.downloads++;
+	info->fetch = mapius_fetcher_queue (priv->fetcher, msg, priority, tile_loaded, tile_info_ref (info));
+
+	g_free (url);
+
+	return TRUE;
+}
+
+static void
+local_tile_loaded (GBytes *bytes, const MapiusTileMeta *meta, TileInfo *info)
+{
+	MapiusMapPrivate *priv = info->map->priv;
+
+	if (info->cancelled) {
+		tile_info_unref (info);
+		return;
+	}
+
+	if (bytes) {
+		priv->stats.disk_hits++;
+		if (!meta || meta->expires <= g_get_real_time () / G_USEC_PER_SEC) {
+			info->stale_bytes = g_bytes_ref (bytes);
+			info->stale_meta = meta ? mapius_tile_meta_copy (meta) : NULL;
+		}
+
+		info->from_disk = TRUE;
+		tile_info_decode (info, bytes);
+	}
+	else {
+		tile_info_set_state (info, TILE_DOWNLOADING);
+		if (!tile_info_fetch (info, info->priority))
+			tile_info_failed (info, SOUP_STATUS_MALFORMED);
+	}
+
+	tile_info_unref (info);
+}
+
+static void
+mapius_map_request_tile (MapiusMap *map, guint zoom, guint tile_x, guint tile_y, gint priority)
+{
+	MapiusMapPrivate *priv = map->priv;
+	MapiusTileKey key = MAPIUS_TILE_KEY (priv->current_map->index, zoom, tile_x, tile_y);
+
+	if (mapius_tile_table_lookup (priv->requests, key)) {
+		priv->stats.deduplicated++;
+		return;
+	}
+
+	if (mapius_negative_cache_check (priv->negative_cache, key)) {
+		priv->stats.negative_hits++;
+		return;
+	}
+
+	TileInfo *info = tile_info_new (map, zoom, tile_x, tile_y);
+	info->priority = priority;
+	mapius_tile_table_insert (priv->requests, key, info);
+	tile_info_set_state (info, TILE_READING);
+
+	mapius_disk_cache_load_async (
+		priv->disk_cache,
+		info->map_info->id,
+		info->map_info->format,
+		zoom,
+		tile_x,
+		tile_y,
+		(MapiusDiskCacheLoadFunc) local_tile_loaded,
+		tile_info_ref (info)
+	);
+}
+
+static void
+mapius_map_get_area_range (MapiusMap *map, guint zoom, gint64 left, gint64 top, gint64 right, gint64 bottom, guint margin, TileRange *range)
+{
+	MapiusMapPrivate *priv = map->priv;
+	guint max_size = pow (2, zoom) - 1;
+
+	range->map = priv->current_map->index;
+	range->zoom = zoom;
+	range->min_x = left > 0 ? left / 256 : 0;
+	range->min_y = top > 0 ? top / 256 : 0;
+	range->max_x = right > 0 ? right / 256 + margin : 0;
+	range->max_y = bottom > 0 ? bottom / 256 + margin : 0;
+	range->min_x = range->min_x > margin ? range->min_x - margin : 0;
+	range->min_y = range->min_y > margin ? range->min_y - margin : 0;
+	if (range->max_x > max_size)
+		range->max_x = max_size;
+	if (range->max_y > max_size)
+		range->max_y = max_size;
+}
+
+static void
+mapius_map_get_range (MapiusMap *map, guint zoom, gint64 x, gint64 y, guint margin, TileRange *range)
+{
+	gint center_x = gtk_widget_get_allocated_width (GTK_WIDGET (map)) / 2;
+	gint center_y = gtk_widget_get_allocated_height (GTK_WIDGET (map)) / 2;
+
+	mapius_map_get_area_range (map, zoom, x - center_x, y - center_y, x + center_x, y + center_y, margin, range);
+}
+
+/* The area mapius_map_render_scaled() covers while a zoom animation
+ * draws the view shrunk: 1 / zoom_scale times the widget around the
+ * anchor.  Only meaningful while zoom_scale < 1. */
+static void
+mapius_map_get_scaled_range (MapiusMap *map, gint64 x, gint64 y, TileRange *range)
+{
+	MapiusMapPrivate *priv = map->priv;
+	GtkWidget *widget = GTK_WIDGET (map);
+	gdouble scale = priv->zoom_scale;
+	gint width = gtk_widget_get_allocated_width (widget);
+	gint height = gtk_widget_get_allocated_height (widget);
+	gdouble anchor_x = x - width / 2 + priv->zoom_anchor_x;
+	gdouble anchor_y = y - height / 2 + priv->zoom_anchor_y;
+
+	mapius_map_get_area_range (map, priv->zoom,
+		floor (anchor_x - priv->zoom_anchor_x / scale),
+		floor (anchor_y - priv->zoom_anchor_y / scale),
+		ceil (anchor_x + (width - priv->zoom_anchor_x) / scale),
+		ceil (anchor_y + (height - priv->zoom_anchor_y) / scale),
+		0, range);
+}
+
+static void
+mapius_map_get_visible_range (MapiusMap *map, TileRange *range)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	mapius_map_get_range (map, priv->zoom, priv->center_x, priv->center_y, 0, range);
+}
+
+gboolean
+mapius_map_is_viewport_complete (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+	TileRange range;
+	guint x, y;
+
+	if (priv->zoom_scale != 1.0)
+		return FALSE;
+
+	mapius_map_get_visible_range (map, &range);
+	for (y = range.min_y; y <= range.max_y; y++) {
+		for (x = range.min_x; x <= range.max_x; x++) {
+			if (!mapius_tile_cache_contains (priv->tiles, MAPIUS_TILE_KEY (range.map, range.zoom, x, y)))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+tile_range_contains (TileRange *range, MapiusTileKey key)
+{
+	guint x = MAPIUS_TILE_KEY_X (key);
+	guint y = MAPIUS_TILE_KEY_Y (key);
+
+	return MAPIUS_TILE_KEY_MAP (key) == range->map
+		&& MAPIUS_TILE_KEY_ZOOM (key) == range->zoom
+		&& x >= range->min_x && x <= range->max_x
+		&& y >= range->min_y && y <= range->max_y;
+}
+
+static gint
+tile_priority (gint base, guint tile_x, guint tile_y, gint64 center_x, gint64 center_y)
+{
+	gint64 dx = (gint64) tile_x * 256 + 128 - center_x;
+	gint64 dy = (gint64) tile_y * 256 + 128 - center_y;
+
+	return base + MIN (dx * dx + dy * dy, PRIORITY_BAND - 1);
+}
+
+static gint
+compare_candidates (TileCandidate *a, TileCandidate *b)
+{
+	return (a->priority > b->priority) - (a->priority < b->priority);
+}
+
+static gboolean
+request_unwanted (MapiusTileKey key, TileInfo *info, MapiusMapPrivate *priv)
+{
+	guint i;
+
+	if (tile_range_contains (&priv->scheduled_range, key))
+		return FALSE;
+
+	for (i = 0; i < priv->n_prefetch_areas; i++) {
+		if (tile_range_contains (&priv->prefetch_areas[i].range, key))
+			return FALSE;
+	}
+
+	return TRUE;
+}
 
-	mapius_map_init_maps (map);
+static gboolean
+request_update_priority (MapiusTileKey key, TileInfo *info, MapiusMapPrivate *priv)
+{
+	if (info->state == TILE_REVALIDATING || !tile_range_contains (&priv->scheduled_range, key))
+		return FALSE;
 
-	gtk_widget_add_events (
-		GTK_WIDGET (map),
-		GDK_POINTER_MOTION_HINT_MASK
-		| GDK_POINTER_MOTION_MASK
-		| GDK_BUTTON_PRESS_MASK
-		| GDK_BUTTON_RELEASE_MASK
-		| GDK_SCROLL_MASK
-		| GDK_KEY_PRESS_MASK
-	);
-	gtk_widget_set_can_focus (GTK_WIDGET (map), TRUE);
+	info->priority = tile_priority (PRIORITY_VISIBLE, info->tile_x, info->tile_y, priv->request_center_x, priv->request_center_y);
+	if (info->fetch)
+		mapius_fetcher_set_priority (priv->fetcher, info->fetch, info->priority);
 
-	g_free (user_agent);
+	return FALSE;
 }
 
 static void
-local_tile_loaded (GObject *stream, GAsyncResult *res, gpointer data)
+mapius_map_add_prefetch_area (MapiusMap *map, guint zoom, gint64 x, gint64 y, guint margin, gint priority)
 {
-	TileInfo *info = (TileInfo *) data;
+	MapiusMapPrivate *priv = map->priv;
+	PrefetchArea *area = &priv->prefetch_areas[priv->n_prefetch_areas++];
+
+	mapius_map_get_range (map, zoom, x, y, margin, &area->range);
+	area->priority = priority;
+	area->center_x = x;
+	area->center_y = y;
+}
+
+static void
+mapius_map_update_prefetch_areas (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+	gint limit = priv->prefetch_margin * 256;
+
+	priv->n_prefetch_areas = 0;
+
+	/* The ring a zoom animation shows around the viewport is drawn from
+	 * fallback tiles meanwhile; it is only worth spare connections. */
+	if (priv->zoom_scale < 1.0) {
+		PrefetchArea *area = &priv->prefetch_areas[priv->n_prefetch_areas++];
+
+		mapius_map_get_scaled_range (map, priv->request_center_x, priv->request_center_y, &area->range);
+		area->priority = PRIORITY_PREFETCH;
+		area->center_x = priv->request_center_x;
+		area->center_y = priv->request_center_y;
+	}
+
+	if (priv->prefetch_margin) {
+		gint offset_x = priv->kinetic_tick_id ? 0 : CLAMP (priv->velocity_x * PREFETCH_LOOKAHEAD, -limit, limit);
+		gint offset_y = priv->kinetic_tick_id ? 0 : CLAMP (priv->velocity_y * PREFETCH_LOOKAHEAD, -limit, limit);
+		TileRange around;
 
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_stream_finish (res, NULL);
-	if (pixbuf) {
-		Tile *tile = g_new (Tile, 1);
-		tile->pixbuf = pixbuf;
-		tile->ts = info->map->priv->current_ts;
-		g_hash_table_insert (info->map->priv->tiles, g_strdup (info->filename), tile);
+		mapius_map_add_prefetch_area (map, priv->zoom, priv->request_center_x + offset_x, priv->request_center_y + offset_y, priv->prefetch_margin, PRIORITY_PREFETCH);
 
-		gtk_widget_queue_draw (GTK_WIDGET (info->map));
+		mapius_map_get_range (map, priv->zoom, priv->request_center_x, priv->request_center_y, priv->prefetch_margin, &around);
+		TileRange *range = &priv->prefetch_areas[priv->n_prefetch_areas - 1].range;
+		range->min_x = MIN (range->min_x, around.min_x);
+		range->min_y = MIN (range->min_y, around.min_y);
+		range->max_x = MAX (range->max_x, around.max_x);
+		range->max_y = MAX (range->max_y, around.max_y);
 	}
 
-	g_object_unref (stream);
-	g_free (info->folder);
-	g_free (info->filename);
-	g_free (info);
+	if (priv->prefetch_zoom) {
+		if (priv->zoom < 24)
+			mapius_map_add_prefetch_area (map, priv->zoom + 1, priv->request_center_x * 2, priv->request_center_y * 2, 0, PRIORITY_PREFETCH_ZOOM);
+		if (priv->zoom > 0)
+			mapius_map_add_prefetch_area (map, priv->zoom - 1, priv->request_center_x / 2, priv->request_center_y / 2, 0, PRIORITY_PREFETCH_ZOOM);
+	}
 }
 
-static void
-tile_loaded (SoupSession *session, SoupMessage *msg, gpointer data)
+static gboolean
+mapius_map_prefetch (MapiusMap *map)
 {
-	TileInfo *info = (TileInfo *) data;
-	FILE *file;
+	MapiusMapPrivate *priv = map->priv;
+	TileCandidate candidate;
+	guint budget;
+	guint i;
+
+	priv->prefetch_source_id = 0;
 
-	g_debug ("%s: %d %s", info->filename, msg->status_code, msg->reason_phrase);
+	budget = mapius_fetcher_get_available (priv->fetcher);
+	if (mapius_fetcher_get_queued (priv->fetcher) || budget == 0)
+		return FALSE;
 
-	if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
-		if (g_mkdir_with_parents (info->folder, 0755) == 0) {
-			file = fopen (info->filename, "wb");
-			if (file != NULL) {
-				fwrite (msg->response_body->data, 1, msg->response_body->length, file);
-				fclose (file);
-				gtk_widget_queue_draw (GTK_WIDGET (info->map));
+	GArray *candidates = g_array_new (FALSE, FALSE, sizeof (TileCandidate));
+	for (i = 0; i < priv->n_prefetch_areas; i++) {
+		PrefetchArea *area = &priv->prefetch_areas[i];
+		TileRange *range = &area->range;
+
+		candidate.zoom = range->zoom;
+		for (candidate.tile_y = range->min_y; candidate.tile_y <= range->max_y; candidate.tile_y++) {
+			for (candidate.tile_x = range->min_x; candidate.tile_x <= range->max_x; candidate.tile_x++) {
+				MapiusTileKey key = MAPIUS_TILE_KEY (range->map, range->zoom, candidate.tile_x, candidate.tile_y);
+				if (mapius_tile_cache_contains (priv->tiles, key)
+					|| mapius_tile_table_lookup (priv->requests, key)
+					|| mapius_negative_cache_check (priv->negative_cache, key))
+					continue;
+				candidate.priority = tile_priority (area->priority, candidate.tile_x, candidate.tile_y, area->center_x, area->center_y);
+				g_array_append_val (candidates, candidate);
 			}
-		} else {
-			g_warning ("Error creating tile download directory: %s", info->folder);
 		}
 	}
 
-	g_hash_table_remove (info->map->priv->loading, info->filename);
-	g_signal_emit_by_name (info->map, "loading", g_hash_table_size (info->map->priv->loading));
+	g_array_sort (candidates, (GCompareFunc) compare_candidates);
+	for (i = 0; i < candidates->len && i < budget; i++) {
+		TileCandidate *c = &g_array_index (candidates, TileCandidate, i);
+		mapius_map_request_tile (map, c->zoom, c->tile_x, c->tile_y, c->priority);
+		priv->stats.prefetches++;
+	}
+
+	g_array_free (candidates, TRUE);
 
-	g_free (info->folder);
-	g_free (info->filename);
-	g_free (info);
+	return FALSE;
 }
 
-static gchar *
-get_tile_url (MapInfo *map_info, int zoom, int x, int y)
+static void
+mapius_map_schedule_prefetch (MapiusMap *map)
 {
-	PyObject *value = PyObject_CallFunction (map_info->url_func, "(iii)", x, y, zoom);
-	if (!value) {
-		PyErr_Print();
-		g_error ("get_tile_url failed");
-		return NULL;
-	}
-
-	gchar *result = g_strdup (PyString_AsString (value));
-	Py_DECREF (value);
+	MapiusMapPrivate *priv = map->priv;
 
-	return result;
+	if (!priv->prefetch_source_id && priv->n_prefetch_areas)
+		priv->prefetch_source_id = g_idle_add_full (G_PRIORITY_LOW, (GSourceFunc) mapius_map_prefetch, map, NULL);
 }
 
-static void
-local_tile_opened (GObject *file, GAsyncResult *res, gpointer data)
+static gboolean
+mapius_map_update_requests (MapiusMap *map)
 {
-	TileInfo *info = (TileInfo *) data;
+	MapiusMapPrivate *priv = map->priv;
+	TileRange *range = &priv->scheduled_range;
+	TileCandidate candidate;
+	guint i;
 
-	GFileInputStream *stream = g_file_read_finish (G_FILE(file), res, NULL);
-	if (stream) {
-		gdk_pixbuf_new_from_stream_async (G_INPUT_STREAM (stream), NULL, local_tile_loaded, info);
+	priv->update_source_id = 0;
+
+	if (priv->kinetic_tick_id) {
+		priv->request_center_x = round (priv->kinetic_x + priv->velocity_x / priv->friction);
+		priv->request_center_y = round (priv->kinetic_y + priv->velocity_y / priv->friction);
+	}
+	else {
+		priv->request_center_x = priv->center_x;
+		priv->request_center_y = priv->center_y;
 	}
-	else if (!g_hash_table_lookup (info->map->priv->loading, info->filename)) {
-		gchar *url = get_tile_url (info->map->priv->current_map, info->map->priv->zoom, info->tile_x, info->tile_y);
 
-		SoupMessage *msg = soup_message_new ("GET", url);
-		g_assert (msg != NULL);
-		soup_session_queue_message (info->map->priv->soup_session, msg, tile_loaded, info);
+	mapius_map_get_range (map, priv->zoom, priv->request_center_x, priv->request_center_y, 0, range);
+	mapius_map_update_prefetch_areas (map);
+
+	priv->stats.cancelled += mapius_tile_table_foreach_remove (priv->requests, (MapiusTileTableFunc) request_unwanted, priv);
+	mapius_tile_table_foreach (priv->requests, (MapiusTileTableFunc) request_update_priority, priv);
+
+	GArray *candidates = g_array_new (FALSE, FALSE, sizeof (TileCandidate));
+	candidate.zoom = range->zoom;
+	for (candidate.tile_y = range->min_y; candidate.tile_y <= range->max_y; candidate.tile_y++) {
+		for (candidate.tile_x = range->min_x; candidate.tile_x <= range->max_x; candidate.tile_x++) {
+			MapiusTileKey key = MAPIUS_TILE_KEY (range->map, range->zoom, candidate.tile_x, candidate.tile_y);
+			if (mapius_tile_cache_contains (priv->tiles, key) || mapius_tile_table_lookup (priv->requests, key))
+				continue;
+			candidate.priority = tile_priority (PRIORITY_VISIBLE, candidate.tile_x, candidate.tile_y, priv->request_center_x, priv->request_center_y);
+			g_array_append_val (candidates, candidate);
+		}
+	}
 
-		g_hash_table_insert (info->map->priv->loading, g_strdup (info->filename), msg);
+	g_array_sort (candidates, (GCompareFunc) compare_candidates);
+	for (i = 0; i < candidates->len; i++) {
+		TileCandidate *c = &g_array_index (candidates, TileCandidate, i);
+		mapius_map_request_tile (map, c->zoom, c->tile_x, c->tile_y, c->priority);
+	}
 
-		g_signal_emit_by_name (info->map, "loading", g_hash_table_size (info->map->priv->loading));
+	g_array_free (candidates, TRUE);
 
-		g_free (url);
-	}
+	mapius_map_schedule_prefetch (map);
 
-	g_object_unref (file);
+	return FALSE;
 }
 
-static gboolean
-tile_purge_check (gchar *key, Tile *tile, gpointer data)
+static void
+mapius_map_schedule_requests (MapiusMap *map)
 {
-	return ((MapiusMapPrivate *) data)->current_ts - tile->ts > 2;
+	MapiusMapPrivate *priv = map->priv;
+
+	if (!priv->update_source_id)
+		priv->update_source_id = g_idle_add ((GSourceFunc) mapius_map_update_requests, map);
 }
 
 static void
@@ -503,127 +1647,406 @@ mapius_map_draw_scale (MapiusMap *map, cairo_t *cr)
 	g_free (label);
 }
 
+static void
+mapius_map_draw_stats (MapiusMap *map, cairo_t *cr)
+{
+	MapiusMapStats stats;
+	cairo_font_extents_t font;
+	cairo_text_extents_t extents;
+	gdouble width = 0;
+	guint i;
+
+	mapius_map_get_stats (map, &stats);
+
+	GString *histogram = g_string_new ("Frame times:");
+	for (i = 0; i < MAPIUS_MAP_FRAME_BUCKETS; i++) {
+		if (i < MAPIUS_MAP_FRAME_BUCKETS - 1)
+			g_string_append_printf (histogram, " <%u:%" G_GUINT64_FORMAT, 1 << i, stats.frame_times[i]);
+		else
+			g_string_append_printf (histogram, " >=%u:%" G_GUINT64_FORMAT, 1 << (i - 1), stats.frame_times[i]);
+	}
+
+	gchar *lines[] = {
+		g_strdup_printf ("Frames: %" G_GUINT64_FORMAT ", avg %.1f ms, max %.1f ms",
+			stats.frames, stats.frames ? stats.frame_time_total / 1000.0 / stats.frames : 0, stats.frame_time_max / 1000.0),
+		g_string_free (histogram, FALSE),
+		g_strdup_printf ("Memory: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %.1f MB, %" G_GUINT64_FORMAT " evicted",
+			stats.cache_hits, stats.cache_misses, stats.memory_usage / 1048576.0, stats.evictions),
+		g_strdup_printf ("Disk: %" G_GUINT64_FORMAT " reads, %" G_GUINT64_FORMAT " hits",
+			stats.disk_reads, stats.disk_hits),
+		g_strdup_printf ("Network: %" G_GUINT64_FORMAT " fetches, %.1f MB, %" G_GUINT64_FORMAT " failures",
+			stats.downloads, stats.bytes_fetched / 1048576.0, stats.failures),
+		g_strdup_printf ("Decode: %" G_GUINT64_FORMAT " tiles, avg %.1f ms",
+			stats.decodes, stats.decodes ? stats.decode_time / 1000.0 / stats.decodes : 0),
+		g_strdup_printf ("Queues: %u reading, %u fetching, %u queued, %u decoding",
+			stats.reading, stats.fetch_active, stats.fetch_queued, stats.decode_queued),
+	};
+
+	cairo_save (cr);
+	cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+	cairo_set_font_size (cr, 11);
+	cairo_font_extents (cr, &font);
+	for (i = 0; i < G_N_ELEMENTS (lines); i++) {
+		cairo_text_extents (cr, lines[i], &extents);
+		width = MAX (width, extents.x_advance);
+	}
+
+	cairo_set_source_rgba (cr, 0, 0, 0, 0.7);
+	cairo_rectangle (cr, 10, 10, width + 12, font.height * G_N_ELEMENTS (lines) + 12);
+	cairo_fill (cr);
+
+	cairo_set_source_rgb (cr, 1, 1, 1);
+	for (i = 0; i < G_N_ELEMENTS (lines); i++) {
+		cairo_move_to (cr, 16, 16 + font.ascent + font.height * i);
+		cairo_show_text (cr, lines[i]);
+		g_free (lines[i]);
+	}
+	cairo_restore (cr);
+}
+
+static void
+mapius_map_record_frame (MapiusMap *map, gint64 frame_time)
+{
+	MapiusMapStats *stats = &map->priv->stats;
+	guint bucket = 0;
+
+	while (bucket < MAPIUS_MAP_FRAME_BUCKETS - 1 && frame_time >= (1000 << bucket))
+		bucket++;
+
+	stats->frames++;
+	stats->frame_time_total += frame_time;
+	stats->frame_time_max = MAX (stats->frame_time_max, (guint64) frame_time);
+	stats->frame_times[bucket]++;
+}
+
 static gboolean
-mapius_map_draw (GtkWidget *widget, cairo_t *cr)
+mapius_map_flush_redraws (GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
 {
 	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
-	gint center_x, center_y;
+	cairo_rectangle_int_t rect;
+	gint i, n;
+
+	priv->redraw_tick_id = 0;
+
+	n = cairo_region_num_rectangles (priv->redraw_region);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle (priv->redraw_region, i, &rect);
+		gtk_widget_queue_draw_area (widget, rect.x, rect.y, rect.width, rect.height);
+	}
+
+	cairo_region_destroy (priv->redraw_region);
+	priv->redraw_region = cairo_region_create ();
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+mapius_map_damage_tile (MapiusMap *map, MapiusTileKey key)
+{
+	MapiusMapPrivate *priv = map->priv;
+	cairo_rectangle_int_t rect;
+
+	if (!priv->backing_map || MAPIUS_TILE_KEY_MAP (key) != priv->backing_map->index)
+		return;
+
+	gdouble size = ldexp (256, (gint) priv->backing_zoom - (gint) MAPIUS_TILE_KEY_ZOOM (key));
+	gdouble x = MAPIUS_TILE_KEY_X (key) * size + priv->backing_width / 2 - priv->backing_x;
+	gdouble y = MAPIUS_TILE_KEY_Y (key) * size + priv->backing_height / 2 - priv->backing_y;
+	gdouble x1 = MIN (x + size, priv->backing_width);
+	gdouble y1 = MIN (y + size, priv->backing_height);
+	x = MAX (x, 0);
+	y = MAX (y, 0);
+	if (x >= x1 || y >= y1)
+		return;
+
+	rect.x = floor (x);
+	rect.y = floor (y);
+	rect.width = ceil (x1) - rect.x;
+	rect.height = ceil (y1) - rect.y;
+	cairo_region_union_rectangle (priv->backing_damage, &rect);
+
+	rect.x += priv->backing_x - priv->center_x;
+	rect.y += priv->backing_y - priv->center_y;
+	cairo_region_union_rectangle (priv->redraw_region, &rect);
+
+	if (!priv->redraw_tick_id)
+		priv->redraw_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (map), mapius_map_flush_redraws, NULL, NULL);
+}
+
+static void
+mapius_map_render_fallback (MapiusMap *map, cairo_t *cr, guint tile_x, guint tile_y, gint x, gint y)
+{
+	MapiusMapPrivate *priv = map->priv;
+	guint map_index = priv->current_map->index;
+	cairo_surface_t *children[4] = { NULL, NULL, NULL, NULL };
+	cairo_surface_t *tile;
+	guint found = 0;
+	guint i;
+
+	if (priv->zoom < 24) {
+		for (i = 0; i < 4; i++) {
+			children[i] = mapius_tile_cache_lookup (priv->tiles, MAPIUS_TILE_KEY (map_index, priv->zoom + 1, tile_x * 2 + (i & 1), tile_y * 2 + (i >> 1)));
+			if (children[i])
+				found++;
+		}
+	}
+
+	cairo_save (cr);
+	cairo_rectangle (cr, x, y, 256, 256);
+	cairo_clip (cr);
+
+	if (found < 4) {
+		guint scaled_zoom;
+		guint scale;
+		for (scale = 2, scaled_zoom = priv->zoom - 1; scale <= 256 && scaled_zoom > 0; scale *= 2, scaled_zoom--) {
+			tile = mapius_tile_cache_lookup (priv->tiles, MAPIUS_TILE_KEY (map_index, scaled_zoom, tile_x / scale, tile_y / scale));
+			if (tile) {
+				cairo_save (cr);
+				cairo_translate (cr, x - tile_x % scale * 256, y - tile_y % scale * 256);
+				cairo_scale (cr, scale, scale);
+				cairo_set_source_surface (cr, tile, 0, 0);
+				cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_NEAREST);
+				cairo_paint (cr);
+				cairo_restore (cr);
+				break;
+			}
+		}
+	}
+
+	if (found > 0) {
+		cairo_translate (cr, x, y);
+		cairo_scale (cr, 0.5, 0.5);
+		for (i = 0; i < 4; i++) {
+			if (!children[i])
+				continue;
+			cairo_set_source_surface (cr, children[i], (i & 1) * 256, (i >> 1) * 256);
+			cairo_pattern_set_filter (cairo_get_source (cr), priv->render_filter);
+			cairo_paint (cr);
+		}
+	}
+
+	cairo_restore (cr);
+}
+
+static gboolean
+mapius_map_render_tiles (MapiusMap *map, cairo_t *cr, cairo_region_t *region, cairo_region_t *missing_region)
+{
+	GtkWidget *widget = GTK_WIDGET (map);
+	MapiusMapPrivate *priv = map->priv;
 	gint offset_x, offset_y;
 	guint min_x, max_x, min_y, max_y;
-	guint max_size;
 	guint tile_x, tile_y;
-	gint draw_x, draw_y;
-	gchar *filename;
-	Tile *tile;
+	cairo_rectangle_int_t rect;
+	guint map_index;
+	guint max_tile;
+	gboolean missing = FALSE;
+	cairo_surface_t *tile;
 
-	center_x = gtk_widget_get_allocated_width (widget) / 2;
-	center_y = gtk_widget_get_allocated_height (widget) / 2;
+	offset_x = gtk_widget_get_allocated_width (widget) / 2 - priv->center_x;
+	offset_y = gtk_widget_get_allocated_height (widget) / 2 - priv->center_y;
 
-	offset_x = center_x - priv->center_x;
-	offset_y = center_y - priv->center_y;
+	map_index = priv->current_map->index;
+	max_tile = (1 << priv->zoom) - 1;
+
+	gdk_cairo_region (cr, region);
+	cairo_clip (cr);
+
+	cairo_region_get_extents (region, &rect);
+	gtk_render_background (gtk_widget_get_style_context (widget), cr, rect.x, rect.y, rect.width, rect.height);
 
-	min_x = priv->center_x > center_x ? (priv->center_x - center_x) / 256 : 0;
-	min_y = priv->center_y > center_y ? (priv->center_y - center_y) / 256 : 0;
-	max_x = priv->center_x + center_x > 0 ? (priv->center_x + center_x) / 256 : 0;
-	max_y = priv->center_y + center_y > 0 ? (priv->center_y + center_y) / 256 : 0;
-	max_size = pow (2, priv->zoom) - 1;
-	if (max_x > max_size)
-		max_x = max_size;
-	if (max_y > max_size)
-		max_y = max_size;
-
-	draw_y = min_y * 256 + offset_y;
+	gint64 left = (gint64) rect.x - offset_x;
+	gint64 top = (gint64) rect.y - offset_y;
+	gint64 right = left + rect.width - 1;
+	gint64 bottom = top + rect.height - 1;
+	if (right < 0 || bottom < 0)
+		return FALSE;
+
+	min_x = left > 0 ? MIN (left / 256, max_tile + 1) : 0;
+	min_y = top > 0 ? MIN (top / 256, max_tile + 1) : 0;
+	max_x = MIN (right / 256, max_tile);
+	max_y = MIN (bottom / 256, max_tile);
+
+	rect.width = 256;
+	rect.height = 256;
 	for (tile_y = min_y; tile_y <= max_y; tile_y++) {
-		draw_x = min_x * 256 + offset_x;
 		for (tile_x = min_x; tile_x <= max_x; tile_x++) {
-			filename = g_strdup_printf (
-				"%s%c%s%c%d%c%d%c%d.%s",
-				priv->cache_dir,
-				G_DIR_SEPARATOR,
-				priv->current_map->id,
-				G_DIR_SEPARATOR,
-				priv->zoom,
-				G_DIR_SEPARATOR,
-				tile_x,
-				G_DIR_SEPARATOR,
-				tile_y,
-				priv->current_map->format
-			);
-			tile = g_hash_table_lookup (priv->tiles, filename);
-			if (tile) {
-				g_free (filename);
+			rect.x = tile_x * 256 + offset_x;
+			rect.y = tile_y * 256 + offset_y;
+			if (cairo_region_contains_rectangle (region, &rect) == CAIRO_REGION_OVERLAP_OUT)
+				continue;
 
-				gdk_cairo_set_source_pixbuf (cr, tile->pixbuf, draw_x, draw_y);
+			tile = mapius_tile_cache_lookup (priv->tiles, MAPIUS_TILE_KEY (map_index, priv->zoom, tile_x, tile_y));
+			if (tile) {
+				priv->stats.cache_hits++;
+				cairo_set_source_surface (cr, tile, rect.x, rect.y);
+				cairo_pattern_set_filter (cairo_get_source (cr), priv->render_filter);
 				cairo_paint (cr);
-
-				tile->ts = priv->current_ts;
 			}
 			else {
-				GFile *file = g_file_new_for_path (filename);
-
-				TileInfo *info = g_new0 (TileInfo, 1);
-				info->map = MAPIUS_MAP (widget);
-				info->folder = g_strdup_printf (
-					"%s%c%s%c%d%c%d",
-					priv->cache_dir,
-					G_DIR_SEPARATOR,
-					priv->current_map->id,
-					G_DIR_SEPARATOR,
-					priv->zoom,
-					G_DIR_SEPARATOR,
-					tile_x
-				);
-				info->filename = filename;
-				info->tile_x = tile_x;
-				info->tile_y = tile_y;
-
-				g_file_read_async (file, G_PRIORITY_DEFAULT, NULL, local_tile_opened, info);
-
-				guint scaled_zoom;
-				guint scale;
-				for (scale = 2, scaled_zoom = priv->zoom - 1; scale <= 256 && scaled_zoom > 0; scale *= 2, scaled_zoom--) {
-					filename = g_strdup_printf (
-						"%s%c%s%c%d%c%d%c%d.%s",
-						priv->cache_dir,
-						G_DIR_SEPARATOR,
-						priv->current_map->id,
-						G_DIR_SEPARATOR,
-						scaled_zoom,
-						G_DIR_SEPARATOR,
-						tile_x / scale,
-						G_DIR_SEPARATOR,
-						tile_y / scale,
-						priv->current_map->format
-					);
-					tile = g_hash_table_lookup (priv->tiles, filename);
-					g_free (filename);
-					if (tile) {
-						guint size = 256 / scale;
-						GdkPixbuf *area = gdk_pixbuf_new_subpixbuf (
-							tile->pixbuf,
-							tile_x % scale * size,
-							tile_y % scale * size,
-							size,
-							size
-						);
-						GdkPixbuf *scaled_pixbuf = gdk_pixbuf_scale_simple (area, 256, 256, GDK_INTERP_NEAREST);
-						gdk_cairo_set_source_pixbuf (cr, scaled_pixbuf, draw_x, draw_y);
-						cairo_paint (cr);
-						g_object_unref (area);
-						g_object_unref (scaled_pixbuf);
-						break;
-					}
-				}
+				priv->stats.cache_misses++;
+				missing = TRUE;
+				if (missing_region)
+					cairo_region_union_rectangle (missing_region, &rect);
+				mapius_map_render_fallback (map, cr, tile_x, tile_y, rect.x, rect.y);
 			}
-			draw_x += 256;
 		}
-		draw_y += 256;
+	}
+
+	return missing;
+}
+
+static gboolean
+mapius_map_update_backing (MapiusMap *map, const cairo_rectangle_int_t *clip)
+{
+	GtkWidget *widget = GTK_WIDGET (map);
+	MapiusMapPrivate *priv = map->priv;
+	cairo_rectangle_int_t bounds;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+
+	bounds.x = 0;
+	bounds.y = 0;
+	bounds.width = gtk_widget_get_allocated_width (widget);
+	bounds.height = gtk_widget_get_allocated_height (widget);
+
+	if (!priv->backing || priv->backing_width != bounds.width || priv->backing_height != bounds.height) {
+		g_clear_pointer (&priv->backing, cairo_surface_destroy);
+		g_clear_pointer (&priv->backing_scratch, cairo_surface_destroy);
+		priv->backing = gdk_window_create_similar_surface (gtk_widget_get_window (widget), CAIRO_CONTENT_COLOR, bounds.width, bounds.height);
+		priv->backing_scratch = gdk_window_create_similar_surface (gtk_widget_get_window (widget), CAIRO_CONTENT_COLOR, bounds.width, bounds.height);
+		priv->backing_width = bounds.width;
+		priv->backing_height = bounds.height;
+		priv->backing_map = NULL;
+	}
+
+	gint dx = priv->center_x - priv->backing_x;
+	gint dy = priv->center_y - priv->backing_y;
+
+	if (priv->backing_map != priv->current_map || priv->backing_zoom != priv->zoom
+		|| ABS (dx) >= bounds.width || ABS (dy) >= bounds.height) {
+		cairo_region_destroy (priv->backing_damage);
+		priv->backing_damage = cairo_region_create_rectangle (&bounds);
+		cairo_region_destroy (priv->backing_missing);
+		priv->backing_missing = cairo_region_create ();
+	}
+	else if (dx || dy) {
+		cr = cairo_create (priv->backing_scratch);
+		cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface (cr, priv->backing, -dx, -dy);
+		cairo_paint (cr);
+		cairo_destroy (cr);
+
+		surface = priv->backing;
+		priv->backing = priv->backing_scratch;
+		priv->backing_scratch = surface;
+
+		cairo_region_translate (priv->backing_damage, -dx, -dy);
+		cairo_region_translate (priv->backing_missing, -dx, -dy);
+		cairo_region_intersect_rectangle (priv->backing_missing, &bounds);
+		cairo_region_t *exposed = cairo_region_create_rectangle (&bounds);
+		bounds.x = -dx;
+		bounds.y = -dy;
+		cairo_region_subtract_rectangle (exposed, &bounds);
+		bounds.x = 0;
+		bounds.y = 0;
+		cairo_region_union (priv->backing_damage, exposed);
+		cairo_region_intersect_rectangle (priv->backing_damage, &bounds);
+		cairo_region_destroy (exposed);
+	}
+
+	priv->backing_map = priv->current_map;
+	priv->backing_zoom = priv->zoom;
+	priv->backing_x = priv->center_x;
+	priv->backing_y = priv->center_y;
+
+	cairo_region_t *area = cairo_region_copy (priv->backing_damage);
+	cairo_region_intersect_rectangle (area, clip);
+	if (!cairo_region_is_empty (area)) {
+		cairo_region_t *missing = cairo_region_create ();
+		cr = cairo_create (priv->backing);
+		mapius_map_render_tiles (map, cr, area, missing);
+		cairo_destroy (cr);
+
+		cairo_region_intersect (missing, area);
+		cairo_region_subtract (priv->backing_missing, area);
+		cairo_region_union (priv->backing_missing, missing);
+		cairo_region_destroy (missing);
+
+		cairo_region_subtract (priv->backing_damage, area);
+	}
+	cairo_region_destroy (area);
+
+	return !cairo_region_is_empty (priv->backing_missing);
+}
+
+static gboolean
+mapius_map_render_scaled (MapiusMap *map, cairo_t *cr)
+{
+	GtkWidget *widget = GTK_WIDGET (map);
+	MapiusMapPrivate *priv = map->priv;
+	gdouble scale = priv->zoom_scale;
+	gdouble anchor_x = priv->zoom_anchor_x;
+	gdouble anchor_y = priv->zoom_anchor_y;
+	cairo_rectangle_int_t rect;
+	gboolean missing;
+
+	rect.x = floor (anchor_x - anchor_x / scale);
+	rect.y = floor (anchor_y - anchor_y / scale);
+	rect.width = ceil (anchor_x + (gtk_widget_get_allocated_width (widget) - anchor_x) / scale) - rect.x;
+	rect.height = ceil (anchor_y + (gtk_widget_get_allocated_height (widget) - anchor_y) / scale) - rect.y;
+	cairo_region_t *region = cairo_region_create_rectangle (&rect);
+
+	cairo_save (cr);
+	cairo_translate (cr, anchor_x, anchor_y);
+	cairo_scale (cr, scale, scale);
+	cairo_translate (cr, -anchor_x, -anchor_y);
+	priv->render_filter = CAIRO_FILTER_BILINEAR;
+	missing = mapius_map_render_tiles (map, cr, region, NULL);
+	priv->render_filter = CAIRO_FILTER_GOOD;
+	cairo_restore (cr);
+
+	cairo_region_destroy (region);
+
+	return missing;
+}
+
+static gboolean
+mapius_map_draw (GtkWidget *widget, cairo_t *cr)
+{
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
+	gint center_x, center_y;
+	gint offset_x, offset_y;
+	cairo_rectangle_int_t clip;
+	TileRange range;
+	gboolean missing;
+	gint64 start_time = g_get_monotonic_time ();
+
+	center_x = gtk_widget_get_allocated_width (widget) / 2;
+	center_y = gtk_widget_get_allocated_height (widget) / 2;
+
+	offset_x = center_x - priv->center_x;
+	offset_y = center_y - priv->center_y;
+
+	if (!gdk_cairo_get_clip_rectangle (cr, &clip)) {
+		clip.x = 0;
+		clip.y = 0;
+		clip.width = gtk_widget_get_allocated_width (widget);
+		clip.height = gtk_widget_get_allocated_height (widget);
+	}
+
+	if (priv->zoom_scale != 1.0) {
+		missing = mapius_map_render_scaled (MAPIUS_MAP (widget), cr);
+	}
+	else {
+		missing = mapius_map_update_backing (MAPIUS_MAP (widget), &clip);
+		cairo_set_source_surface (cr, priv->backing, 0, 0);
+		cairo_paint (cr);
 	}
 
 	if (priv->cursor_timeout_id) {
 		gint k = pow (2, 24 - priv->zoom);
-		gint x = priv->cursor_x / k + offset_x;
-		gint y = priv->cursor_y / k + offset_y;
+		gdouble x = priv->zoom_anchor_x + (priv->cursor_x / k + offset_x - priv->zoom_anchor_x) * priv->zoom_scale;
+		gdouble y = priv->zoom_anchor_y + (priv->cursor_y / k + offset_y - priv->zoom_anchor_y) * priv->zoom_scale;
 		cairo_set_line_width (cr, 2);
 		cairo_set_source_rgb (cr, 1, 0, 0);
 		cairo_arc (cr, x, y, 5, 0, 2 * M_PI);
@@ -640,23 +2063,26 @@ mapius_map_draw (GtkWidget *widget, cairo_t *cr)
 	cairo_line_to (cr, center_x + 0.5, center_y + 5.5);
 	cairo_stroke (cr);
 
-	if (g_hash_table_size (priv->tiles) > 500) {
-		g_debug ("Purging tiles");
-		guint res = g_hash_table_foreach_remove (priv->tiles, (GHRFunc) tile_purge_check, priv);
-		g_debug ("Removed %d tiles, left %d", res, g_hash_table_size (priv->tiles));
-	}
+	if (priv->show_stats)
+		mapius_map_draw_stats (MAPIUS_MAP (widget), cr);
+
+	mapius_map_get_visible_range (MAPIUS_MAP (widget), &range);
+	if (!priv->kinetic_tick_id && (missing || memcmp (&range, &priv->scheduled_range, sizeof (TileRange)) != 0))
+		mapius_map_schedule_requests (MAPIUS_MAP (widget));
+
+	mapius_map_record_frame (MAPIUS_MAP (widget), g_get_monotonic_time () - start_time);
 
 	return FALSE;
 }
 
-static void
+static gboolean
 mapius_map_change_zoom (GtkWidget *widget, int dx, int dy, gboolean up)
 {
 	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
 
 	if (up) {
 		if (priv->zoom >= 24)
-			return;
+			return FALSE;
 		priv->zoom++;
 		if (dx || dy) {
 			priv->center_x = (priv->center_x + dx) * 2 - dx;
@@ -669,7 +2095,7 @@ mapius_map_change_zoom (GtkWidget *widget, int dx, int dy, gboolean up)
 	}
 	else {
 		if (priv->zoom <= 0)
-			return;
+			return FALSE;
 		priv->zoom--;
 		if (dx || dy) {
 			priv->center_x = (priv->center_x + dx) / 2 - dx;
@@ -681,12 +2107,81 @@ mapius_map_change_zoom (GtkWidget *widget, int dx, int dy, gboolean up)
 		}
 	}
 
-	soup_session_abort (priv->soup_session);
-	g_hash_table_remove_all (priv->loading);
-
-	priv->current_ts++;
+	mapius_map_stop_kinetic (MAPIUS_MAP (widget));
+	priv->velocity_x = 0;
+	priv->velocity_y = 0;
 
 	g_signal_emit_by_name (widget, "zoom-changed", priv->zoom);
+
+	return TRUE;
+}
+
+static gboolean
+mapius_map_zoom_tick (GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
+	gdouble t = (gdk_frame_clock_get_frame_time (frame_clock) - priv->zoom_start_time) / (gdouble) ZOOM_DURATION;
+
+	gtk_widget_queue_draw (widget);
+
+	if (t >= 1) {
+		priv->zoom_scale = priv->zoom_target_scale;
+		priv->zoom_tick_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	t = 1 - pow (1 - MAX (t, 0), 3);
+	priv->zoom_scale = priv->zoom_start_scale * pow (priv->zoom_target_scale / priv->zoom_start_scale, t);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+mapius_map_animate_zoom (GtkWidget *widget, gdouble target_scale)
+{
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
+
+	priv->zoom_start_scale = priv->zoom_scale;
+	priv->zoom_target_scale = target_scale;
+	priv->zoom_start_time = g_get_monotonic_time ();
+
+	if (!priv->zoom_tick_id)
+		priv->zoom_tick_id = gtk_widget_add_tick_callback (widget, mapius_map_zoom_tick, NULL, NULL);
+
+	gtk_widget_queue_draw (widget);
+}
+
+static gboolean
+mapius_map_zoom_step (GtkWidget *widget, int dx, int dy, gboolean up)
+{
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
+
+	if (priv->zoom_scale != 1.0 && (priv->zoom_anchor_x != gtk_widget_get_allocated_width (widget) / 2 + dx
+		|| priv->zoom_anchor_y != gtk_widget_get_allocated_height (widget) / 2 + dy)) {
+		priv->scroll_delta = 0;
+		priv->zoom_scale = 1.0;
+	}
+
+	if (!mapius_map_change_zoom (widget, dx, dy, up))
+		return FALSE;
+
+	priv->zoom_anchor_x = gtk_widget_get_allocated_width (widget) / 2 + dx;
+	priv->zoom_anchor_y = gtk_widget_get_allocated_height (widget) / 2 + dy;
+	priv->zoom_scale *= up ? 0.5 : 2;
+
+	return TRUE;
+}
+
+static gboolean
+mapius_map_zoom_snap (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	priv->zoom_snap_id = 0;
+	priv->scroll_delta = 0;
+	mapius_map_animate_zoom (GTK_WIDGET (map), 1.0);
+
+	return FALSE;
 }
 
 static gboolean
@@ -707,30 +2202,96 @@ mapius_map_key_press (GtkWidget *widget, GdkEventKey *event)
 		priv->center_y += 64;
 	}
 	else if (event->keyval == GDK_KEY_Page_Up) {
-		mapius_map_change_zoom (widget, 0, 0, TRUE);
+		if (mapius_map_zoom_step (widget, 0, 0, TRUE))
+			mapius_map_animate_zoom (widget, 1.0);
 	}
 	else if (event->keyval == GDK_KEY_Page_Down) {
-		mapius_map_change_zoom (widget, 0, 0, FALSE);
+		if (mapius_map_zoom_step (widget, 0, 0, FALSE))
+			mapius_map_animate_zoom (widget, 1.0);
 	}
 	else {
 		return FALSE;
 	}
 
+	mapius_map_stop_kinetic (MAPIUS_MAP (widget));
 	gtk_widget_queue_draw (widget);
 
 	return TRUE;
 }
 
+static void
+mapius_map_stop_kinetic (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+
+	if (priv->kinetic_tick_id) {
+		gtk_widget_remove_tick_callback (GTK_WIDGET (map), priv->kinetic_tick_id);
+		priv->kinetic_tick_id = 0;
+		mapius_map_schedule_requests (map);
+	}
+}
+
+static gboolean
+mapius_map_kinetic_tick (GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
+	gint64 now = gdk_frame_clock_get_frame_time (frame_clock);
+	gdouble decay = exp (-priv->friction * (now - priv->kinetic_time) / 1000.0);
+
+	priv->kinetic_time = now;
+	priv->kinetic_x += priv->velocity_x * (1 - decay) / priv->friction;
+	priv->kinetic_y += priv->velocity_y * (1 - decay) / priv->friction;
+	priv->velocity_x *= decay;
+	priv->velocity_y *= decay;
+	priv->center_x = round (priv->kinetic_x);
+	priv->center_y = round (priv->kinetic_y);
+
+	gtk_widget_queue_draw (widget);
+
+	if (hypot (priv->velocity_x, priv->velocity_y) < KINETIC_MIN_VELOCITY) {
+		priv->velocity_x = 0;
+		priv->velocity_y = 0;
+		priv->kinetic_tick_id = 0;
+		mapius_map_schedule_requests (MAPIUS_MAP (widget));
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+mapius_map_start_kinetic (MapiusMap *map)
+{
+	MapiusMapPrivate *priv = map->priv;
+	GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (map));
+
+	if (priv->friction <= 0 || !frame_clock || hypot (priv->velocity_x, priv->velocity_y) < KINETIC_MIN_VELOCITY)
+		return;
+
+	priv->kinetic_time = gdk_frame_clock_get_frame_time (frame_clock);
+	priv->kinetic_x = priv->center_x;
+	priv->kinetic_y = priv->center_y;
+	priv->kinetic_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (map), mapius_map_kinetic_tick, NULL, NULL);
+
+	mapius_map_schedule_requests (map);
+}
+
 static gboolean
 mapius_map_button_press (GtkWidget *widget, GdkEventButton *event)
 {
 	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
 
+	mapius_map_stop_kinetic (MAPIUS_MAP (widget));
+
 	priv->click_x = event->x;
 	priv->click_y = event->y;
 	priv->start_x = priv->center_x + event->x;
 	priv->start_y = priv->center_y + event->y;
 
+	priv->velocity_x = 0;
+	priv->velocity_y = 0;
+	priv->motion_time = event->time;
+
 	priv->button_press = TRUE;
 
 	return TRUE;
@@ -763,6 +2324,9 @@ mapius_map_button_release (GtkWidget *widget, GdkEventButton *event)
 			g_source_remove (priv->cursor_timeout_id);
 		priv->cursor_timeout_id = g_timeout_add_seconds (5, (GSourceFunc) mapius_map_hide_cursor, MAPIUS_MAP (widget));
 	}
+	else if (event->time - priv->motion_time < KINETIC_RELEASE_DELAY) {
+		mapius_map_start_kinetic (MAPIUS_MAP (widget));
+	}
 
 	gtk_widget_queue_draw (widget);
 
@@ -774,13 +2338,34 @@ mapius_map_motion_notify (GtkWidget *widget, GdkEventMotion *event)
 {
 	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
 	gint x, y;
+	gint dx, dy;
+	guint32 dt;
 
 	if (!priv->button_press)
 		return FALSE;
 
-	gdk_window_get_device_position (event->window, event->device, &x, &y, NULL);
-	priv->center_x = priv->start_x - x;
-	priv->center_y = priv->start_y - y;
+	if (event->is_hint) {
+		gdk_window_get_device_position (event->window, event->device, &x, &y, NULL);
+	}
+	else {
+		x = event->x;
+		y = event->y;
+	}
+	dx = priv->start_x - x - priv->center_x;
+	dy = priv->start_y - y - priv->center_y;
+	priv->center_x += dx;
+	priv->center_y += dy;
+
+	dt = event->time - priv->motion_time;
+	if (dt > 0 && dt < 100) {
+		priv->velocity_x = priv->velocity_x * 0.7 + (gdouble) dx / dt * 0.3;
+		priv->velocity_y = priv->velocity_y * 0.7 + (gdouble) dy / dt * 0.3;
+	}
+	else if (dt >= 100) {
+		priv->velocity_x = 0;
+		priv->velocity_y = 0;
+	}
+	priv->motion_time = event->time;
 
 	gtk_widget_queue_draw (widget);
 
@@ -790,8 +2375,10 @@ mapius_map_motion_notify (GtkWidget *widget, GdkEventMotion *event)
 static gboolean
 mapius_map_scroll (GtkWidget *widget, GdkEventScroll *event)
 {
+	MapiusMapPrivate *priv = MAPIUS_MAP (widget)->priv;
 	guint width, height;
 	gint dx, dy;
+	gdouble delta_x, delta_y;
 
 	width = gtk_widget_get_allocated_width (widget);
 	height = gtk_widget_get_allocated_height (widget);
@@ -800,12 +2387,35 @@ mapius_map_scroll (GtkWidget *widget, GdkEventScroll *event)
 	dy = event->y - height / 2;
 
 	if (event->direction == GDK_SCROLL_UP) {
-		mapius_map_change_zoom (widget, dx, dy, TRUE);
-		gtk_widget_queue_draw (widget);
+		if (mapius_map_zoom_step (widget, dx, dy, TRUE))
+			mapius_map_animate_zoom (widget, 1.0);
 	}
 	else if (event->direction == GDK_SCROLL_DOWN) {
-		mapius_map_change_zoom (widget, dx, dy, FALSE);
-		gtk_widget_queue_draw (widget);
+		if (mapius_map_zoom_step (widget, dx, dy, FALSE))
+			mapius_map_animate_zoom (widget, 1.0);
+	}
+	else if (event->direction == GDK_SCROLL_SMOOTH && gdk_event_get_scroll_deltas ((GdkEvent *) event, &delta_x, &delta_y)) {
+		if (priv->zoom_scale == 1.0) {
+			priv->zoom_anchor_x = width / 2 + dx;
+			priv->zoom_anchor_y = height / 2 + dy;
+		}
+		else {
+			dx = priv->zoom_anchor_x - width / 2;
+			dy = priv->zoom_anchor_y - height / 2;
+		}
+
+		priv->scroll_delta -= delta_y;
+		while (priv->scroll_delta >= 0.5 && mapius_map_zoom_step (widget, dx, dy, TRUE))
+			priv->scroll_delta -= 1;
+		while (priv->scroll_delta <= -0.5 && mapius_map_zoom_step (widget, dx, dy, FALSE))
+			priv->scroll_delta += 1;
+		priv->scroll_delta = CLAMP (priv->scroll_delta, -0.5, 0.5);
+
+		mapius_map_animate_zoom (widget, pow (2, priv->scroll_delta));
+
+		if (priv->zoom_snap_id)
+			g_source_remove (priv->zoom_snap_id);
+		priv->zoom_snap_id = g_timeout_add (ZOOM_SNAP_DELAY, (GSourceFunc) mapius_map_zoom_snap, MAPIUS_MAP (widget));
 	}
 
 	return TRUE;
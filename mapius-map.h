@@ -5,11 +5,16 @@
 
 #define MAPIUS_TYPE_MAP (mapius_map_get_type ())
 #define MAPIUS_MAP(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), MAPIUS_TYPE_MAP, MapiusMap))
+#define MAPIUS_TYPE_MAP_STATS (mapius_map_stats_get_type ())
+
+/* frame_times[i] counts frames drawn in under 2^i ms, the last bucket the rest */
+#define MAPIUS_MAP_FRAME_BUCKETS 8
 
 typedef struct _MapiusMap MapiusMap;
 typedef struct _MapiusMapClass MapiusMapClass;
 typedef struct _MapiusMapPrivate MapiusMapPrivate;
 typedef struct _MapiusMapInfo MapiusMapInfo;
+typedef struct _MapiusMapStats MapiusMapStats;
 
 struct _MapiusMap
 {
@@ -31,8 +36,55 @@ struct _MapiusMapInfo
 	GdkModifierType accel_mods;
 };
 
+struct _MapiusMapStats
+{
+	guint64 disk_reads;
+	guint64 redundant_reads;
+	guint64 deduplicated;
+	guint64 downloads;
+	guint64 decodes;
+	guint64 failures;
+	guint64 negative_hits;
+	guint64 cancelled;
+	guint64 prefetches;
+	guint64 revalidations;
+	guint64 not_modified;
+	guint64 bytes_fetched;
+	guint64 disk_usage;
+	guint64 cache_hits;
+	guint64 cache_misses;
+	guint64 memory_usage;
+	guint64 evictions;
+	guint64 disk_hits;
+	guint64 decode_time;
+	guint64 frames;
+	guint64 frame_time_total;
+	guint64 frame_time_max;
+	guint64 frame_times[MAPIUS_MAP_FRAME_BUCKETS];
+	guint reading;
+	guint downloading;
+	guint decoding;
+	guint fetch_queued;
+	guint fetch_active;
+	guint decode_queued;
+};
+
 GType mapius_map_get_type (void);
+GType mapius_map_stats_get_type (void);
 GtkWidget *mapius_map_new();
 void mapius_map_change_map (MapiusMap *map, gchar *id);
+void mapius_map_set_cache_budget (MapiusMap *map, gsize bytes);
+gsize mapius_map_get_cache_budget (MapiusMap *map);
+gsize mapius_map_get_cache_usage (MapiusMap *map);
+void mapius_map_get_stats (MapiusMap *map, MapiusMapStats *stats);
+void mapius_map_set_show_stats (MapiusMap *map, gboolean show);
+gboolean mapius_map_get_show_stats (MapiusMap *map);
+GArray *mapius_map_get_host_stats (MapiusMap *map);
+void mapius_map_set_view (MapiusMap *map, guint zoom, gint x, gint y);
+void mapius_map_get_view (MapiusMap *map, guint *zoom, gint *x, gint *y);
+void mapius_map_set_zoom_scale (MapiusMap *map, gdouble scale);
+const gchar *mapius_map_get_map_id (MapiusMap *map);
+gboolean mapius_map_is_viewport_complete (MapiusMap *map);
+void mapius_map_insert_tile (MapiusMap *map, guint zoom, guint x, guint y, cairo_surface_t *surface);
 
 #endif
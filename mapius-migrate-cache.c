@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "mapius-tile-pack.h"
+
+#define FLUSH_INTERVAL 1000
+
+static gboolean delete_files = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "delete", 'd', 0, G_OPTION_ARG_NONE, &delete_files, "Delete tile files after importing them", NULL },
+	{ NULL }
+};
+
+static gboolean
+parse_number (const gchar *str, guint *value)
+{
+	gchar *end;
+	guint64 result = g_ascii_strtoull (str, &end, 10);
+
+	if (end == str || *end != '\0' || result > G_MAXUINT)
+		return FALSE;
+
+	*value = result;
+
+	return TRUE;
+}
+
+/* Tile files are named "<y>.<format>"; anything with a second dot is a
+ * sidecar or a temporary file left behind by an interrupted write. */
+static gboolean
+parse_tile_name (const gchar *name, guint *y)
+{
+	const gchar *dot = strchr (name, '.');
+	const gchar *p;
+	gchar *number;
+	gboolean result;
+
+	if (!dot || dot[1] == '\0')
+		return FALSE;
+
+	for (p = dot + 1; *p; p++) {
+		if (!g_ascii_isalnum (*p))
+			return FALSE;
+	}
+
+	number = g_strndup (name, dot - name);
+	result = parse_number (number, y);
+	g_free (number);
+
+	return result;
+}
+
+static gboolean
+flush_pack (MapiusTilePack *pack, GPtrArray *imported)
+{
+	GError *err = NULL;
+	guint i;
+
+	if (!mapius_tile_pack_flush (pack, &err)) {
+		g_printerr ("%s\n", err->message);
+		g_error_free (err);
+		return FALSE;
+	}
+
+	if (delete_files) {
+		for (i = 0; i < imported->len; i++)
+			g_unlink (g_ptr_array_index (imported, i));
+	}
+	g_ptr_array_set_size (imported, 0);
+
+	return TRUE;
+}
+
+static void
+mark_imported (GPtrArray *imported, const gchar *filename)
+{
+	gchar *meta_filename = g_strconcat (filename, ".meta", NULL);
+
+	g_ptr_array_add (imported, g_strdup (filename));
+	if (g_file_test (meta_filename, G_FILE_TEST_EXISTS))
+		g_ptr_array_add (imported, meta_filename);
+	else
+		g_free (meta_filename);
+}
+
+/* Returns FALSE only on pack write errors; unreadable tiles are reported
+ * and left in place. */
+static gboolean
+import_file (MapiusTilePack *pack, GPtrArray *imported, const gchar *filename, guint zoom, guint x, guint y, guint *count)
+{
+	GError *err = NULL;
+	gchar *contents;
+	gsize length;
+
+	if (!g_file_get_contents (filename, &contents, &length, &err)) {
+		g_printerr ("%s\n", err->message);
+		g_error_free (err);
+		return TRUE;
+	}
+
+	GBytes *bytes = g_bytes_new_take (contents, length);
+	GBytes *meta = NULL;
+	gchar *meta_filename = g_strconcat (filename, ".meta", NULL);
+
+	if (g_file_get_contents (meta_filename, &contents, &length, NULL))
+		meta = g_bytes_new_take (contents, length);
+
+	gboolean result = mapius_tile_pack_append (pack, zoom, x, y, meta, bytes, &err);
+	g_bytes_unref (bytes);
+	if (meta)
+		g_bytes_unref (meta);
+	g_free (meta_filename);
+
+	if (!result) {
+		g_printerr ("%s\n", err->message);
+		g_error_free (err);
+		return FALSE;
+	}
+
+	mark_imported (imported, filename);
+	(*count)++;
+
+	return TRUE;
+}
+
+static gboolean
+import_map (const gchar *cache_dir, const gchar *map_id)
+{
+	GError *err = NULL;
+	gchar *map_dir = g_build_filename (cache_dir, map_id, NULL);
+	const gchar *zoom_name, *x_name, *y_name;
+	guint zoom, x, y;
+	guint count = 0, skipped = 0;
+	gboolean result = TRUE;
+
+	GDir *zoom_dir = g_dir_open (map_dir, 0, &err);
+	if (!zoom_dir) {
+		g_printerr ("%s\n", err->message);
+		g_error_free (err);
+		g_free (map_dir);
+		return FALSE;
+	}
+
+	MapiusTilePack *pack = mapius_tile_pack_open (map_dir, &err);
+	if (!pack) {
+		g_printerr ("%s\n", err->message);
+		g_error_free (err);
+		g_dir_close (zoom_dir);
+		g_free (map_dir);
+		return FALSE;
+	}
+
+	GPtrArray *imported = g_ptr_array_new_with_free_func (g_free);
+
+	while (result && (zoom_name = g_dir_read_name (zoom_dir))) {
+		gchar *zoom_path = g_build_filename (map_dir, zoom_name, NULL);
+		GDir *x_dir;
+
+		if (!parse_number (zoom_name, &zoom) || zoom > 24 || !(x_dir = g_dir_open (zoom_path, 0, NULL))) {
+			g_free (zoom_path);
+			continue;
+		}
+
+		while (result && (x_name = g_dir_read_name (x_dir))) {
+			gchar *x_path = g_build_filename (zoom_path, x_name, NULL);
+			GDir *y_dir;
+
+			if (!parse_number (x_name, &x) || !(y_dir = g_dir_open (x_path, 0, NULL))) {
+				g_free (x_path);
+				continue;
+			}
+
+			while (result && (y_name = g_dir_read_name (y_dir))) {
+				if (!parse_tile_name (y_name, &y))
+					continue;
+
+				gchar *y_path = g_build_filename (x_path, y_name, NULL);
+				GBytes *existing = mapius_tile_pack_lookup (pack, zoom, x, y, NULL);
+				if (existing) {
+					g_bytes_unref (existing);
+					skipped++;
+					mark_imported (imported, y_path);
+					g_free (y_path);
+					continue;
+				}
+
+				result = import_file (pack, imported, y_path, zoom, x, y, &count);
+				g_free (y_path);
+
+				if (result && imported->len >= FLUSH_INTERVAL)
+					result = flush_pack (pack, imported);
+			}
+
+			g_dir_close (y_dir);
+			if (result && delete_files) {
+				result = flush_pack (pack, imported);
+				g_rmdir (x_path);
+			}
+			g_free (x_path);
+		}
+
+		g_dir_close (x_dir);
+		if (result && delete_files)
+			g_rmdir (zoom_path);
+		g_free (zoom_path);
+	}
+
+	if (result)
+		result = flush_pack (pack, imported);
+
+	g_print ("%s: %u tiles imported, %u already packed, %u total\n", map_id, count, skipped, mapius_tile_pack_size (pack));
+
+	g_ptr_array_free (imported, TRUE);
+	mapius_tile_pack_close (pack);
+	g_dir_close (zoom_dir);
+	g_free (map_dir);
+
+	return result;
+}
+
+int main (int argc, char **argv)
+{
+	GError *err = NULL;
+	gboolean result = TRUE;
+	int i;
+
+	GOptionContext *context = g_option_context_new ("CACHE_DIR [MAP...] - import a tile directory cache into tile packs");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	if (argc < 2) {
+		g_printerr ("Usage: %s [--delete] CACHE_DIR [MAP...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 2) {
+		for (i = 2; i < argc; i++)
+			result &= import_map (argv[1], argv[i]);
+	}
+	else {
+		GDir *dir = g_dir_open (argv[1], 0, &err);
+		const gchar *name;
+
+		if (!dir) {
+			g_printerr ("%s\n", err->message);
+			return EXIT_FAILURE;
+		}
+
+		while ((name = g_dir_read_name (dir))) {
+			gchar *path = g_build_filename (argv[1], name, NULL);
+			if (g_file_test (path, G_FILE_TEST_IS_DIR))
+				result &= import_map (argv[1], name);
+			g_free (path);
+		}
+
+		g_dir_close (dir);
+	}
+
+	return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
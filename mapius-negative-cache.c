@@ -0,0 +1,217 @@
+#include <glib/gstdio.h>
+
+#include "mapius-negative-cache.h"
+
+struct _MapiusNegativeCache
+{
+	MapiusTileTable *entries;
+	gint64 not_found_ttl;
+	gint64 decode_error_ttl;
+	gint64 backoff;
+	gint64 backoff_max;
+	GHashTable *touched;
+	gboolean dirty;
+};
+
+typedef struct
+{
+	guint status;
+	guint failures;
+	gint64 expires;
+} Entry;
+
+typedef struct
+{
+	GHashTable *files;
+	gint64 now;
+} SaveData;
+
+static void
+string_free (GString *string)
+{
+	g_string_free (string, TRUE);
+}
+
+static gint64
+now_seconds (void)
+{
+	return g_get_real_time () / G_USEC_PER_SEC;
+}
+
+MapiusNegativeCache *
+mapius_negative_cache_new (gint64 not_found_ttl, gint64 decode_error_ttl, gint64 backoff, gint64 backoff_max)
+{
+	MapiusNegativeCache *cache = g_new (MapiusNegativeCache, 1);
+
+	cache->entries = mapius_tile_table_new (g_free);
+	cache->not_found_ttl = not_found_ttl;
+	cache->decode_error_ttl = decode_error_ttl;
+	cache->backoff = backoff;
+	cache->backoff_max = backoff_max;
+	cache->touched = g_hash_table_new (NULL, NULL);
+	cache->dirty = FALSE;
+
+	return cache;
+}
+
+void
+mapius_negative_cache_free (MapiusNegativeCache *cache)
+{
+	mapius_tile_table_free (cache->entries);
+	g_hash_table_destroy (cache->touched);
+	g_free (cache);
+}
+
+gboolean
+mapius_negative_cache_check (MapiusNegativeCache *cache, MapiusTileKey key)
+{
+	Entry *entry = mapius_tile_table_lookup (cache->entries, key);
+
+	return entry && entry->expires > now_seconds ();
+}
+
+void
+mapius_negative_cache_add (MapiusNegativeCache *cache, MapiusTileKey key, guint status)
+{
+	Entry *entry = mapius_tile_table_lookup (cache->entries, key);
+	gint64 ttl;
+
+	if (!entry) {
+		entry = g_new0 (Entry, 1);
+		mapius_tile_table_insert (cache->entries, key, entry);
+	}
+
+	if (status == 404 || status == 410) {
+		ttl = cache->not_found_ttl;
+	}
+	else if (status == MAPIUS_NEGATIVE_DECODE_ERROR) {
+		ttl = cache->decode_error_ttl;
+	}
+	else {
+		ttl = cache->backoff << MIN (entry->failures, 20);
+		if (ttl > cache->backoff_max)
+			ttl = cache->backoff_max;
+	}
+
+	entry->status = status;
+	entry->failures++;
+	entry->expires = now_seconds () + ttl;
+
+	g_hash_table_add (cache->touched, GUINT_TO_POINTER (MAPIUS_TILE_KEY_MAP (key)));
+	cache->dirty = TRUE;
+}
+
+void
+mapius_negative_cache_clear (MapiusNegativeCache *cache, MapiusTileKey key)
+{
+	if (mapius_tile_table_remove (cache->entries, key)) {
+		g_hash_table_add (cache->touched, GUINT_TO_POINTER (MAPIUS_TILE_KEY_MAP (key)));
+		cache->dirty = TRUE;
+	}
+}
+
+gboolean
+mapius_negative_cache_is_dirty (MapiusNegativeCache *cache)
+{
+	return cache->dirty;
+}
+
+void
+mapius_negative_cache_load (MapiusNegativeCache *cache, guint map_index, const gchar *filename)
+{
+	gchar *contents;
+	gchar **lines;
+	gint64 now = now_seconds ();
+	guint i;
+
+	if (!g_file_get_contents (filename, &contents, NULL, NULL))
+		return;
+
+	g_hash_table_add (cache->touched, GUINT_TO_POINTER (map_index));
+
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i]; i++) {
+		guint zoom, x, y, status, failures;
+		gint64 expires;
+
+		if (sscanf (lines[i], "%u %u %u %u %u %" G_GINT64_FORMAT, &zoom, &x, &y, &status, &failures, &expires) != 6)
+			continue;
+		if (expires <= now || zoom > 24 || x > 0xffffff || y > 0xffffff)
+			continue;
+
+		Entry *entry = g_new (Entry, 1);
+		entry->status = status;
+		entry->failures = failures;
+		entry->expires = expires;
+		mapius_tile_table_insert (cache->entries, MAPIUS_TILE_KEY (map_index, zoom, x, y), entry);
+	}
+
+	g_strfreev (lines);
+	g_free (contents);
+}
+
+static gboolean
+save_entry (MapiusTileKey key, Entry *entry, SaveData *data)
+{
+	GString *file = g_hash_table_lookup (data->files, GUINT_TO_POINTER (MAPIUS_TILE_KEY_MAP (key)));
+
+	if (file && entry->expires > data->now) {
+		g_string_append_printf (
+			file,
+			"%u %u %u %u %u %" G_GINT64_FORMAT "\n",
+			MAPIUS_TILE_KEY_ZOOM (key),
+			MAPIUS_TILE_KEY_X (key),
+			MAPIUS_TILE_KEY_Y (key),
+			entry->status,
+			entry->failures,
+			entry->expires
+		);
+	}
+
+	return FALSE;
+}
+
+void
+mapius_negative_cache_save (MapiusNegativeCache *cache, MapiusNegativeCacheFileFunc func, gpointer user_data)
+{
+	SaveData data;
+	GHashTableIter iter;
+	gpointer map_index;
+	GString *file;
+	GError *err = NULL;
+
+	data.files = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) string_free);
+	data.now = now_seconds ();
+
+	g_hash_table_iter_init (&iter, cache->touched);
+	while (g_hash_table_iter_next (&iter, &map_index, NULL))
+		g_hash_table_insert (data.files, map_index, g_string_new (NULL));
+
+	mapius_tile_table_foreach (cache->entries, (MapiusTileTableFunc) save_entry, &data);
+
+	g_hash_table_iter_init (&iter, data.files);
+	while (g_hash_table_iter_next (&iter, &map_index, (gpointer *) &file)) {
+		gchar *filename = func (GPOINTER_TO_UINT (map_index), user_data);
+		if (!filename)
+			continue;
+
+		if (file->len > 0) {
+			gchar *folder = g_path_get_dirname (filename);
+			g_mkdir_with_parents (folder, 0755);
+			g_free (folder);
+
+			if (!g_file_set_contents (filename, file->str, file->len, &err)) {
+				g_warning ("Error saving negative cache: %s", err->message);
+				g_clear_error (&err);
+			}
+		}
+		else {
+			g_unlink (filename);
+		}
+
+		g_free (filename);
+	}
+
+	g_hash_table_destroy (data.files);
+	cache->dirty = FALSE;
+}
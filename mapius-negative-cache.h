@@ -0,0 +1,22 @@
+#ifndef __MAPIUS_NEGATIVE_CACHE_H__
+#define __MAPIUS_NEGATIVE_CACHE_H__
+
+#include <glib.h>
+
+#include "mapius-tile-table.h"
+
+#define MAPIUS_NEGATIVE_DECODE_ERROR 0
+
+typedef struct _MapiusNegativeCache MapiusNegativeCache;
+typedef gchar *(*MapiusNegativeCacheFileFunc) (guint map_index, gpointer data);
+
+MapiusNegativeCache *mapius_negative_cache_new (gint64 not_found_ttl, gint64 decode_error_ttl, gint64 backoff, gint64 backoff_max);
+void mapius_negative_cache_free (MapiusNegativeCache *cache);
+gboolean mapius_negative_cache_check (MapiusNegativeCache *cache, MapiusTileKey key);
+void mapius_negative_cache_add (MapiusNegativeCache *cache, MapiusTileKey key, guint status);
+void mapius_negative_cache_clear (MapiusNegativeCache *cache, MapiusTileKey key);
+gboolean mapius_negative_cache_is_dirty (MapiusNegativeCache *cache);
+void mapius_negative_cache_load (MapiusNegativeCache *cache, guint map_index, const gchar *filename);
+void mapius_negative_cache_save (MapiusNegativeCache *cache, MapiusNegativeCacheFileFunc func, gpointer data);
+
+#endif
@@ -0,0 +1,54 @@
+#include "mapius-projection.h"
+
+#define LATLONG_PROJ "+proj=latlong +datum=WGS84"
+#define SPHERICAL_MERCATOR_PROJ "+proj=merc +lon_0=0 +k=1 +x_0=0 +y_0=0 +a=6378137 +b=6378137 +units=m +no_defs"
+#define ELLIPSE_MERCATOR_PROJ "+proj=merc +lon_0=0 +k=1 +x_0=0 +y_0=0 +ellps=WGS84 +datum=WGS84 +units=m +no_defs"
+#define MAX_LATITUDE 85.0511287798
+
+static projPJ latlong_proj;
+static projPJ spherical_mercator_proj;
+static projPJ ellipse_mercator_proj;
+
+static void
+init_projections (void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		latlong_proj = pj_init_plus (LATLONG_PROJ);
+		spherical_mercator_proj = pj_init_plus (SPHERICAL_MERCATOR_PROJ);
+		ellipse_mercator_proj = pj_init_plus (ELLIPSE_MERCATOR_PROJ);
+		g_once_init_leave (&initialized, 1);
+	}
+}
+
+/* The projections maps can declare; NULL for any other EPSG code.  Shared
+ * by the widget and the headless tools so both place tiles alike. */
+projPJ
+mapius_projection_for_epsg (gint epsg)
+{
+	init_projections ();
+
+	if (epsg == 3857)
+		return spherical_mercator_proj;
+	if (epsg == 3395)
+		return ellipse_mercator_proj;
+
+	return NULL;
+}
+
+/* Converts a WGS84 position to pixel coordinates at @zoom, in the same
+ * space as the widget's view center. */
+void
+mapius_projection_get_pixel (projPJ proj, gdouble lon, gdouble lat, guint zoom, gdouble *x, gdouble *y)
+{
+	gdouble size = 128.0 * (1 << zoom);
+	gdouble px = CLAMP (lon, -180, 180) * DEG_TO_RAD;
+	gdouble py = CLAMP (lat, -MAX_LATITUDE, MAX_LATITUDE) * DEG_TO_RAD;
+
+	init_projections ();
+	pj_transform (latlong_proj, proj, 1, 1, &px, &py, NULL);
+
+	*x = CLAMP (px * size / MAPIUS_EQUATOR_HALFLENGTH + size, 0, 2 * size);
+	*y = CLAMP (size - py * size / MAPIUS_EQUATOR_HALFLENGTH, 0, 2 * size);
+}
@@ -0,0 +1,12 @@
+#ifndef __MAPIUS_PROJECTION_H__
+#define __MAPIUS_PROJECTION_H__
+
+#include <glib.h>
+#include <proj_api.h>
+
+#define MAPIUS_EQUATOR_HALFLENGTH 20037508.34
+
+projPJ mapius_projection_for_epsg (gint epsg);
+void mapius_projection_get_pixel (projPJ proj, gdouble lon, gdouble lat, guint zoom, gdouble *x, gdouble *y);
+
+#endif
@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+
+#include "mapius-fixture.h"
+#include "mapius-map.h"
+#include "mapius-trace.h"
+#include "mapius-util.h"
+
+#define REPLAY_MAP_ID "replay"
+#define REPLAY_MODULE \
+	"title = 'Replay'\n" \
+	"format = 'png'\n" \
+	"proj = 3857\n" \
+	"url_template = '%s/{z}/{x}/{y}.png'\n"
+
+#define DEFAULT_FRAME_INTERVAL 16667
+
+static gchar *server = "http://127.0.0.1:8080";
+static gint sessions = 1;
+static gint timeout = 30;
+static gboolean show = FALSE;
+static gchar *config = "mapius.ini";
+
+static GOptionEntry entries[] = {
+	{ "server", 's', 0, G_OPTION_ARG_STRING, &server, "Tile server base URL (default http://127.0.0.1:8080)", "URL" },
+	{ "sessions", 'n', 0, G_OPTION_ARG_INT, &sessions, "Number of replays, each with a cold cache (default 1)", "N" },
+	{ "timeout", 't', 0, G_OPTION_ARG_INT, &timeout, "Seconds to wait for the last view to complete (default 30)", "SECONDS" },
+	{ "show", 0, 0, G_OPTION_ARG_NONE, &show, "Replay in a visible window", NULL },
+	{ "config", 0, 0, G_OPTION_ARG_FILENAME, &config, "Settings file used as a base for the map view (default mapius.ini)", "FILE" },
+	{ NULL }
+};
+
+typedef struct
+{
+	GtkWidget *window;
+	MapiusMap *map;
+	GPtrArray *events;
+	guint next_event;
+	guint32 base_time;
+	gint64 start_time;
+	gint64 end_time;
+	gboolean finished;
+	gboolean timed_out;
+	guint timeout_id;
+	gint64 last_frame_time;
+	guint frames;
+	guint frames_dropped;
+	gint64 first_tile_time;
+	gint64 first_complete_time;
+	gint64 settle_time;
+	gint64 pending_since;
+	guint zoom;
+	gint x;
+	gint y;
+	guint completions;
+	gint64 latency_sum;
+	gint64 latency_max;
+	GMainLoop *loop;
+} Replay;
+
+static gboolean
+replay_timeout (Replay *replay)
+{
+	replay->timed_out = TRUE;
+	replay->timeout_id = 0;
+	g_main_loop_quit (replay->loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+replay_next_event (Replay *replay)
+{
+	gint64 elapsed = (g_get_monotonic_time () - replay->start_time) / 1000;
+	MapiusTraceEvent *event;
+
+	while (replay->next_event < replay->events->len
+		&& (event = g_ptr_array_index (replay->events, replay->next_event))->time <= elapsed) {
+		mapius_trace_event_dispatch (event, replay->map, replay->base_time);
+		replay->next_event++;
+	}
+
+	if (replay->next_event < replay->events->len) {
+		event = g_ptr_array_index (replay->events, replay->next_event);
+		g_timeout_add (event->time - elapsed, (GSourceFunc) replay_next_event, replay);
+	}
+	else {
+		replay->end_time = g_get_monotonic_time ();
+		replay->finished = TRUE;
+		replay->timeout_id = g_timeout_add_seconds (timeout, (GSourceFunc) replay_timeout, replay);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+replay_tick (GtkWidget *widget, GdkFrameClock *clock, Replay *replay)
+{
+	gint64 now = gdk_frame_clock_get_frame_time (clock);
+	gint64 interval;
+	MapiusMapStats stats;
+	guint zoom;
+	gint x, y;
+
+	gdk_frame_clock_get_refresh_info (clock, now, &interval, NULL);
+	if (interval <= 0)
+		interval = DEFAULT_FRAME_INTERVAL;
+	if (replay->last_frame_time && now - replay->last_frame_time > interval * 3 / 2)
+		replay->frames_dropped += (now - replay->last_frame_time + interval / 2) / interval - 1;
+	replay->last_frame_time = now;
+	replay->frames++;
+
+	mapius_map_get_stats (replay->map, &stats);
+	if (replay->first_tile_time < 0 && stats.decodes > 0)
+		replay->first_tile_time = now - replay->start_time;
+
+	gboolean complete = mapius_map_is_viewport_complete (replay->map);
+
+	mapius_map_get_view (replay->map, &zoom, &x, &y);
+	if (zoom != replay->zoom || x != replay->x || y != replay->y) {
+		replay->zoom = zoom;
+		replay->x = x;
+		replay->y = y;
+		if (!replay->pending_since && !complete)
+			replay->pending_since = now;
+	}
+
+	if (replay->pending_since && complete) {
+		gint64 latency = now - replay->pending_since;
+
+		if (replay->first_complete_time < 0)
+			replay->first_complete_time = now - replay->start_time;
+		replay->completions++;
+		replay->latency_sum += latency;
+		replay->latency_max = MAX (replay->latency_max, latency);
+		replay->pending_since = 0;
+	}
+
+	if (replay->finished && !replay->pending_since) {
+		replay->settle_time = MAX (now - replay->end_time, 0);
+		g_main_loop_quit (replay->loop);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gchar *
+format_ms (gchar *buffer, gint64 usec)
+{
+	if (usec < 0)
+		return "null";
+
+	return g_ascii_formatd (buffer, G_ASCII_DTOSTR_BUF_SIZE, "%.1f", usec / 1000.0);
+}
+
+static void
+replay_report (Replay *replay, guint session, const gchar *trace)
+{
+	gchar first_tile[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar first_complete[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar settle[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar mean[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar max[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar duration[G_ASCII_DTOSTR_BUF_SIZE];
+	MapiusMapStats stats;
+
+	mapius_map_get_stats (replay->map, &stats);
+	gchar *escaped_trace = mapius_json_escape (trace);
+
+	g_print ("{\"session\": %u, \"trace\": \"%s\", \"events\": %u, \"duration_ms\": %s, "
+		"\"time_to_first_tile_ms\": %s, \"time_to_complete_viewport_ms\": %s, \"settle_ms\": %s, "
+		"\"viewport_completions\": %u, \"viewport_latency_mean_ms\": %s, \"viewport_latency_max_ms\": %s, "
+		"\"frames\": %u, \"frames_dropped\": %u, \"tiles_fetched\": %" G_GUINT64_FORMAT ", \"bytes_fetched\": %" G_GUINT64_FORMAT "}\n",
+		session, escaped_trace, replay->events->len,
+		format_ms (duration, (replay->end_time ? replay->end_time : g_get_monotonic_time ()) - replay->start_time),
+		format_ms (first_tile, replay->first_tile_time),
+		format_ms (first_complete, replay->first_complete_time),
+		format_ms (settle, replay->timed_out ? -1 : replay->settle_time),
+		replay->completions,
+		format_ms (mean, replay->completions ? replay->latency_sum / replay->completions : -1),
+		format_ms (max, replay->completions ? replay->latency_max : -1),
+		replay->frames, replay->frames_dropped, stats.downloads, stats.bytes_fetched);
+
+	g_free (escaped_trace);
+}
+
+static void
+run_session (GPtrArray *events, guint session, const gchar *trace)
+{
+	Replay replay = { 0 };
+	gint width = 800;
+	gint height = 600;
+	MapiusTraceEvent *event;
+
+	replay.events = events;
+	replay.first_tile_time = -1;
+	replay.first_complete_time = -1;
+	replay.settle_time = -1;
+	replay.loop = g_main_loop_new (NULL, FALSE);
+
+	replay.window = show ? gtk_window_new (GTK_WINDOW_TOPLEVEL) : gtk_offscreen_window_new ();
+	replay.map = MAPIUS_MAP (mapius_map_new ());
+	gtk_container_add (GTK_CONTAINER (replay.window), GTK_WIDGET (replay.map));
+
+	while (replay.next_event < events->len
+		&& ((event = g_ptr_array_index (events, replay.next_event))->type == MAPIUS_TRACE_SIZE || event->type == MAPIUS_TRACE_VIEW)) {
+		if (event->type == MAPIUS_TRACE_SIZE) {
+			width = event->width;
+			height = event->height;
+		}
+		else {
+			mapius_trace_event_dispatch (event, replay.map, 0);
+		}
+		replay.next_event++;
+	}
+	gtk_widget_set_size_request (GTK_WIDGET (replay.map), width, height);
+
+	mapius_map_get_view (replay.map, &replay.zoom, &replay.x, &replay.y);
+	gtk_widget_add_tick_callback (GTK_WIDGET (replay.map), (GtkTickCallback) replay_tick, &replay, NULL);
+	gtk_widget_show_all (replay.window);
+
+	replay.start_time = g_get_monotonic_time ();
+	replay.pending_since = replay.start_time;
+	replay.base_time = replay.start_time / 1000;
+	replay_next_event (&replay);
+
+	g_main_loop_run (replay.loop);
+
+	if (replay.timeout_id)
+		g_source_remove (replay.timeout_id);
+
+	replay_report (&replay, session, trace);
+
+	gtk_widget_destroy (replay.window);
+	while (gtk_events_pending ())
+		gtk_main_iteration ();
+	g_main_loop_unref (replay.loop);
+}
+
+static gchar *
+create_fixture (void)
+{
+	GKeyFile *settings;
+	gchar *dir = mapius_fixture_new ("replay", config, &settings);
+	gchar *module_source = g_strdup_printf (REPLAY_MODULE, server);
+
+	mapius_fixture_add_map (dir, REPLAY_MAP_ID, module_source);
+	mapius_fixture_save_settings (dir, settings);
+
+	g_key_file_free (settings);
+	g_free (module_source);
+
+	return dir;
+}
+
+int main (int argc, char **argv)
+{
+	GError *err = NULL;
+	guint i;
+
+	GOptionContext *context = g_option_context_new ("TRACE - replay recorded map interaction and measure latency");
+	g_option_context_set_summary (context,
+		"Record a trace with 'mapius --record FILE', then replay it against\n"
+		"mapius-test-server, e.g. 'mapius-test-server --latency 80 --jitter 40'.\n"
+		"Every session starts with an empty cache and prints one JSON object with\n"
+		"time to first tile, time to complete the viewport, frames dropped and\n"
+		"bytes fetched. Map ids in the trace are replaced by a map served by --server.");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	if (argc != 2) {
+		g_printerr ("Usage: %s [--server URL] [--sessions N] TRACE\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	gtk_disable_setlocale ();
+	if (!gtk_init_check (&argc, &argv)) {
+		g_printerr ("Cannot open display, run under Xvfb for headless replay\n");
+		return EXIT_FAILURE;
+	}
+
+	GPtrArray *events = mapius_trace_load (argv[1], &err);
+	if (!events) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < events->len; i++) {
+		MapiusTraceEvent *event = g_ptr_array_index (events, i);
+		if (event->type == MAPIUS_TRACE_VIEW) {
+			g_free (event->map_id);
+			event->map_id = g_strdup (REPLAY_MAP_ID);
+		}
+	}
+
+	gchar *cwd = g_get_current_dir ();
+
+	for (i = 0; i < (guint) MAX (sessions, 1); i++) {
+		gchar *dir = create_fixture ();
+		if (g_chdir (dir) != 0) {
+			g_error ("Error changing to %s", dir);
+		}
+
+		run_session (events, i, argv[1]);
+
+		g_chdir (cwd);
+		mapius_fixture_free (dir);
+	}
+
+	g_ptr_array_unref (events);
+	g_free (cwd);
+
+	return EXIT_SUCCESS;
+}
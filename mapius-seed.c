@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <glib-unix.h>
+
+#include "mapius-headless.h"
+
+#define FILL_BATCH 1000
+
+static gchar *bbox = NULL;
+static gint min_zoom = 0;
+static gint max_zoom = -1;
+static gint concurrency = 8;
+static gchar *config = "mapius.ini";
+static gboolean host_stats = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "bbox", 'b', 0, G_OPTION_ARG_STRING, &bbox, "Area to download", "MIN_LON,MIN_LAT,MAX_LON,MAX_LAT" },
+	{ "min-zoom", 'z', 0, G_OPTION_ARG_INT, &min_zoom, "Lowest zoom level (default 0)", "ZOOM" },
+	{ "max-zoom", 'Z', 0, G_OPTION_ARG_INT, &max_zoom, "Highest zoom level (default MIN_ZOOM)", "ZOOM" },
+	{ "concurrency", 'c', 0, G_OPTION_ARG_INT, &concurrency, "Maximum number of parallel requests (default 8)", "N" },
+	{ "config", 0, 0, G_OPTION_ARG_FILENAME, &config, "Settings file (default mapius.ini)", "FILE" },
+	{ "host-stats", 0, 0, G_OPTION_ARG_NONE, &host_stats, "Print requests, errors and latency per host when done", NULL },
+	{ NULL }
+};
+
+typedef struct
+{
+	MapiusHeadless *headless;
+	guint min_x[25];
+	guint max_x[25];
+	guint min_y[25];
+	guint max_y[25];
+	guint zoom;
+	guint x;
+	guint y;
+	gboolean exhausted;
+	gboolean interrupted;
+	guint queued;
+	guint fill_source_id;
+	guint64 total;
+	guint64 downloaded;
+	guint64 skipped;
+	guint64 failed;
+	guint64 bytes;
+	gint64 start_time;
+	GMainLoop *loop;
+} Seeder;
+
+static void seeder_fill (Seeder *seeder);
+
+static guint
+to_tile (gdouble pixel, guint zoom)
+{
+	return MIN ((guint) pixel / 256, (1u << zoom) - 1);
+}
+
+static gboolean
+seeder_next (Seeder *seeder, guint *zoom, guint *x, guint *y)
+{
+	if (seeder->exhausted)
+		return FALSE;
+
+	*zoom = seeder->zoom;
+	*x = seeder->x;
+	*y = seeder->y;
+
+	if (++seeder->x > seeder->max_x[seeder->zoom]) {
+		if (++seeder->y > seeder->max_y[seeder->zoom]) {
+			if (++seeder->zoom > (guint) max_zoom) {
+				seeder->exhausted = TRUE;
+				return TRUE;
+			}
+			seeder->y = seeder->min_y[seeder->zoom];
+		}
+		seeder->x = seeder->min_x[seeder->zoom];
+	}
+
+	return TRUE;
+}
+
+static void
+seeder_report (Seeder *seeder, gboolean final)
+{
+	gdouble elapsed = MAX ((g_get_monotonic_time () - seeder->start_time) / (gdouble) G_USEC_PER_SEC, 0.001);
+
+	g_print (
+		"%s%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " tiles, %" G_GUINT64_FORMAT " downloaded, %" G_GUINT64_FORMAT " present, %" G_GUINT64_FORMAT " failed, %.1f tiles/s, %.2f MB/s%s",
+		final ? "" : "\r",
+		seeder->downloaded + seeder->skipped + seeder->failed,
+		seeder->total,
+		seeder->downloaded,
+		seeder->skipped,
+		seeder->failed,
+		seeder->downloaded / elapsed,
+		seeder->bytes / elapsed / (1024 * 1024),
+		final ? "\n" : ""
+	);
+}
+
+static void
+seeder_report_hosts (Seeder *seeder)
+{
+	GArray *hosts = mapius_fetcher_get_host_stats (seeder->headless->fetcher);
+	guint i;
+
+	for (i = 0; i < hosts->len; i++) {
+		MapiusHostStats *stats = &g_array_index (hosts, MapiusHostStats, i);
+		g_print (
+			"%s: %" G_GUINT64_FORMAT " requests, %" G_GUINT64_FORMAT " errors, %.1f ms\n",
+			stats->host,
+			stats->requests,
+			stats->errors,
+			stats->latency
+		);
+	}
+
+	g_array_unref (hosts);
+}
+
+static gboolean
+seeder_report_progress (Seeder *seeder)
+{
+	seeder_report (seeder, FALSE);
+
+	return TRUE;
+}
+
+static void
+tile_fetched (GBytes *bytes, guint status, Seeder *seeder)
+{
+	if (bytes) {
+		seeder->downloaded++;
+		seeder->bytes += g_bytes_get_size (bytes);
+	}
+	else if (status != SOUP_STATUS_CANCELLED) {
+		seeder->failed++;
+	}
+
+	seeder->queued--;
+	seeder_fill (seeder);
+}
+
+static gboolean
+seeder_fill_idle (Seeder *seeder)
+{
+	seeder->fill_source_id = 0;
+	seeder_fill (seeder);
+
+	return FALSE;
+}
+
+static void
+seeder_fill (Seeder *seeder)
+{
+	guint zoom, x, y;
+	guint checked = 0;
+
+	while (!seeder->interrupted && seeder->queued < (guint) concurrency * 2) {
+		if (checked++ >= FILL_BATCH) {
+			if (!seeder->fill_source_id)
+				seeder->fill_source_id = g_idle_add ((GSourceFunc) seeder_fill_idle, seeder);
+			return;
+		}
+
+		if (!seeder_next (seeder, &zoom, &x, &y))
+			break;
+
+		MapiusMapSource *source = seeder->headless->source;
+		if (mapius_disk_cache_contains (seeder->headless->cache, source->id, source->format, zoom, x, y)) {
+			seeder->skipped++;
+			continue;
+		}
+
+		if (!mapius_headless_download (seeder->headless, zoom, x, y, 0, (MapiusDownloadFunc) tile_fetched, seeder)) {
+			seeder->failed++;
+			continue;
+		}
+		seeder->queued++;
+	}
+
+	if (seeder->queued == 0 && (seeder->exhausted || seeder->interrupted))
+		g_main_loop_quit (seeder->loop);
+}
+
+static gboolean
+seeder_interrupt (Seeder *seeder)
+{
+	if (seeder->interrupted)
+		return TRUE;
+
+	g_printerr ("\nInterrupted, waiting for %u requests\n", seeder->queued);
+	seeder->interrupted = TRUE;
+	seeder_fill (seeder);
+
+	return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+	GError *err = NULL;
+	Seeder seeder;
+	gdouble min_lon, min_lat, max_lon, max_lat;
+	guint zoom;
+
+	GOptionContext *context = g_option_context_new ("MAP_ID - download map tiles for an area into the cache");
+	g_option_context_set_summary (context,
+		"Tiles already present in the cache are skipped, so an interrupted run\n"
+		"resumes where it stopped when started again with the same arguments.");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	if (argc != 2 || !bbox) {
+		g_printerr ("Usage: %s --bbox MIN_LON,MIN_LAT,MAX_LON,MAX_LAT [--min-zoom Z] [--max-zoom Z] MAP_ID\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!mapius_parse_bbox (bbox, &min_lon, &min_lat, &max_lon, &max_lat)) {
+		g_printerr ("Bad bounding box: %s\n", bbox);
+		return EXIT_FAILURE;
+	}
+
+	if (max_zoom < 0)
+		max_zoom = min_zoom;
+	if (min_zoom < 0 || max_zoom > 24 || min_zoom > max_zoom) {
+		g_printerr ("Bad zoom range: %d-%d\n", min_zoom, max_zoom);
+		return EXIT_FAILURE;
+	}
+	concurrency = MAX (concurrency, 1);
+
+	memset (&seeder, 0, sizeof (Seeder));
+	seeder.headless = mapius_headless_new (config, argv[1], concurrency, &err);
+	if (!seeder.headless) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+
+	for (zoom = min_zoom; zoom <= (guint) max_zoom; zoom++) {
+		gdouble left, top, right, bottom;
+
+		mapius_headless_get_pixel (seeder.headless, min_lon, max_lat, zoom, &left, &top);
+		mapius_headless_get_pixel (seeder.headless, max_lon, min_lat, zoom, &right, &bottom);
+		seeder.min_x[zoom] = to_tile (left, zoom);
+		seeder.max_x[zoom] = to_tile (right, zoom);
+		seeder.min_y[zoom] = to_tile (top, zoom);
+		seeder.max_y[zoom] = to_tile (bottom, zoom);
+		seeder.total += (guint64) (seeder.max_x[zoom] - seeder.min_x[zoom] + 1) * (seeder.max_y[zoom] - seeder.min_y[zoom] + 1);
+	}
+
+	seeder.zoom = min_zoom;
+	seeder.x = seeder.min_x[min_zoom];
+	seeder.y = seeder.min_y[min_zoom];
+	seeder.start_time = g_get_monotonic_time ();
+	seeder.loop = g_main_loop_new (NULL, FALSE);
+
+	g_print ("Seeding %s, zoom %d-%d, %" G_GUINT64_FORMAT " tiles\n", seeder.headless->source->id, min_zoom, max_zoom, seeder.total);
+
+	g_unix_signal_add (SIGINT, (GSourceFunc) seeder_interrupt, &seeder);
+	g_unix_signal_add (SIGTERM, (GSourceFunc) seeder_interrupt, &seeder);
+	guint report_id = g_timeout_add_seconds (1, (GSourceFunc) seeder_report_progress, &seeder);
+
+	seeder_fill (&seeder);
+	if (seeder.queued > 0 || seeder.fill_source_id)
+		g_main_loop_run (seeder.loop);
+
+	g_source_remove (report_id);
+	seeder_report (&seeder, TRUE);
+	if (host_stats)
+		seeder_report_hosts (&seeder);
+
+	mapius_headless_free (seeder.headless);
+	g_main_loop_unref (seeder.loop);
+
+	return seeder.interrupted || seeder.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cairo.h>
+#include <libsoup/soup.h>
+
+static gint port = 8080;
+static gint latency = 0;
+static gint jitter = 0;
+static gdouble error_rate = 0;
+static gchar **host_latencies = NULL;
+static GHashTable *latencies;
+
+static GOptionEntry entries[] = {
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to listen on, 0 for any free port", "PORT" },
+	{ "latency", 'l', 0, G_OPTION_ARG_INT, &latency, "Response latency in milliseconds", "MS" },
+	{ "jitter", 'j', 0, G_OPTION_ARG_INT, &jitter, "Random extra latency in milliseconds", "MS" },
+	{ "error-rate", 'e', 0, G_OPTION_ARG_DOUBLE, &error_rate, "Percentage of requests answered with 503", "PERCENT" },
+	{ "host-latency", 'H', 0, G_OPTION_ARG_STRING_ARRAY, &host_latencies, "Response latency for requests to HOST", "HOST=MS" },
+	{ NULL }
+};
+
+typedef struct
+{
+	SoupServer *server;
+	SoupMessage *msg;
+} PausedMessage;
+
+static cairo_status_t
+write_png (GByteArray *array, const unsigned char *data, unsigned int length)
+{
+	g_byte_array_append (array, data, length);
+
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static GByteArray *
+render_tile (guint zoom, guint x, guint y)
+{
+	cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, 256, 256);
+	cairo_t *cr = cairo_create (surface);
+	GByteArray *array = g_byte_array_new ();
+	gchar *text = g_strdup_printf ("%u/%u/%u", zoom, x, y);
+	guint hash = (x * 7919 + y * 104729 + zoom * 15485863) & 0xffffff;
+
+	cairo_set_source_rgb (cr, 0.5 + (hash & 0xff) / 512.0, 0.5 + ((hash >> 8) & 0xff) / 512.0, 0.5 + (hash >> 16) / 512.0);
+	cairo_paint (cr);
+	cairo_set_source_rgb (cr, 0, 0, 0);
+	cairo_rectangle (cr, 0.5, 0.5, 255, 255);
+	cairo_set_line_width (cr, 1);
+	cairo_stroke (cr);
+	cairo_set_font_size (cr, 20);
+	cairo_move_to (cr, 16, 128);
+	cairo_show_text (cr, text);
+
+	cairo_destroy (cr);
+	cairo_surface_write_to_png_stream (surface, (cairo_write_func_t) write_png, array);
+	cairo_surface_destroy (surface);
+	g_free (text);
+
+	return array;
+}
+
+static gint
+get_latency (SoupMessage *msg)
+{
+	const gchar *host = soup_message_get_uri (msg)->host;
+	gpointer value;
+	gint result = latency;
+
+	if (host && g_hash_table_lookup_extended (latencies, host, NULL, &value))
+		result = GPOINTER_TO_INT (value);
+	if (jitter > 0)
+		result += g_random_int_range (0, jitter);
+
+	return result;
+}
+
+static void
+handle_tile (SoupMessage *msg, const char *path)
+{
+	guint zoom, x, y;
+	gchar *etag;
+
+	if (sscanf (path, "/%u/%u/%u.png", &zoom, &x, &y) != 3 || zoom > 24 || x >= (1u << zoom) || y >= (1u << zoom)) {
+		soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	if (error_rate > 0 && g_random_double_range (0, 100) < error_rate) {
+		soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return;
+	}
+
+	etag = g_strdup_printf ("\"%u-%u-%u\"", zoom, x, y);
+	soup_message_headers_replace (msg->response_headers, "ETag", etag);
+	soup_message_headers_replace (msg->response_headers, "Cache-Control", "max-age=60");
+
+	if (g_strcmp0 (soup_message_headers_get_one (msg->request_headers, "If-None-Match"), etag) == 0) {
+		soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+	}
+	else {
+		GByteArray *array = render_tile (zoom, x, y);
+		gsize length = array->len;
+		soup_message_set_status (msg, SOUP_STATUS_OK);
+		soup_message_set_response (msg, "image/png", SOUP_MEMORY_TAKE, (gchar *) g_byte_array_free (array, FALSE), length);
+	}
+
+	g_free (etag);
+}
+
+static gboolean
+resume_message (PausedMessage *paused)
+{
+	soup_server_unpause_message (paused->server, paused->msg);
+	g_object_unref (paused->msg);
+	g_free (paused);
+
+	return FALSE;
+}
+
+static void
+server_callback (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *client, gpointer data)
+{
+	if (msg->method != SOUP_METHOD_GET) {
+		soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	handle_tile (msg, path);
+
+	gint delay = get_latency (msg);
+	if (delay > 0) {
+		PausedMessage *paused = g_new (PausedMessage, 1);
+		paused->server = server;
+		paused->msg = g_object_ref (msg);
+		soup_server_pause_message (server, msg);
+		g_timeout_add (delay, (GSourceFunc) resume_message, paused);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	GError *err = NULL;
+	gchar **i;
+
+	GOptionContext *context = g_option_context_new ("- serve generated tiles with configurable latency");
+	g_option_context_set_summary (context,
+		"Tiles are served as /ZOOM/X/Y.png. Requests to different host names\n"
+		"(127.0.0.1, 127.0.0.2, localhost, ...) can be given different latencies\n"
+		"to exercise mirror selection, e.g. with a map module declaring\n\n"
+		"  url_template = 'http://127.0.0.1:8080/{z}/{x}/{y}.png'\n"
+		"  mirrors = ['127.0.0.1', '127.0.0.2', 'localhost']");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	latencies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	for (i = host_latencies; i && *i; i++) {
+		gchar *sep = strrchr (*i, '=');
+		if (!sep) {
+			g_printerr ("Bad host latency '%s'\n", *i);
+			return EXIT_FAILURE;
+		}
+		g_hash_table_insert (latencies, g_strndup (*i, sep - *i), GINT_TO_POINTER (atoi (sep + 1)));
+	}
+
+	SoupServer *server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "mapius-test-server ", NULL);
+	soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+	if (!soup_server_listen_all (server, port, 0, &err)) {
+		g_printerr ("%s\n", err->message);
+		return EXIT_FAILURE;
+	}
+
+	GSList *uris = soup_server_get_uris (server);
+	g_print ("Listening on port %u\n", uris ? soup_uri_get_port (uris->data) : (guint) port);
+	fflush (stdout);
+	g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+	g_main_loop_run (g_main_loop_new (NULL, FALSE));
+
+	return EXIT_SUCCESS;
+}
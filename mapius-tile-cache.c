@@ -0,0 +1,165 @@
+#include "mapius-tile-cache.h"
+
+typedef struct _Entry Entry;
+
+struct _Entry
+{
+	MapiusTileKey key;
+	cairo_surface_t *surface;
+	gsize size;
+	Entry *prev;
+	Entry *next;
+};
+
+struct _MapiusTileCache
+{
+	MapiusTileTable *entries;
+	Entry *head;
+	Entry *tail;
+	gsize budget;
+	gsize usage;
+};
+
+static void
+entry_unlink (MapiusTileCache *cache, Entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+}
+
+static void
+entry_push_head (MapiusTileCache *cache, Entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
+}
+
+static void
+entry_free (Entry *entry)
+{
+	cairo_surface_destroy (entry->surface);
+	g_free (entry);
+}
+
+MapiusTileCache *
+mapius_tile_cache_new (gsize budget)
+{
+	MapiusTileCache *cache = g_new (MapiusTileCache, 1);
+
+	cache->entries = mapius_tile_table_new ((GDestroyNotify) entry_free);
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->budget = budget;
+	cache->usage = 0;
+
+	return cache;
+}
+
+void
+mapius_tile_cache_free (MapiusTileCache *cache)
+{
+	mapius_tile_table_free (cache->entries);
+	g_free (cache);
+}
+
+cairo_surface_t *
+mapius_tile_cache_lookup (MapiusTileCache *cache, MapiusTileKey key)
+{
+	Entry *entry = mapius_tile_table_lookup (cache->entries, key);
+
+	if (!entry)
+		return NULL;
+
+	if (entry != cache->head) {
+		entry_unlink (cache, entry);
+		entry_push_head (cache, entry);
+	}
+
+	return entry->surface;
+}
+
+gboolean
+mapius_tile_cache_contains (MapiusTileCache *cache, MapiusTileKey key)
+{
+	return mapius_tile_table_lookup (cache->entries, key) != NULL;
+}
+
+void
+mapius_tile_cache_insert (MapiusTileCache *cache, MapiusTileKey key, cairo_surface_t *surface)
+{
+	Entry *entry = mapius_tile_table_lookup (cache->entries, key);
+
+	if (entry) {
+		entry_unlink (cache, entry);
+		cache->usage -= entry->size;
+		mapius_tile_table_remove (cache->entries, key);
+	}
+
+	entry = g_new (Entry, 1);
+	entry->key = key;
+	entry->surface = surface;
+	entry->size = sizeof (Entry)
+		+ cairo_image_surface_get_stride (surface) * cairo_image_surface_get_height (surface);
+
+	mapius_tile_table_insert (cache->entries, key, entry);
+	entry_push_head (cache, entry);
+	cache->usage += entry->size;
+}
+
+guint
+mapius_tile_cache_evict (MapiusTileCache *cache)
+{
+	guint count = 0;
+
+	while (cache->usage > cache->budget && cache->tail) {
+		Entry *entry = cache->tail;
+		entry_unlink (cache, entry);
+		cache->usage -= entry->size;
+		mapius_tile_table_remove (cache->entries, entry->key);
+		count++;
+	}
+
+	return count;
+}
+
+gboolean
+mapius_tile_cache_over_budget (MapiusTileCache *cache)
+{
+	return cache->usage > cache->budget;
+}
+
+void
+mapius_tile_cache_set_budget (MapiusTileCache *cache, gsize budget)
+{
+	cache->budget = budget;
+}
+
+gsize
+mapius_tile_cache_get_budget (MapiusTileCache *cache)
+{
+	return cache->budget;
+}
+
+gsize
+mapius_tile_cache_get_usage (MapiusTileCache *cache)
+{
+	return cache->usage;
+}
+
+guint
+mapius_tile_cache_size (MapiusTileCache *cache)
+{
+	return mapius_tile_table_size (cache->entries);
+}
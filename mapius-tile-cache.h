@@ -0,0 +1,23 @@
+#ifndef __MAPIUS_TILE_CACHE_H__
+#define __MAPIUS_TILE_CACHE_H__
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "mapius-tile-table.h"
+
+typedef struct _MapiusTileCache MapiusTileCache;
+
+MapiusTileCache *mapius_tile_cache_new (gsize budget);
+void mapius_tile_cache_free (MapiusTileCache *cache);
+cairo_surface_t *mapius_tile_cache_lookup (MapiusTileCache *cache, MapiusTileKey key);
+gboolean mapius_tile_cache_contains (MapiusTileCache *cache, MapiusTileKey key);
+void mapius_tile_cache_insert (MapiusTileCache *cache, MapiusTileKey key, cairo_surface_t *surface);
+guint mapius_tile_cache_evict (MapiusTileCache *cache);
+gboolean mapius_tile_cache_over_budget (MapiusTileCache *cache);
+void mapius_tile_cache_set_budget (MapiusTileCache *cache, gsize budget);
+gsize mapius_tile_cache_get_budget (MapiusTileCache *cache);
+gsize mapius_tile_cache_get_usage (MapiusTileCache *cache);
+guint mapius_tile_cache_size (MapiusTileCache *cache);
+
+#endif
@@ -0,0 +1,243 @@
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mapius-tile-decoder.h"
+
+struct _MapiusTileDecoder
+{
+	GThreadPool *pool;
+	GAsyncQueue *results;
+	MapiusTileDecodedFunc func;
+	gpointer data;
+	gint dispatch_scheduled;
+	gint queued;
+	guint64 decode_time;
+	gint ref_count;
+};
+
+struct _MapiusTileDecodeJob
+{
+	MapiusTileKey key;
+	GBytes *bytes;
+	cairo_surface_t *surface;
+	gint64 decode_time;
+	gint cancelled;
+	gint ref_count;
+};
+
+typedef MapiusTileDecodeJob Job;
+
+void
+mapius_tile_decode_job_unref (Job *job)
+{
+	if (g_atomic_int_dec_and_test (&job->ref_count)) {
+		if (job->bytes)
+			g_bytes_unref (job->bytes);
+		if (job->surface)
+			cairo_surface_destroy (job->surface);
+		g_free (job);
+	}
+}
+
+void
+mapius_tile_decode_job_cancel (Job *job)
+{
+	g_atomic_int_set (&job->cancelled, TRUE);
+}
+
+static cairo_surface_t *
+surface_from_pixbuf (GdkPixbuf *pixbuf)
+{
+	gint width = gdk_pixbuf_get_width (pixbuf);
+	gint height = gdk_pixbuf_get_height (pixbuf);
+	gint n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+	gint src_stride = gdk_pixbuf_get_rowstride (pixbuf);
+	const guchar *src_data = gdk_pixbuf_get_pixels (pixbuf);
+	gint x, y;
+
+	cairo_surface_t *surface = cairo_image_surface_create (
+		n_channels == 4 ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+		width,
+		height
+	);
+	if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy (surface);
+		return NULL;
+	}
+
+	cairo_surface_flush (surface);
+	guchar *dst_data = cairo_image_surface_get_data (surface);
+	gint dst_stride = cairo_image_surface_get_stride (surface);
+
+	for (y = 0; y < height; y++) {
+		const guchar *src = src_data + y * src_stride;
+		guint32 *dst = (guint32 *) (dst_data + y * dst_stride);
+
+		if (n_channels == 4) {
+			for (x = 0; x < width; x++, src += 4) {
+				guint a = src[3];
+				if (a == 0xff) {
+					dst[x] = 0xff000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+				}
+				else if (a == 0) {
+					dst[x] = 0;
+				}
+				else {
+					guint r = src[0] * a + 0x80;
+					guint g = src[1] * a + 0x80;
+					guint b = src[2] * a + 0x80;
+					r = ((r >> 8) + r) >> 8;
+					g = ((g >> 8) + g) >> 8;
+					b = ((b >> 8) + b) >> 8;
+					dst[x] = (a << 24) | (r << 16) | (g << 8) | b;
+				}
+			}
+		}
+		else {
+			for (x = 0; x < width; x++, src += n_channels)
+				dst[x] = 0xff000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+		}
+	}
+
+	cairo_surface_mark_dirty (surface);
+
+	return surface;
+}
+
+cairo_surface_t *
+mapius_tile_decode (GBytes *bytes)
+{
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
+	cairo_surface_t *surface = NULL;
+	gsize size;
+	const guchar *data = g_bytes_get_data (bytes, &size);
+
+	if (gdk_pixbuf_loader_write (loader, data, size, NULL) && gdk_pixbuf_loader_close (loader, NULL)) {
+		GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+		if (pixbuf)
+			surface = surface_from_pixbuf (pixbuf);
+	}
+	else {
+		gdk_pixbuf_loader_close (loader, NULL);
+	}
+
+	g_object_unref (loader);
+
+	return surface;
+}
+
+static MapiusTileDecoder *
+decoder_ref (MapiusTileDecoder *decoder)
+{
+	g_atomic_int_inc (&decoder->ref_count);
+	return decoder;
+}
+
+static void
+decoder_unref (MapiusTileDecoder *decoder)
+{
+	if (g_atomic_int_dec_and_test (&decoder->ref_count)) {
+		g_async_queue_unref (decoder->results);
+		g_free (decoder);
+	}
+}
+
+static gboolean
+dispatch_results (MapiusTileDecoder *decoder)
+{
+	Job *job;
+
+	g_atomic_int_set (&decoder->dispatch_scheduled, FALSE);
+
+	while ((job = g_async_queue_try_pop (decoder->results))) {
+		decoder->decode_time += job->decode_time;
+		if (decoder->func && !g_atomic_int_get (&job->cancelled)) {
+			decoder->func (job->key, job->surface, decoder->data);
+			job->surface = NULL;
+		}
+		mapius_tile_decode_job_unref (job);
+	}
+
+	return FALSE;
+}
+
+static void
+decode_job (Job *job, MapiusTileDecoder *decoder)
+{
+	g_atomic_int_add (&decoder->queued, -1);
+
+	if (g_atomic_int_get (&job->cancelled)) {
+		mapius_tile_decode_job_unref (job);
+		return;
+	}
+
+	gint64 start_time = g_get_monotonic_time ();
+	job->surface = mapius_tile_decode (job->bytes);
+	job->decode_time = g_get_monotonic_time () - start_time;
+	g_bytes_unref (job->bytes);
+	job->bytes = NULL;
+
+	g_async_queue_push (decoder->results, job);
+
+	if (g_atomic_int_compare_and_exchange (&decoder->dispatch_scheduled, FALSE, TRUE)) {
+		g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, (GSourceFunc) dispatch_results,
+			decoder_ref (decoder), (GDestroyNotify) decoder_unref);
+	}
+}
+
+MapiusTileDecoder *
+mapius_tile_decoder_new (guint threads, MapiusTileDecodedFunc func, gpointer data)
+{
+	MapiusTileDecoder *decoder = g_new (MapiusTileDecoder, 1);
+	GError *err = NULL;
+
+	if (threads == 0)
+		threads = g_get_num_processors ();
+
+	decoder->pool = g_thread_pool_new ((GFunc) decode_job, decoder, threads, FALSE, &err);
+	if (err) {
+		g_error ("Error creating decoder threads: %s", err->message);
+	}
+	decoder->results = g_async_queue_new_full ((GDestroyNotify) mapius_tile_decode_job_unref);
+	decoder->func = func;
+	decoder->data = data;
+	decoder->dispatch_scheduled = FALSE;
+	decoder->queued = 0;
+	decoder->decode_time = 0;
+	decoder->ref_count = 1;
+
+	return decoder;
+}
+
+void
+mapius_tile_decoder_free (MapiusTileDecoder *decoder)
+{
+	g_thread_pool_free (decoder->pool, TRUE, TRUE);
+
+	decoder->func = NULL;
+	decoder_unref (decoder);
+}
+
+void
+mapius_tile_decoder_get_stats (MapiusTileDecoder *decoder, guint *queued, guint64 *decode_time)
+{
+	*queued = MAX (g_atomic_int_get (&decoder->queued), 0);
+	*decode_time = decoder->decode_time;
+}
+
+MapiusTileDecodeJob *
+mapius_tile_decoder_push (MapiusTileDecoder *decoder, MapiusTileKey key, GBytes *bytes)
+{
+	Job *job = g_new (Job, 1);
+
+	job->key = key;
+	job->bytes = g_bytes_ref (bytes);
+	job->surface = NULL;
+	job->decode_time = 0;
+	job->cancelled = FALSE;
+	job->ref_count = 2;
+
+	g_atomic_int_inc (&decoder->queued);
+	g_thread_pool_push (decoder->pool, job, NULL);
+
+	return job;
+}
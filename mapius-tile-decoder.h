@@ -0,0 +1,21 @@
+#ifndef __MAPIUS_TILE_DECODER_H__
+#define __MAPIUS_TILE_DECODER_H__
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "mapius-tile-table.h"
+
+typedef struct _MapiusTileDecoder MapiusTileDecoder;
+typedef struct _MapiusTileDecodeJob MapiusTileDecodeJob;
+typedef void (*MapiusTileDecodedFunc) (MapiusTileKey key, cairo_surface_t *surface, gpointer data);
+
+MapiusTileDecoder *mapius_tile_decoder_new (guint threads, MapiusTileDecodedFunc func, gpointer data);
+void mapius_tile_decoder_free (MapiusTileDecoder *decoder);
+MapiusTileDecodeJob *mapius_tile_decoder_push (MapiusTileDecoder *decoder, MapiusTileKey key, GBytes *bytes);
+void mapius_tile_decode_job_cancel (MapiusTileDecodeJob *job);
+void mapius_tile_decode_job_unref (MapiusTileDecodeJob *job);
+void mapius_tile_decoder_get_stats (MapiusTileDecoder *decoder, guint *queued, guint64 *decode_time);
+cairo_surface_t *mapius_tile_decode (GBytes *bytes);
+
+#endif
@@ -0,0 +1,686 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <glib/gstdio.h>
+
+#include "mapius-tile-pack.h"
+#include "mapius-tile-table.h"
+
+#define PACK_MAGIC "MAPIUSPK"
+#define INDEX_MAGIC "MAPIUSIX"
+#define MAGIC_SIZE 8
+
+/* A record (and its index entry) with this meta_length and no payload marks
+ * its tile as removed; the space it shadows is reclaimed by compaction. */
+#define TOMBSTONE G_MAXUINT32
+
+struct _MapiusTilePack
+{
+	gchar *pack_filename;
+	gchar *index_filename;
+	int lock_fd;
+	FILE *pack_file;
+	FILE *index_file;
+	guint64 end;
+	GArray *unpublished;
+	GMutex lock;
+	GMappedFile *mapping;
+	GArray *entries;
+	MapiusTileTable *index;
+	guint64 published_end;
+	guint64 live_size;
+	gint64 created;
+};
+
+typedef struct
+{
+	guint64 key;
+	guint32 length;
+	guint32 meta_length;
+} PackRecord;
+
+typedef struct
+{
+	guint64 key;
+	guint64 offset;
+	guint32 length;
+	guint32 meta_length;
+} PackEntry;
+
+static void
+set_errno_error (GError **error, const gchar *filename)
+{
+	int saved_errno = errno;
+
+	g_set_error (
+		error,
+		G_FILE_ERROR,
+		g_file_error_from_errno (saved_errno),
+		"%s: %s",
+		filename,
+		g_strerror (saved_errno)
+	);
+}
+
+static gboolean
+create_file (const gchar *filename, const gchar *magic, GError **error)
+{
+	if (g_file_test (filename, G_FILE_TEST_EXISTS))
+		return TRUE;
+
+	return g_file_set_contents (filename, magic, MAGIC_SIZE, error);
+}
+
+static gboolean
+is_tombstone (guint32 length, guint32 meta_length)
+{
+	return meta_length == TOMBSTONE && length == 0;
+}
+
+static void
+add_entry (MapiusTilePack *pack, PackEntry *entry)
+{
+	guint i = GPOINTER_TO_UINT (mapius_tile_table_lookup (pack->index, entry->key));
+	if (i)
+		pack->live_size -= sizeof (PackRecord) + g_array_index (pack->entries, PackEntry, i - 1).length;
+
+	if (is_tombstone (entry->length, entry->meta_length)) {
+		mapius_tile_table_remove (pack->index, entry->key);
+		return;
+	}
+
+	g_array_append_val (pack->entries, *entry);
+	mapius_tile_table_insert (pack->index, entry->key, GUINT_TO_POINTER (pack->entries->len));
+	pack->live_size += sizeof (PackRecord) + entry->length;
+}
+
+typedef struct
+{
+	MapiusTilePack *pack;
+	GArray *live;
+} ForeachData;
+
+static gboolean
+collect_entry (MapiusTileKey key, gpointer value, ForeachData *data)
+{
+	PackEntry *entry = &g_array_index (data->pack->entries, PackEntry, GPOINTER_TO_UINT (value) - 1);
+
+	g_array_append_val (data->live, *entry);
+
+	return FALSE;
+}
+
+static gint
+compare_offsets (PackEntry *a, PackEntry *b)
+{
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+static GArray *
+live_entries (MapiusTilePack *pack)
+{
+	ForeachData data;
+
+	data.pack = pack;
+	data.live = g_array_sized_new (FALSE, FALSE, sizeof (PackEntry), mapius_tile_table_size (pack->index));
+	mapius_tile_table_foreach (pack->index, (MapiusTileTableFunc) collect_entry, &data);
+	g_array_sort (data.live, (GCompareFunc) compare_offsets);
+
+	return data.live;
+}
+
+/* Writes only the live entries, so neither superseded records nor removed
+ * tiles come back when the index is loaded again. */
+static gboolean
+write_index (MapiusTilePack *pack, GError **error)
+{
+	GArray *live = live_entries (pack);
+	GByteArray *buffer = g_byte_array_sized_new (MAGIC_SIZE + live->len * sizeof (PackEntry));
+
+	g_byte_array_append (buffer, (const guint8 *) INDEX_MAGIC, MAGIC_SIZE);
+	g_byte_array_append (buffer, (const guint8 *) live->data, live->len * sizeof (PackEntry));
+
+	gboolean result = g_file_set_contents (pack->index_filename, (const gchar *) buffer->data, buffer->len, error);
+	g_byte_array_free (buffer, TRUE);
+	g_array_free (live, TRUE);
+
+	return result;
+}
+
+static gboolean
+load_index (MapiusTilePack *pack, gsize pack_size, gboolean *rewrite, GError **error)
+{
+	GMappedFile *mapping = g_mapped_file_new (pack->index_filename, FALSE, error);
+	if (!mapping)
+		return FALSE;
+
+	const gchar *contents = g_mapped_file_get_contents (mapping);
+	gsize length = g_mapped_file_get_length (mapping);
+	gsize i;
+
+	if (length < MAGIC_SIZE || memcmp (contents, INDEX_MAGIC, MAGIC_SIZE) != 0) {
+		g_mapped_file_unref (mapping);
+		*rewrite = TRUE;
+		return TRUE;
+	}
+
+	if ((length - MAGIC_SIZE) % sizeof (PackEntry) != 0)
+		*rewrite = TRUE;
+
+	for (i = MAGIC_SIZE; i + sizeof (PackEntry) <= length; i += sizeof (PackEntry)) {
+		PackEntry entry;
+		memcpy (&entry, contents + i, sizeof (PackEntry));
+
+		if (entry.offset < MAGIC_SIZE || entry.offset + sizeof (PackRecord) + entry.length > pack_size
+			|| (entry.meta_length > entry.length && !is_tombstone (entry.length, entry.meta_length))) {
+			*rewrite = TRUE;
+			continue;
+		}
+
+		add_entry (pack, &entry);
+		pack->end = MAX (pack->end, entry.offset + sizeof (PackRecord) + entry.length);
+	}
+
+	g_mapped_file_unref (mapping);
+
+	return TRUE;
+}
+
+static gsize
+recover_records (MapiusTilePack *pack, const gchar *contents, gsize size, gboolean *rewrite)
+{
+	while (pack->end + sizeof (PackRecord) <= size) {
+		PackRecord record;
+		PackEntry entry;
+
+		memcpy (&record, contents + pack->end, sizeof (PackRecord));
+		if (pack->end + sizeof (PackRecord) + record.length > size
+			|| (record.meta_length > record.length && !is_tombstone (record.length, record.meta_length)))
+			break;
+
+		entry.key = record.key;
+		entry.offset = pack->end;
+		entry.length = record.length;
+		entry.meta_length = record.meta_length;
+		add_entry (pack, &entry);
+
+		/* The index keeps no tombstones, so trailing ones are replayed
+		 * here on every open; that alone is no reason to rewrite it. */
+		if (!is_tombstone (record.length, record.meta_length))
+			*rewrite = TRUE;
+
+		pack->end += sizeof (PackRecord) + record.length;
+	}
+
+	return pack->end;
+}
+
+/* When the pack was first opened, kept in a file of its own because the
+ * pack's mtime moves with every append. */
+static gint64
+load_created (const gchar *dir)
+{
+	gchar *filename = g_build_filename (dir, "tiles.created", NULL);
+	gchar *contents;
+	gint64 created = 0;
+
+	if (g_file_get_contents (filename, &contents, NULL, NULL)) {
+		created = g_ascii_strtoll (contents, NULL, 10);
+		g_free (contents);
+	}
+
+	if (created <= 0) {
+		created = g_get_real_time () / G_USEC_PER_SEC;
+		contents = g_strdup_printf ("%" G_GINT64_FORMAT "\n", created);
+		g_file_set_contents (filename, contents, -1, NULL);
+		g_free (contents);
+	}
+
+	g_free (filename);
+
+	return created;
+}
+
+MapiusTilePack *
+mapius_tile_pack_open (const gchar *dir, GError **error)
+{
+	MapiusTilePack *pack = g_new0 (MapiusTilePack, 1);
+	gboolean rewrite = FALSE;
+
+	pack->pack_filename = g_build_filename (dir, "tiles.pack", NULL);
+	pack->index_filename = g_build_filename (dir, "tiles.idx", NULL);
+	pack->lock_fd = -1;
+	pack->end = MAGIC_SIZE;
+	pack->unpublished = g_array_new (FALSE, FALSE, sizeof (PackEntry));
+	g_mutex_init (&pack->lock);
+	pack->entries = g_array_new (FALSE, FALSE, sizeof (PackEntry));
+	pack->index = mapius_tile_table_new (NULL);
+
+	if (g_mkdir_with_parents (dir, 0755) != 0) {
+		set_errno_error (error, dir);
+		goto fail;
+	}
+
+	/* One writer per pack: a running mapius and mapius-migrate-cache (or
+	 * a seeder) would otherwise append over each other.  The lock lives
+	 * in a file of its own since compaction replaces pack and index. */
+	gchar *lock_filename = g_build_filename (dir, "tiles.lock", NULL);
+	pack->lock_fd = g_open (lock_filename, O_RDWR | O_CREAT, 0644);
+	if (pack->lock_fd < 0) {
+		set_errno_error (error, lock_filename);
+		g_free (lock_filename);
+		goto fail;
+	}
+	if (flock (pack->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno == EWOULDBLOCK)
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_AGAIN, "%s: tile pack is in use by another process", dir);
+		else
+			set_errno_error (error, lock_filename);
+		g_free (lock_filename);
+		goto fail;
+	}
+	g_free (lock_filename);
+
+	if (!create_file (pack->pack_filename, PACK_MAGIC, error))
+		goto fail;
+	pack->created = load_created (dir);
+	if (!g_file_test (pack->index_filename, G_FILE_TEST_EXISTS))
+		rewrite = TRUE;
+
+	pack->mapping = g_mapped_file_new (pack->pack_filename, FALSE, error);
+	if (!pack->mapping)
+		goto fail;
+
+	const gchar *contents = g_mapped_file_get_contents (pack->mapping);
+	gsize size = g_mapped_file_get_length (pack->mapping);
+	if (size < MAGIC_SIZE || memcmp (contents, PACK_MAGIC, MAGIC_SIZE) != 0) {
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: not a tile pack", pack->pack_filename);
+		goto fail;
+	}
+
+	if (!rewrite && !load_index (pack, size, &rewrite, error))
+		goto fail;
+
+	if (recover_records (pack, contents, size, &rewrite) < size) {
+		g_warning ("Truncating damaged tile pack %s at %" G_GUINT64_FORMAT, pack->pack_filename, pack->end);
+
+		g_mapped_file_unref (pack->mapping);
+		pack->mapping = NULL;
+
+		if (truncate (pack->pack_filename, pack->end) != 0) {
+			set_errno_error (error, pack->pack_filename);
+			goto fail;
+		}
+
+		pack->mapping = g_mapped_file_new (pack->pack_filename, FALSE, error);
+		if (!pack->mapping)
+			goto fail;
+	}
+
+	if (rewrite && !write_index (pack, error))
+		goto fail;
+
+	pack->published_end = pack->end;
+
+	pack->pack_file = fopen (pack->pack_filename, "ab");
+	if (!pack->pack_file) {
+		set_errno_error (error, pack->pack_filename);
+		goto fail;
+	}
+
+	pack->index_file = fopen (pack->index_filename, "ab");
+	if (!pack->index_file) {
+		set_errno_error (error, pack->index_filename);
+		goto fail;
+	}
+
+	return pack;
+
+fail:
+	mapius_tile_pack_close (pack);
+	return NULL;
+}
+
+void
+mapius_tile_pack_close (MapiusTilePack *pack)
+{
+	GError *err = NULL;
+
+	if (pack->pack_file && pack->index_file && !mapius_tile_pack_flush (pack, &err)) {
+		g_warning ("Error flushing tile pack: %s", err->message);
+		g_error_free (err);
+	}
+
+	if (pack->pack_file)
+		fclose (pack->pack_file);
+	if (pack->index_file)
+		fclose (pack->index_file);
+	if (pack->mapping)
+		g_mapped_file_unref (pack->mapping);
+	if (pack->lock_fd >= 0)
+		close (pack->lock_fd);
+
+	mapius_tile_table_free (pack->index);
+	g_array_free (pack->entries, TRUE);
+	g_mutex_clear (&pack->lock);
+	g_array_free (pack->unpublished, TRUE);
+	g_free (pack->index_filename);
+	g_free (pack->pack_filename);
+	g_free (pack);
+}
+
+gint64
+mapius_tile_pack_get_created (MapiusTilePack *pack)
+{
+	return pack->created;
+}
+
+guint
+mapius_tile_pack_size (MapiusTilePack *pack)
+{
+	g_mutex_lock (&pack->lock);
+	guint size = mapius_tile_table_size (pack->index);
+	g_mutex_unlock (&pack->lock);
+
+	return size;
+}
+
+static GBytes *
+mapped_bytes (GMappedFile *mapping, guint64 offset, gsize length)
+{
+	return g_bytes_new_with_free_func (
+		g_mapped_file_get_contents (mapping) + offset,
+		length,
+		(GDestroyNotify) g_mapped_file_unref,
+		g_mapped_file_ref (mapping)
+	);
+}
+
+GBytes *
+mapius_tile_pack_lookup (MapiusTilePack *pack, guint zoom, guint x, guint y, GBytes **meta)
+{
+	GBytes *bytes = NULL;
+
+	if (meta)
+		*meta = NULL;
+
+	g_mutex_lock (&pack->lock);
+
+	guint i = GPOINTER_TO_UINT (mapius_tile_table_lookup (pack->index, MAPIUS_TILE_KEY (0, zoom, x, y)));
+	if (i) {
+		PackEntry *entry = &g_array_index (pack->entries, PackEntry, i - 1);
+		guint64 start = entry->offset + sizeof (PackRecord);
+
+		if (start + entry->length <= g_mapped_file_get_length (pack->mapping)) {
+			bytes = mapped_bytes (pack->mapping, start + entry->meta_length, entry->length - entry->meta_length);
+			if (meta && entry->meta_length)
+				*meta = mapped_bytes (pack->mapping, start, entry->meta_length);
+		}
+	}
+
+	g_mutex_unlock (&pack->lock);
+
+	return bytes;
+}
+
+gboolean
+mapius_tile_pack_append (MapiusTilePack *pack, guint zoom, guint x, guint y, GBytes *meta, GBytes *bytes, GError **error)
+{
+	PackRecord record;
+	PackEntry entry;
+	gsize size, meta_size = 0;
+	gconstpointer data = g_bytes_get_data (bytes, &size);
+	gconstpointer meta_data = meta ? g_bytes_get_data (meta, &meta_size) : NULL;
+
+	if (!pack->pack_file) {
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_BADF, "%s: not open for writing", pack->pack_filename);
+		return FALSE;
+	}
+
+	record.key = MAPIUS_TILE_KEY (0, zoom, x, y);
+	record.length = meta_size + size;
+	record.meta_length = meta_size;
+
+	if (fwrite (&record, sizeof (PackRecord), 1, pack->pack_file) != 1
+		|| (meta_size && fwrite (meta_data, meta_size, 1, pack->pack_file) != 1)
+		|| (size && fwrite (data, size, 1, pack->pack_file) != 1)) {
+		set_errno_error (error, pack->pack_filename);
+		return FALSE;
+	}
+
+	entry.key = record.key;
+	entry.offset = pack->end;
+	entry.length = record.length;
+	entry.meta_length = record.meta_length;
+	g_array_append_val (pack->unpublished, entry);
+
+	pack->end += sizeof (PackRecord) + record.length;
+
+	return TRUE;
+}
+
+/* Appends a tombstone for a tile; like an appended record it takes effect
+ * on the next flush. */
+gboolean
+mapius_tile_pack_remove (MapiusTilePack *pack, guint zoom, guint x, guint y, GError **error)
+{
+	PackRecord record;
+	PackEntry entry;
+
+	if (!pack->pack_file) {
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_BADF, "%s: not open for writing", pack->pack_filename);
+		return FALSE;
+	}
+
+	record.key = MAPIUS_TILE_KEY (0, zoom, x, y);
+	record.length = 0;
+	record.meta_length = TOMBSTONE;
+
+	if (fwrite (&record, sizeof (PackRecord), 1, pack->pack_file) != 1) {
+		set_errno_error (error, pack->pack_filename);
+		return FALSE;
+	}
+
+	entry.key = record.key;
+	entry.offset = pack->end;
+	entry.length = record.length;
+	entry.meta_length = record.meta_length;
+	g_array_append_val (pack->unpublished, entry);
+
+	pack->end += sizeof (PackRecord);
+
+	return TRUE;
+}
+
+/* Bytes of published records that are superseded, removed or tombstones,
+ * i.e. what mapius_tile_pack_compact() would reclaim. */
+guint64
+mapius_tile_pack_get_dead_size (MapiusTilePack *pack, guint64 *total)
+{
+	g_mutex_lock (&pack->lock);
+	guint64 size = pack->published_end - MAGIC_SIZE;
+	guint64 dead = size - pack->live_size;
+	g_mutex_unlock (&pack->lock);
+
+	if (total)
+		*total = size;
+
+	return dead;
+}
+
+gboolean
+mapius_tile_pack_flush (MapiusTilePack *pack, GError **error)
+{
+	guint i;
+
+	if (!pack->unpublished->len)
+		return TRUE;
+
+	if (!pack->pack_file || !pack->index_file) {
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_BADF, "%s: not open for writing", pack->pack_filename);
+		return FALSE;
+	}
+
+	if (fflush (pack->pack_file) != 0) {
+		set_errno_error (error, pack->pack_filename);
+		return FALSE;
+	}
+
+	if (fwrite (pack->unpublished->data, sizeof (PackEntry), pack->unpublished->len, pack->index_file) != pack->unpublished->len
+		|| fflush (pack->index_file) != 0) {
+		set_errno_error (error, pack->index_filename);
+		return FALSE;
+	}
+
+	GMappedFile *mapping = g_mapped_file_new (pack->pack_filename, FALSE, error);
+	if (!mapping)
+		return FALSE;
+
+	g_mutex_lock (&pack->lock);
+	g_mapped_file_unref (pack->mapping);
+	pack->mapping = mapping;
+	for (i = 0; i < pack->unpublished->len; i++)
+		add_entry (pack, &g_array_index (pack->unpublished, PackEntry, i));
+	pack->published_end = pack->end;
+	g_mutex_unlock (&pack->lock);
+
+	g_array_set_size (pack->unpublished, 0);
+
+	return TRUE;
+}
+
+void
+mapius_tile_pack_foreach (MapiusTilePack *pack, MapiusTilePackFunc func, gpointer data)
+{
+	guint i;
+
+	g_mutex_lock (&pack->lock);
+	GArray *live = live_entries (pack);
+	g_mutex_unlock (&pack->lock);
+
+	for (i = 0; i < live->len; i++) {
+		PackEntry *entry = &g_array_index (live, PackEntry, i);
+		func (
+			MAPIUS_TILE_KEY_ZOOM (entry->key),
+			MAPIUS_TILE_KEY_X (entry->key),
+			MAPIUS_TILE_KEY_Y (entry->key),
+			entry->length,
+			data
+		);
+	}
+
+	g_array_free (live, TRUE);
+}
+
+gboolean
+mapius_tile_pack_compact (MapiusTilePack *pack, MapiusTilePackFunc keep, gpointer data, GError **error)
+{
+	gchar *tmp_filename = g_strconcat (pack->pack_filename, ".tmp", NULL);
+	GArray *kept = g_array_new (FALSE, FALSE, sizeof (PackEntry));
+	GError *rename_err = NULL;
+	gboolean result = FALSE;
+	guint64 end = MAGIC_SIZE;
+	guint i;
+
+	if (!pack->pack_file || !pack->index_file) {
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_BADF, "%s: not open for writing", pack->pack_filename);
+		goto out;
+	}
+
+	if (!mapius_tile_pack_flush (pack, error))
+		goto out;
+
+	FILE *tmp_file = fopen (tmp_filename, "wb");
+	if (!tmp_file) {
+		set_errno_error (error, tmp_filename);
+		goto out;
+	}
+
+	gboolean written = fwrite (PACK_MAGIC, MAGIC_SIZE, 1, tmp_file) == 1;
+
+	GArray *live = live_entries (pack);
+	const gchar *contents = g_mapped_file_get_contents (pack->mapping);
+
+	for (i = 0; written && i < live->len; i++) {
+		PackEntry *entry = &g_array_index (live, PackEntry, i);
+		guint64 size = sizeof (PackRecord) + entry->length;
+
+		if (!keep (MAPIUS_TILE_KEY_ZOOM (entry->key), MAPIUS_TILE_KEY_X (entry->key), MAPIUS_TILE_KEY_Y (entry->key), entry->length, data))
+			continue;
+
+		written = fwrite (contents + entry->offset, size, 1, tmp_file) == 1;
+		entry->offset = end;
+		g_array_append_val (kept, *entry);
+		end += size;
+	}
+
+	g_array_free (live, TRUE);
+
+	if (fclose (tmp_file) != 0 || !written) {
+		set_errno_error (error, tmp_filename);
+		g_unlink (tmp_filename);
+		goto out;
+	}
+
+	fclose (pack->pack_file);
+	fclose (pack->index_file);
+	pack->pack_file = NULL;
+	pack->index_file = NULL;
+
+	g_unlink (pack->index_filename);
+	if (g_rename (tmp_filename, pack->pack_filename) != 0) {
+		set_errno_error (&rename_err, pack->pack_filename);
+		g_unlink (tmp_filename);
+	}
+
+	GMappedFile *mapping = g_mapped_file_new (pack->pack_filename, FALSE, error);
+	if (!mapping)
+		goto out;
+
+	g_mutex_lock (&pack->lock);
+	g_mapped_file_unref (pack->mapping);
+	pack->mapping = mapping;
+	if (!rename_err) {
+		mapius_tile_table_remove_all (pack->index);
+		g_array_set_size (pack->entries, 0);
+		pack->live_size = 0;
+		for (i = 0; i < kept->len; i++)
+			add_entry (pack, &g_array_index (kept, PackEntry, i));
+		pack->end = end;
+		pack->published_end = end;
+	}
+	g_mutex_unlock (&pack->lock);
+
+	if (!write_index (pack, error))
+		goto out;
+
+	pack->pack_file = fopen (pack->pack_filename, "ab");
+	if (!pack->pack_file) {
+		set_errno_error (error, pack->pack_filename);
+		goto out;
+	}
+
+	pack->index_file = fopen (pack->index_filename, "ab");
+	if (!pack->index_file) {
+		set_errno_error (error, pack->index_filename);
+		goto out;
+	}
+
+	if (rename_err) {
+		g_propagate_error (error, rename_err);
+		rename_err = NULL;
+	}
+	else {
+		result = TRUE;
+	}
+
+out:
+	g_clear_error (&rename_err);
+	g_array_free (kept, TRUE);
+	g_free (tmp_filename);
+
+	return result;
+}
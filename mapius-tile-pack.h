@@ -0,0 +1,21 @@
+#ifndef __MAPIUS_TILE_PACK_H__
+#define __MAPIUS_TILE_PACK_H__
+
+#include <glib.h>
+
+typedef struct _MapiusTilePack MapiusTilePack;
+typedef gboolean (*MapiusTilePackFunc) (guint zoom, guint x, guint y, guint64 size, gpointer data);
+
+MapiusTilePack *mapius_tile_pack_open (const gchar *dir, GError **error);
+void mapius_tile_pack_close (MapiusTilePack *pack);
+gint64 mapius_tile_pack_get_created (MapiusTilePack *pack);
+guint mapius_tile_pack_size (MapiusTilePack *pack);
+GBytes *mapius_tile_pack_lookup (MapiusTilePack *pack, guint zoom, guint x, guint y, GBytes **meta);
+gboolean mapius_tile_pack_append (MapiusTilePack *pack, guint zoom, guint x, guint y, GBytes *meta, GBytes *bytes, GError **error);
+gboolean mapius_tile_pack_remove (MapiusTilePack *pack, guint zoom, guint x, guint y, GError **error);
+gboolean mapius_tile_pack_flush (MapiusTilePack *pack, GError **error);
+guint64 mapius_tile_pack_get_dead_size (MapiusTilePack *pack, guint64 *total);
+void mapius_tile_pack_foreach (MapiusTilePack *pack, MapiusTilePackFunc func, gpointer data);
+gboolean mapius_tile_pack_compact (MapiusTilePack *pack, MapiusTilePackFunc keep, gpointer data, GError **error);
+
+#endif
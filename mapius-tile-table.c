@@ -0,0 +1,216 @@
+#include "mapius-tile-table.h"
+
+#define EMPTY_KEY G_MAXUINT64
+#define INITIAL_SIZE 256
+
+typedef struct
+{
+	MapiusTileKey key;
+	gpointer value;
+} Entry;
+
+struct _MapiusTileTable
+{
+	Entry *entries;
+	guint mask;
+	guint size;
+	GDestroyNotify value_destroy;
+};
+
+static inline guint
+key_hash (MapiusTileKey key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return (guint) key;
+}
+
+static Entry *
+entries_new (guint count)
+{
+	Entry *entries = g_new (Entry, count);
+	guint i;
+
+	for (i = 0; i < count; i++)
+		entries[i].key = EMPTY_KEY;
+
+	return entries;
+}
+
+MapiusTileTable *
+mapius_tile_table_new (GDestroyNotify value_destroy)
+{
+	MapiusTileTable *table = g_new (MapiusTileTable, 1);
+
+	table->entries = entries_new (INITIAL_SIZE);
+	table->mask = INITIAL_SIZE - 1;
+	table->size = 0;
+	table->value_destroy = value_destroy;
+
+	return table;
+}
+
+void
+mapius_tile_table_free (MapiusTileTable *table)
+{
+	mapius_tile_table_remove_all (table);
+	g_free (table->entries);
+	g_free (table);
+}
+
+guint
+mapius_tile_table_size (MapiusTileTable *table)
+{
+	return table->size;
+}
+
+static guint
+find_slot (MapiusTileTable *table, MapiusTileKey key)
+{
+	guint i = key_hash (key) & table->mask;
+
+	while (table->entries[i].key != EMPTY_KEY && table->entries[i].key != key)
+		i = (i + 1) & table->mask;
+
+	return i;
+}
+
+gpointer
+mapius_tile_table_lookup (MapiusTileTable *table, MapiusTileKey key)
+{
+	Entry *entry = &table->entries[find_slot (table, key)];
+
+	return entry->key == key ? entry->value : NULL;
+}
+
+static void
+resize (MapiusTileTable *table, guint count)
+{
+	Entry *old = table->entries;
+	guint old_count = table->mask + 1;
+	guint i;
+
+	table->entries = entries_new (count);
+	table->mask = count - 1;
+
+	for (i = 0; i < old_count; i++) {
+		if (old[i].key != EMPTY_KEY)
+			table->entries[find_slot (table, old[i].key)] = old[i];
+	}
+
+	g_free (old);
+}
+
+void
+mapius_tile_table_insert (MapiusTileTable *table, MapiusTileKey key, gpointer value)
+{
+	g_return_if_fail (key != EMPTY_KEY);
+
+	if ((table->size + 1) * 4 > (table->mask + 1) * 3)
+		resize (table, (table->mask + 1) * 2);
+
+	Entry *entry = &table->entries[find_slot (table, key)];
+	if (entry->key == key) {
+		if (table->value_destroy && entry->value != value)
+			table->value_destroy (entry->value);
+	}
+	else {
+		entry->key = key;
+		table->size++;
+	}
+	entry->value = value;
+}
+
+gpointer
+mapius_tile_table_steal (MapiusTileTable *table, MapiusTileKey key)
+{
+	guint i = find_slot (table, key);
+	guint j, k;
+	gpointer value;
+
+	if (table->entries[i].key != key)
+		return NULL;
+
+	value = table->entries[i].value;
+
+	/* Backward shift deletion keeps probe chains intact without tombstones */
+	j = i;
+	for (;;) {
+		j = (j + 1) & table->mask;
+		if (table->entries[j].key == EMPTY_KEY)
+			break;
+		k = key_hash (table->entries[j].key) & table->mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			table->entries[i] = table->entries[j];
+			i = j;
+		}
+	}
+	table->entries[i].key = EMPTY_KEY;
+	table->size--;
+
+	return value;
+}
+
+gboolean
+mapius_tile_table_remove (MapiusTileTable *table, MapiusTileKey key)
+{
+	guint i = find_slot (table, key);
+
+	if (table->entries[i].key != key)
+		return FALSE;
+
+	gpointer value = mapius_tile_table_steal (table, key);
+	if (table->value_destroy)
+		table->value_destroy (value);
+
+	return TRUE;
+}
+
+void
+mapius_tile_table_remove_all (MapiusTileTable *table)
+{
+	guint i;
+
+	for (i = 0; i <= table->mask; i++) {
+		if (table->entries[i].key != EMPTY_KEY) {
+			if (table->value_destroy)
+				table->value_destroy (table->entries[i].value);
+			table->entries[i].key = EMPTY_KEY;
+		}
+	}
+	table->size = 0;
+}
+
+void
+mapius_tile_table_foreach (MapiusTileTable *table, MapiusTileTableFunc func, gpointer data)
+{
+	guint i;
+
+	for (i = 0; i <= table->mask; i++) {
+		if (table->entries[i].key != EMPTY_KEY)
+			func (table->entries[i].key, table->entries[i].value, data);
+	}
+}
+
+guint
+mapius_tile_table_foreach_remove (MapiusTileTable *table, MapiusTileTableFunc func, gpointer data)
+{
+	GArray *keys = g_array_new (FALSE, FALSE, sizeof (MapiusTileKey));
+	guint i;
+
+	for (i = 0; i <= table->mask; i++) {
+		if (table->entries[i].key != EMPTY_KEY && func (table->entries[i].key, table->entries[i].value, data))
+			g_array_append_val (keys, table->entries[i].key);
+	}
+
+	for (i = 0; i < keys->len; i++)
+		mapius_tile_table_remove (table, g_array_index (keys, MapiusTileKey, i));
+
+	guint removed = keys->len;
+	g_array_free (keys, TRUE);
+
+	return removed;
+}
@@ -0,0 +1,29 @@
+#ifndef __MAPIUS_TILE_TABLE_H__
+#define __MAPIUS_TILE_TABLE_H__
+
+#include <glib.h>
+
+typedef guint64 MapiusTileKey;
+
+#define MAPIUS_TILE_KEY(map, zoom, x, y) \
+	(((guint64) (map) << 53) | ((guint64) (zoom) << 48) | ((guint64) (x) << 24) | (guint64) (y))
+#define MAPIUS_TILE_KEY_MAP(key) ((guint) ((key) >> 53))
+#define MAPIUS_TILE_KEY_ZOOM(key) ((guint) ((key) >> 48) & 0x1f)
+#define MAPIUS_TILE_KEY_X(key) ((guint) ((key) >> 24) & 0xffffff)
+#define MAPIUS_TILE_KEY_Y(key) ((guint) (key) & 0xffffff)
+
+typedef struct _MapiusTileTable MapiusTileTable;
+typedef gboolean (*MapiusTileTableFunc) (MapiusTileKey key, gpointer value, gpointer data);
+
+MapiusTileTable *mapius_tile_table_new (GDestroyNotify value_destroy);
+void mapius_tile_table_free (MapiusTileTable *table);
+guint mapius_tile_table_size (MapiusTileTable *table);
+gpointer mapius_tile_table_lookup (MapiusTileTable *table, MapiusTileKey key);
+void mapius_tile_table_insert (MapiusTileTable *table, MapiusTileKey key, gpointer value);
+gboolean mapius_tile_table_remove (MapiusTileTable *table, MapiusTileKey key);
+gpointer mapius_tile_table_steal (MapiusTileTable *table, MapiusTileKey key);
+void mapius_tile_table_remove_all (MapiusTileTable *table);
+void mapius_tile_table_foreach (MapiusTileTable *table, MapiusTileTableFunc func, gpointer data);
+guint mapius_tile_table_foreach_remove (MapiusTileTable *table, MapiusTileTableFunc func, gpointer data);
+
+#endif
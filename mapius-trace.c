@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "mapius-trace.h"
+
+#define TRACE_HEADER "# mapius trace 1"
+
+struct _MapiusTraceRecorder
+{
+	MapiusMap *map;
+	FILE *file;
+	gint64 start_time;
+	gint width;
+	gint height;
+	gulong handlers[7];
+};
+
+static gchar *
+format_double (gchar *buffer, gdouble value)
+{
+	return g_ascii_formatd (buffer, G_ASCII_DTOSTR_BUF_SIZE, "%.2f", value);
+}
+
+static void
+recorder_write (MapiusTraceRecorder *recorder, const gchar *format, ...)
+{
+	va_list args;
+
+	fprintf (recorder->file, "%u ", (guint) ((g_get_monotonic_time () - recorder->start_time) / 1000));
+	va_start (args, format);
+	vfprintf (recorder->file, format, args);
+	va_end (args);
+	fputc ('\n', recorder->file);
+	fflush (recorder->file);
+}
+
+static void
+record_view (MapiusMap *map, gchar *title, MapiusTraceRecorder *recorder)
+{
+	guint zoom;
+	gint x, y;
+
+	mapius_map_get_view (map, &zoom, &x, &y);
+	recorder_write (recorder, "view %s %u %d %d", mapius_map_get_map_id (map), zoom, x, y);
+}
+
+static void
+record_size (GtkWidget *widget, GdkRectangle *allocation, MapiusTraceRecorder *recorder)
+{
+	if (allocation->width == recorder->width && allocation->height == recorder->height)
+		return;
+
+	recorder->width = allocation->width;
+	recorder->height = allocation->height;
+	recorder_write (recorder, "size %d %d", allocation->width, allocation->height);
+}
+
+static gboolean
+record_button (GtkWidget *widget, GdkEventButton *event, MapiusTraceRecorder *recorder)
+{
+	gchar x[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar y[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (event->type == GDK_BUTTON_PRESS || event->type == GDK_BUTTON_RELEASE) {
+		recorder_write (recorder, "%s %s %s %u %u", event->type == GDK_BUTTON_PRESS ? "press" : "release",
+			format_double (x, event->x), format_double (y, event->y), event->button, event->state);
+	}
+
+	return FALSE;
+}
+
+static gboolean
+record_motion (GtkWidget *widget, GdkEventMotion *event, MapiusTraceRecorder *recorder)
+{
+	gchar x[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar y[G_ASCII_DTOSTR_BUF_SIZE];
+	gdouble event_x = event->x;
+	gdouble event_y = event->y;
+
+	if (event->is_hint) {
+		gint pointer_x, pointer_y;
+		gdk_window_get_device_position (event->window, event->device, &pointer_x, &pointer_y, NULL);
+		event_x = pointer_x;
+		event_y = pointer_y;
+	}
+
+	recorder_write (recorder, "motion %s %s %u", format_double (x, event_x), format_double (y, event_y), event->state);
+
+	return FALSE;
+}
+
+static gboolean
+record_scroll (GtkWidget *widget, GdkEventScroll *event, MapiusTraceRecorder *recorder)
+{
+	gchar x[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar y[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar dx[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar dy[G_ASCII_DTOSTR_BUF_SIZE];
+	gdouble delta_x = 0;
+	gdouble delta_y = 0;
+
+	gdk_event_get_scroll_deltas ((GdkEvent *) event, &delta_x, &delta_y);
+	recorder_write (recorder, "scroll %s %s %u %u %s %s", format_double (x, event->x), format_double (y, event->y),
+		event->direction, event->state, format_double (dx, delta_x), format_double (dy, delta_y));
+
+	return FALSE;
+}
+
+static gboolean
+record_key (GtkWidget *widget, GdkEventKey *event, MapiusTraceRecorder *recorder)
+{
+	recorder_write (recorder, "key %u %u", event->keyval, event->state);
+
+	return FALSE;
+}
+
+MapiusTraceRecorder *
+mapius_trace_recorder_new (MapiusMap *map, const gchar *filename, GError **error)
+{
+	FILE *file = g_fopen (filename, "w");
+	if (!file) {
+		int saved_errno = errno;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno), "%s: %s", filename, g_strerror (saved_errno));
+		return NULL;
+	}
+
+	MapiusTraceRecorder *recorder = g_new0 (MapiusTraceRecorder, 1);
+	recorder->map = g_object_ref (map);
+	recorder->file = file;
+	recorder->start_time = g_get_monotonic_time ();
+
+	fputs (TRACE_HEADER "\n", file);
+	record_view (map, NULL, recorder);
+	if (gtk_widget_get_realized (GTK_WIDGET (map))) {
+		GtkAllocation allocation;
+		gtk_widget_get_allocation (GTK_WIDGET (map), &allocation);
+		record_size (GTK_WIDGET (map), &allocation, recorder);
+	}
+
+	recorder->handlers[0] = g_signal_connect_after (G_OBJECT (map), "map-changed", G_CALLBACK (record_view), recorder);
+	recorder->handlers[1] = g_signal_connect_after (G_OBJECT (map), "size-allocate", G_CALLBACK (record_size), recorder);
+	recorder->handlers[2] = g_signal_connect (G_OBJECT (map), "button-press-event", G_CALLBACK (record_button), recorder);
+	recorder->handlers[3] = g_signal_connect (G_OBJECT (map), "button-release-event", G_CALLBACK (record_button), recorder);
+	recorder->handlers[4] = g_signal_connect (G_OBJECT (map), "motion-notify-event", G_CALLBACK (record_motion), recorder);
+	recorder->handlers[5] = g_signal_connect (G_OBJECT (map), "scroll-event", G_CALLBACK (record_scroll), recorder);
+	recorder->handlers[6] = g_signal_connect (G_OBJECT (map), "key-press-event", G_CALLBACK (record_key), recorder);
+
+	return recorder;
+}
+
+void
+mapius_trace_recorder_free (MapiusTraceRecorder *recorder)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (recorder->handlers); i++) {
+		if (g_signal_handler_is_connected (recorder->map, recorder->handlers[i]))
+			g_signal_handler_disconnect (recorder->map, recorder->handlers[i]);
+	}
+
+	fclose (recorder->file);
+	g_object_unref (recorder->map);
+	g_free (recorder);
+}
+
+static void
+trace_event_free (MapiusTraceEvent *event)
+{
+	g_free (event->map_id);
+	g_free (event);
+}
+
+static gboolean
+parse_double (const gchar *str, gdouble *value)
+{
+	gchar *end;
+
+	*value = g_ascii_strtod (str, &end);
+
+	return end != str && *end == '\0';
+}
+
+static gboolean
+parse_uint (const gchar *str, guint *value)
+{
+	gchar *end;
+
+	guint64 result = g_ascii_strtoull (str, &end, 10);
+	*value = result;
+
+	return end != str && *end == '\0' && result <= G_MAXUINT;
+}
+
+static gboolean
+parse_event (gchar **tokens, MapiusTraceEvent *event)
+{
+	guint n = g_strv_length (tokens);
+	guint width, height;
+
+	if (n < 2 || !parse_uint (tokens[0], &event->time))
+		return FALSE;
+
+	const gchar *kind = tokens[1];
+	gchar **args = tokens + 2;
+	n -= 2;
+
+	if (strcmp (kind, "size") == 0 && n == 2) {
+		event->type = MAPIUS_TRACE_SIZE;
+		if (!parse_uint (args[0], &width) || !parse_uint (args[1], &height) || width > G_MAXINT || height > G_MAXINT)
+			return FALSE;
+		event->width = width;
+		event->height = height;
+		return TRUE;
+	}
+	else if (strcmp (kind, "view") == 0 && n == 4) {
+		event->type = MAPIUS_TRACE_VIEW;
+		event->map_id = g_strdup (args[0]);
+		return parse_uint (args[1], &event->detail) && event->detail <= 24
+			&& parse_double (args[2], &event->x) && parse_double (args[3], &event->y);
+	}
+	else if ((strcmp (kind, "press") == 0 || strcmp (kind, "release") == 0) && n == 4) {
+		event->type = kind[0] == 'p' ? MAPIUS_TRACE_BUTTON_PRESS : MAPIUS_TRACE_BUTTON_RELEASE;
+		return parse_double (args[0], &event->x) && parse_double (args[1], &event->y)
+			&& parse_uint (args[2], &event->detail) && parse_uint (args[3], &event->state);
+	}
+	else if (strcmp (kind, "motion") == 0 && n == 3) {
+		event->type = MAPIUS_TRACE_MOTION;
+		return parse_double (args[0], &event->x) && parse_double (args[1], &event->y)
+			&& parse_uint (args[2], &event->state);
+	}
+	else if (strcmp (kind, "scroll") == 0 && n == 6) {
+		event->type = MAPIUS_TRACE_SCROLL;
+		return parse_double (args[0], &event->x) && parse_double (args[1], &event->y)
+			&& parse_uint (args[2], &event->detail) && event->detail <= GDK_SCROLL_SMOOTH
+			&& parse_uint (args[3], &event->state)
+			&& parse_double (args[4], &event->delta_x) && parse_double (args[5], &event->delta_y);
+	}
+	else if (strcmp (kind, "key") == 0 && n == 2) {
+		event->type = MAPIUS_TRACE_KEY_PRESS;
+		return parse_uint (args[0], &event->detail) && parse_uint (args[1], &event->state);
+	}
+
+	return FALSE;
+}
+
+GPtrArray *
+mapius_trace_load (const gchar *filename, GError **error)
+{
+	gchar *contents;
+	guint i;
+
+	if (!g_file_get_contents (filename, &contents, NULL, error))
+		return NULL;
+
+	GPtrArray *events = g_ptr_array_new_with_free_func ((GDestroyNotify) trace_event_free);
+	gchar **lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	for (i = 0; lines[i]; i++) {
+		g_strstrip (lines[i]);
+		if (lines[i][0] == '\0' || lines[i][0] == '#')
+			continue;
+
+		gchar **tokens = g_strsplit_set (lines[i], " \t", -1);
+		MapiusTraceEvent *event = g_new0 (MapiusTraceEvent, 1);
+		gboolean valid = parse_event (tokens, event);
+		g_strfreev (tokens);
+
+		if (!valid || (events->len && event->time < ((MapiusTraceEvent *) g_ptr_array_index (events, events->len - 1))->time)) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s:%u: bad trace event", filename, i + 1);
+			trace_event_free (event);
+			g_ptr_array_unref (events);
+			g_strfreev (lines);
+			return NULL;
+		}
+
+		g_ptr_array_add (events, event);
+	}
+
+	g_strfreev (lines);
+
+	return events;
+}
+
+void
+mapius_trace_event_dispatch (MapiusTraceEvent *trace_event, MapiusMap *map, guint32 base_time)
+{
+	GtkWidget *widget = GTK_WIDGET (map);
+	GdkSeat *seat = gdk_display_get_default_seat (gtk_widget_get_display (widget));
+	guint32 time = base_time + trace_event->time;
+	GdkEvent *event;
+
+	switch (trace_event->type) {
+	case MAPIUS_TRACE_SIZE:
+		gtk_widget_set_size_request (widget, trace_event->width, trace_event->height);
+		return;
+	case MAPIUS_TRACE_VIEW:
+		if (g_strcmp0 (mapius_map_get_map_id (map), trace_event->map_id) != 0)
+			mapius_map_change_map (map, trace_event->map_id);
+		mapius_map_set_view (map, trace_event->detail, trace_event->x, trace_event->y);
+		return;
+	case MAPIUS_TRACE_BUTTON_PRESS:
+	case MAPIUS_TRACE_BUTTON_RELEASE:
+		event = gdk_event_new (trace_event->type == MAPIUS_TRACE_BUTTON_PRESS ? GDK_BUTTON_PRESS : GDK_BUTTON_RELEASE);
+		event->button.x = trace_event->x;
+		event->button.y = trace_event->y;
+		event->button.button = trace_event->detail;
+		event->button.state = trace_event->state;
+		event->button.time = time;
+		break;
+	case MAPIUS_TRACE_MOTION:
+		event = gdk_event_new (GDK_MOTION_NOTIFY);
+		event->motion.x = trace_event->x;
+		event->motion.y = trace_event->y;
+		event->motion.state = trace_event->state;
+		event->motion.is_hint = FALSE;
+		event->motion.time = time;
+		break;
+	case MAPIUS_TRACE_SCROLL:
+		event = gdk_event_new (GDK_SCROLL);
+		event->scroll.x = trace_event->x;
+		event->scroll.y = trace_event->y;
+		event->scroll.direction = trace_event->detail;
+		event->scroll.state = trace_event->state;
+		event->scroll.delta_x = trace_event->delta_x;
+		event->scroll.delta_y = trace_event->delta_y;
+		event->scroll.time = time;
+		break;
+	case MAPIUS_TRACE_KEY_PRESS:
+		event = gdk_event_new (GDK_KEY_PRESS);
+		event->key.keyval = trace_event->detail;
+		event->key.state = trace_event->state;
+		event->key.time = time;
+		break;
+	default:
+		return;
+	}
+
+	event->any.window = g_object_ref (gtk_widget_get_window (widget));
+	event->any.send_event = TRUE;
+	gdk_event_set_device (event, trace_event->type == MAPIUS_TRACE_KEY_PRESS ? gdk_seat_get_keyboard (seat) : gdk_seat_get_pointer (seat));
+
+	gtk_widget_event (widget, event);
+	gdk_event_free (event);
+}
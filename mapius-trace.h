@@ -0,0 +1,42 @@
+#ifndef __MAPIUS_TRACE_H__
+#define __MAPIUS_TRACE_H__
+
+#include <gtk/gtk.h>
+
+#include "mapius-map.h"
+
+typedef struct _MapiusTraceRecorder MapiusTraceRecorder;
+typedef struct _MapiusTraceEvent MapiusTraceEvent;
+
+typedef enum
+{
+	MAPIUS_TRACE_SIZE,
+	MAPIUS_TRACE_VIEW,
+	MAPIUS_TRACE_BUTTON_PRESS,
+	MAPIUS_TRACE_BUTTON_RELEASE,
+	MAPIUS_TRACE_MOTION,
+	MAPIUS_TRACE_SCROLL,
+	MAPIUS_TRACE_KEY_PRESS
+} MapiusTraceEventType;
+
+struct _MapiusTraceEvent
+{
+	guint32 time;
+	MapiusTraceEventType type;
+	gdouble x;
+	gdouble y;
+	gdouble delta_x;
+	gdouble delta_y;
+	guint state;
+	guint detail;
+	gint width;
+	gint height;
+	gchar *map_id;
+};
+
+MapiusTraceRecorder *mapius_trace_recorder_new (MapiusMap *map, const gchar *filename, GError **error);
+void mapius_trace_recorder_free (MapiusTraceRecorder *recorder);
+GPtrArray *mapius_trace_load (const gchar *filename, GError **error);
+void mapius_trace_event_dispatch (MapiusTraceEvent *event, MapiusMap *map, guint32 base_time);
+
+#endif
@@ -0,0 +1,192 @@
+#include <string.h>
+#include <gio/gio.h>
+
+#include "mapius-url-template.h"
+
+typedef enum
+{
+	SEGMENT_LITERAL,
+	SEGMENT_ZOOM,
+	SEGMENT_X,
+	SEGMENT_Y,
+	SEGMENT_FLIPPED_Y,
+	SEGMENT_SUBDOMAIN,
+	SEGMENT_QUADKEY
+} SegmentType;
+
+typedef struct
+{
+	SegmentType type;
+	const gchar *text;
+	gsize length;
+} Segment;
+
+struct _MapiusUrlTemplate
+{
+	gchar *pattern;
+	GArray *segments;
+	gchar **subdomains;
+	gsize *subdomain_lengths;
+	guint n_subdomains;
+};
+
+static void
+add_segment (MapiusUrlTemplate *tpl, SegmentType type, const gchar *text, gsize length)
+{
+	Segment segment;
+
+	if (type == SEGMENT_LITERAL && length == 0)
+		return;
+
+	segment.type = type;
+	segment.text = text;
+	segment.length = length;
+	g_array_append_val (tpl->segments, segment);
+}
+
+MapiusUrlTemplate *
+mapius_url_template_new (const gchar *pattern, const gchar * const *subdomains, GError **error)
+{
+	MapiusUrlTemplate *tpl = g_new (MapiusUrlTemplate, 1);
+	const gchar *p, *literal;
+	guint i;
+
+	tpl->pattern = g_strdup (pattern);
+	tpl->segments = g_array_new (FALSE, FALSE, sizeof (Segment));
+	tpl->subdomains = g_strdupv ((gchar **) subdomains);
+	tpl->n_subdomains = subdomains ? g_strv_length (tpl->subdomains) : 0;
+	tpl->subdomain_lengths = g_new (gsize, tpl->n_subdomains);
+	for (i = 0; i < tpl->n_subdomains; i++)
+		tpl->subdomain_lengths[i] = strlen (tpl->subdomains[i]);
+
+	literal = p = tpl->pattern;
+	while ((p = strchr (p, '{'))) {
+		const gchar *end = strchr (p, '}');
+		SegmentType type;
+
+		if (!end) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unterminated placeholder in '%s'", pattern);
+			mapius_url_template_free (tpl);
+			return NULL;
+		}
+
+		gsize length = end - p - 1;
+		if (length == 1 && p[1] == 'z')
+			type = SEGMENT_ZOOM;
+		else if (length == 1 && p[1] == 'x')
+			type = SEGMENT_X;
+		else if (length == 1 && p[1] == 'y')
+			type = SEGMENT_Y;
+		else if (length == 2 && strncmp (p + 1, "-y", 2) == 0)
+			type = SEGMENT_FLIPPED_Y;
+		else if (length == 1 && p[1] == 's')
+			type = SEGMENT_SUBDOMAIN;
+		else if (length == 1 && p[1] == 'q')
+			type = SEGMENT_QUADKEY;
+		else {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unknown placeholder '%.*s' in '%s'", (int) length, p + 1, pattern);
+			mapius_url_template_free (tpl);
+			return NULL;
+		}
+
+		if (type == SEGMENT_SUBDOMAIN && tpl->n_subdomains == 0) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No subdomains for '%s'", pattern);
+			mapius_url_template_free (tpl);
+			return NULL;
+		}
+
+		add_segment (tpl, SEGMENT_LITERAL, literal, p - literal);
+		add_segment (tpl, type, NULL, 0);
+		literal = p = end + 1;
+	}
+	add_segment (tpl, SEGMENT_LITERAL, literal, strlen (literal));
+
+	return tpl;
+}
+
+void
+mapius_url_template_free (MapiusUrlTemplate *tpl)
+{
+	g_free (tpl->subdomain_lengths);
+	g_strfreev (tpl->subdomains);
+	g_array_free (tpl->segments, TRUE);
+	g_free (tpl->pattern);
+	g_free (tpl);
+}
+
+static inline void
+put (gchar *buffer, gsize size, gsize *pos, const gchar *text, gsize length)
+{
+	if (*pos < size)
+		memcpy (buffer + *pos, text, MIN (length, size - *pos));
+	*pos += length;
+}
+
+static inline void
+put_number (gchar *buffer, gsize size, gsize *pos, guint value)
+{
+	gchar digits[10];
+	gsize n = sizeof (digits);
+
+	do {
+		digits[--n] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	put (buffer, size, pos, digits + n, sizeof (digits) - n);
+}
+
+gsize
+mapius_url_template_expand (MapiusUrlTemplate *tpl, guint zoom, guint x, guint y, gchar *buffer, gsize size)
+{
+	gsize pos = 0;
+	guint i, j;
+
+	for (i = 0; i < tpl->segments->len; i++) {
+		Segment *segment = &g_array_index (tpl->segments, Segment, i);
+
+		switch (segment->type) {
+		case SEGMENT_LITERAL:
+			put (buffer, size, &pos, segment->text, segment->length);
+			break;
+		case SEGMENT_ZOOM:
+			put_number (buffer, size, &pos, zoom);
+			break;
+		case SEGMENT_X:
+			put_number (buffer, size, &pos, x);
+			break;
+		case SEGMENT_Y:
+			put_number (buffer, size, &pos, y);
+			break;
+		case SEGMENT_FLIPPED_Y:
+			put_number (buffer, size, &pos, (1u << zoom) - 1 - y);
+			break;
+		case SEGMENT_SUBDOMAIN:
+			j = (x + y) % tpl->n_subdomains;
+			put (buffer, size, &pos, tpl->subdomains[j], tpl->subdomain_lengths[j]);
+			break;
+		case SEGMENT_QUADKEY:
+			for (j = zoom; j > 0; j--) {
+				gchar digit = '0' + ((x >> (j - 1)) & 1) + (((y >> (j - 1)) & 1) << 1);
+				put (buffer, size, &pos, &digit, 1);
+			}
+			break;
+		}
+	}
+
+	if (size)
+		buffer[MIN (pos, size - 1)] = '\0';
+
+	return pos;
+}
+
+gchar *
+mapius_url_template_expand_dup (MapiusUrlTemplate *tpl, guint zoom, guint x, guint y)
+{
+	gsize length = mapius_url_template_expand (tpl, zoom, x, y, NULL, 0);
+	gchar *url = g_malloc (length + 1);
+
+	mapius_url_template_expand (tpl, zoom, x, y, url, length + 1);
+
+	return url;
+}
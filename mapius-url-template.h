@@ -0,0 +1,13 @@
+#ifndef __MAPIUS_URL_TEMPLATE_H__
+#define __MAPIUS_URL_TEMPLATE_H__
+
+#include <glib.h>
+
+typedef struct _MapiusUrlTemplate MapiusUrlTemplate;
+
+MapiusUrlTemplate *mapius_url_template_new (const gchar *pattern, const gchar * const *subdomains, GError **error);
+void mapius_url_template_free (MapiusUrlTemplate *tpl);
+gsize mapius_url_template_expand (MapiusUrlTemplate *tpl, guint zoom, guint x, guint y, gchar *buffer, gsize size);
+gchar *mapius_url_template_expand_dup (MapiusUrlTemplate *tpl, guint zoom, guint x, guint y);
+
+#endif
@@ -0,0 +1,53 @@
+#include <string.h>
+
+#include "mapius-util.h"
+
+void
+mapius_make_abs_path (gchar **path)
+{
+	if (!g_path_is_absolute (*path)) {
+		gchar *cur_dir = g_get_current_dir();
+		gchar *abs_path = g_build_filename (cur_dir, *path, NULL);
+		g_free (cur_dir);
+		g_free (*path);
+		*path = abs_path;
+	}
+}
+
+/* Escapes @str for use inside a JSON string literal.  Bytes that are not
+ * valid UTF-8 are emitted as the code point of the same value. */
+gchar *
+mapius_json_escape (const gchar *str)
+{
+	GString *result = g_string_sized_new (strlen (str));
+	const gchar *p = str;
+
+	while (*p) {
+		guchar c = *p;
+
+		if (c == '"' || c == '\\') {
+			g_string_append_c (result, '\\');
+			g_string_append_c (result, c);
+			p++;
+		}
+		else if (c < 0x20) {
+			g_string_append_printf (result, "\\u%04x", c);
+			p++;
+		}
+		else if (c < 0x80) {
+			g_string_append_c (result, c);
+			p++;
+		}
+		else if (g_utf8_get_char_validated (p, -1) <= G_MAXUNICODE) {
+			const gchar *next = g_utf8_next_char (p);
+			g_string_append_len (result, p, next - p);
+			p = next;
+		}
+		else {
+			g_string_append_printf (result, "\\u%04x", c);
+			p++;
+		}
+	}
+
+	return g_string_free (result, FALSE);
+}
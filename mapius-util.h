@@ -0,0 +1,9 @@
+#ifndef __MAPIUS_UTIL_H__
+#define __MAPIUS_UTIL_H__
+
+#include <glib.h>
+
+void mapius_make_abs_path (gchar **path);
+gchar *mapius_json_escape (const gchar *str);
+
+#endif